@@ -0,0 +1,229 @@
+/*******************************************************************************************
+*
+*   bench - End to end timing of the flock step over boid counts, densities and threads
+*
+*   Every configuration starts from the same seeded boids, runs a few untimed steps so the
+*   arenas and search structures have grown, then times every step on its own. Results go
+*   to a tab separated file, one line per configuration, for comparing between releases.
+*
+*   The world grows with the boid count so dispersed boids keep the density of the default
+*   flock. Clumped boids sit in tight clusters inside that world, a sheet is the same world
+*   squashed flat along z.
+*
+*   Options:
+*     --counts=a,b,...          Boid counts, default 1000,10000,100000,1000000
+*     --densities=a,b,...       dispersed, clumped and/or sheet, default all three
+*     --threads=a,b,...         Thread counts, 0 for one per CPU, default 1,0
+*     --steps=n                 Timed steps, default about 1e7 boid-steps, 10 to 200
+*     --fused=on|off            Steer while finding neighbours or from stored lists
+*     --compact=on|off          Search the state packed in 16 bits or in floats
+*     --output=path             Where to write the results, default bench_output.txt
+*
+********************************************************************************************/
+
+#include "flock.h"
+#include "neighbour_kernel.h"
+#include "thread_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define BENCH_MAX_VALUES 16
+#define BENCH_WARMUP_STEPS 5
+
+typedef enum {
+    BENCH_DENSITY_DISPERSED = 0,
+    BENCH_DENSITY_CLUMPED,
+    BENCH_DENSITY_SHEET,
+    BENCH_DENSITY_COUNT
+} BenchDensity;
+
+typedef struct BenchResult {
+    int steps;
+    double stepsPerSecond;
+    double nsPerBoidStep;
+    double p50;                 // Seconds
+    double p99;
+} BenchResult;
+
+static Flock flock = { 0 };
+
+static const char *GetBenchDensityName(BenchDensity density) {
+    switch (density) {
+        case BENCH_DENSITY_CLUMPED: return "clumped";
+        case BENCH_DENSITY_SHEET: return "sheet";
+        default: return "dispersed";
+    }
+}
+
+// Hashes an integer to a float in [-1, 1), so every run starts from the same boids
+static float HashToUnit(unsigned int x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return (float)(x >> 8)/8388608.0f - 1.0f;
+}
+
+// Bounds of the default flock, grown so count boids spread through them at its density
+static void InitBenchFlock(int count, BenchDensity density) {
+    float scale = cbrtf((float)count/DEFAULT_BOID_COUNT);
+    InitFlock(&flock, count, 50.0f*scale, 10.0f*scale, 10.0f*scale);
+
+    // Clusters of about 2000 boids, roughly gaussian from the sum of three uniforms
+    int clusterCount = (count + 1999)/2000;
+    float spread = 4.0f/3.0f;
+
+    for (int i = 0; i < count; i++) {
+        unsigned int seed = 16*(unsigned int)i;
+        float x = flock.boundsX*HashToUnit(seed);
+        float y = flock.boundsY*HashToUnit(seed + 1);
+        float z = flock.boundsZ*HashToUnit(seed + 2);
+
+        if (density == BENCH_DENSITY_CLUMPED) {
+            unsigned int cluster = 8*(unsigned int)(i%clusterCount) + 0x9e3779b9U;
+            x = flock.boundsX*HashToUnit(cluster) + spread*(HashToUnit(seed) + HashToUnit(seed + 6) + HashToUnit(seed + 7));
+            y = flock.boundsY*HashToUnit(cluster + 1) + spread*(HashToUnit(seed + 1) + HashToUnit(seed + 8) + HashToUnit(seed + 9));
+            z = flock.boundsZ*HashToUnit(cluster + 2) + spread*(HashToUnit(seed + 2) + HashToUnit(seed + 10) + HashToUnit(seed + 11));
+        }
+        else if (density == BENCH_DENSITY_SHEET) z = 0.25f*HashToUnit(seed + 2);
+
+        flock.positionX[i] = x;
+        flock.positionY[i] = y;
+        flock.positionZ[i] = z;
+        flock.velocityX[i] = 2.0f*HashToUnit(seed + 3);
+        flock.velocityY[i] = 2.0f*HashToUnit(seed + 4);
+        flock.velocityZ[i] = 2.0f*HashToUnit(seed + 5);
+    }
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static BenchResult RunBench(int steps) {
+    double *stepTimes = (double *)calloc(steps, sizeof(double));
+    double totalTime = 0.0;
+    BenchResult result = { 0 };
+
+    for (int step = 0; step < BENCH_WARMUP_STEPS; step++) UpdateFlock(&flock, 1.0f/60.0f);
+    for (int step = 0; step < steps; step++) {
+        double start = GetWallTime();
+        UpdateFlock(&flock, 1.0f/60.0f);
+        stepTimes[step] = GetWallTime() - start;
+        totalTime += stepTimes[step];
+    }
+
+    qsort(stepTimes, steps, sizeof(double), CompareDoubles);
+    result.steps = steps;
+    result.stepsPerSecond = steps/totalTime;
+    result.nsPerBoidStep = 1e9*totalTime/((double)steps*flock.count);
+    result.p50 = stepTimes[steps/2];
+    result.p99 = stepTimes[(int)(0.99*(steps - 1))];
+    free(stepTimes);
+
+    return result;
+}
+
+// Comma separated integers, returns how many were read
+static int ParseList(const char *text, int *values) {
+    int count = 0;
+
+    while ((*text != '\0') && (count < BENCH_MAX_VALUES)) {
+        values[count++] = atoi(text);
+        const char *comma = strchr(text, ',');
+        if (comma == NULL) break;
+        text = comma + 1;
+    }
+
+    return count;
+}
+
+static int ParseDensities(const char *text, int *densities) {
+    int count = 0;
+
+    for (int d = 0; d < BENCH_DENSITY_COUNT; d++) {
+        if (strstr(text, GetBenchDensityName((BenchDensity)d)) != NULL) densities[count++] = d;
+    }
+
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    int counts[BENCH_MAX_VALUES] = { 1000, 10000, 100000, 1000000 };
+    int countCount = 4;
+    int densities[BENCH_DENSITY_COUNT] = { BENCH_DENSITY_DISPERSED, BENCH_DENSITY_CLUMPED, BENCH_DENSITY_SHEET };
+    int densityCount = BENCH_DENSITY_COUNT;
+    int threads[BENCH_MAX_VALUES] = { 1, 0 };
+    int threadCount = 2;
+    int fixedSteps = 0;
+    bool fusedSteering = false;
+    bool compactState = false;
+    const char *outputPath = "bench_output.txt";
+
+    for (int a = 1; a < argc; a++) {
+        if (strncmp(argv[a], "--counts=", 9) == 0) countCount = ParseList(argv[a] + 9, counts);
+        else if (strncmp(argv[a], "--densities=", 12) == 0) densityCount = ParseDensities(argv[a] + 12, densities);
+        else if (strncmp(argv[a], "--threads=", 10) == 0) threadCount = ParseList(argv[a] + 10, threads);
+        else if (strncmp(argv[a], "--steps=", 8) == 0) fixedSteps = atoi(argv[a] + 8);
+        else if (strcmp(argv[a], "--fused=on") == 0) fusedSteering = true;
+        else if (strcmp(argv[a], "--fused=off") == 0) fusedSteering = false;
+        else if (strcmp(argv[a], "--compact=on") == 0) compactState = true;
+        else if (strcmp(argv[a], "--compact=off") == 0) compactState = false;
+        else if (strncmp(argv[a], "--output=", 9) == 0) outputPath = argv[a] + 9;
+        else fprintf(stderr, "bench: unknown argument %s\n", argv[a]);
+    }
+
+    FILE *output = fopen(outputPath, "w");
+    if (output == NULL) {
+        fprintf(stderr, "bench: could not open %s\n", outputPath);
+        return 1;
+    }
+
+    InitNeighbourKernel();
+    InitFlock(&flock, 1, 1.0f, 1.0f, 1.0f);
+    fprintf(output, "# kernel %s, search %s, %s steering, %s state, %d CPUs\n", GetNeighbourKernelName(GetNeighbourKernel()),
+            GetNeighbourSearchName(flock.neighbourSearch), (fusedSteering)? "fused" : "separate", (compactState)? "compact" : "float",
+            GetCpuCount());
+    fprintf(output, "boids\tdensity\tthreads\tsteps\tsteps_per_sec\tns_per_boid_step\tp50_ms\tp99_ms\n");
+    UnloadFlock(&flock);
+
+    for (int t = 0; t < threadCount; t++) {
+        ThreadPool pool = { 0 };
+        InitThreadPool(&pool, threads[t]);
+
+        // One per CPU is often the same as a count already run
+        bool repeated = false;
+        for (int u = 0; u < t; u++) repeated |= (((threads[u] > 0)? threads[u] : GetCpuCount()) == pool.threadCount);
+
+        for (int c = 0; (c < countCount) && !repeated; c++) {
+            for (int d = 0; d < densityCount; d++) {
+                int steps = (fixedSteps > 0)? fixedSteps : (int)fminf(200.0f, fmaxf(10.0f, 1e7f/counts[c]));
+
+                InitBenchFlock(counts[c], (BenchDensity)densities[d]);
+                flock.fusedSteering = fusedSteering;
+                flock.compactState = compactState;
+                flock.threadPool = &pool;
+                BenchResult result = RunBench(steps);
+                UnloadFlock(&flock);
+
+                fprintf(output, "%d\t%s\t%d\t%d\t%.3f\t%.3f\t%.3f\t%.3f\n", counts[c], GetBenchDensityName((BenchDensity)densities[d]),
+                        pool.threadCount, result.steps, result.stepsPerSecond, result.nsPerBoidStep, 1000.0*result.p50, 1000.0*result.p99);
+                fflush(output);
+                printf("%8d boids %-9s %2d threads: %10.2f steps/s %9.1f ns/boid-step, p50 %9.3f ms, p99 %9.3f ms\n", counts[c],
+                       GetBenchDensityName((BenchDensity)densities[d]), pool.threadCount, result.stepsPerSecond, result.nsPerBoidStep,
+                       1000.0*result.p50, 1000.0*result.p99);
+            }
+        }
+
+        UnloadThreadPool(&pool);
+    }
+
+    fclose(output);
+    return 0;
+}
@@ -17,7 +17,7 @@ PROJECT_VERSION=1.0 ^
 PROJECT_DESCRIPTION="Watching birds" ^
 PROJECT_INTERNAL_NAME=birdwatching ^
 PROJECT_PLATFORM=PLATFORM_DESKTOP ^
-PROJECT_SOURCE_FILES="birdwatching.c" ^
+PROJECT_SOURCE_FILES="birdwatching.c spatial_grid.c flock.c neighbour_kernel.c octree.c thread_pool.c simulation.c arena.c frame_timer.c trace.c rng.c flock_file.c recorder.c trajectory_codec.c" ^
 BUILD_MODE="RELEASE" ^
 BUILD_WEB_ASYNCIFY=FALSE ^
 BUILD_WEB_MIN_SHELL=TRUE ^
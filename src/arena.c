@@ -0,0 +1,187 @@
+/*******************************************************************************************
+*
+*   arena - Bump allocated memory from one up-front reservation
+*
+********************************************************************************************/
+
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+#elif !defined(__EMSCRIPTEN__)
+    #include <sys/mman.h>
+    #define ARENA_VIRTUAL_MEMORY
+#endif
+
+static size_t RoundUp(size_t value, size_t multiple) {
+    return (value + multiple - 1)/multiple*multiple;
+}
+
+// Address space only, returns NULL when not even that is available
+static unsigned char *ReserveMemory(size_t size) {
+#if defined(_WIN32)
+    return (unsigned char *)VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+#elif defined(ARENA_VIRTUAL_MEMORY)
+    void *memory = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return (memory != MAP_FAILED)? (unsigned char *)memory : NULL;
+#else
+    return (unsigned char *)calloc(1, size);
+#endif
+}
+
+static void ReleaseMemory(unsigned char *memory, size_t size) {
+#if defined(_WIN32)
+    VirtualFree(memory, 0, MEM_RELEASE);
+#elif defined(ARENA_VIRTUAL_MEMORY)
+    munmap(memory, size);
+#else
+    free(memory);
+#endif
+}
+
+static bool CommitMemory(unsigned char *memory, size_t size) {
+#if defined(_WIN32)
+    return (VirtualAlloc(memory, size, MEM_COMMIT, PAGE_READWRITE) != NULL);
+#elif defined(ARENA_VIRTUAL_MEMORY)
+    return (mprotect(memory, size, PROT_READ | PROT_WRITE) == 0);
+#else
+    return true;
+#endif
+}
+
+// Halves the reservation until the address space can be had
+Arena LoadArena(size_t reserve) {
+    Arena arena = { 0 };
+
+    reserve = RoundUp((reserve > 0)? reserve : 1, ARENA_COMMIT_GRANULE);
+    while ((arena.base = ReserveMemory(reserve)) == NULL && (reserve > ARENA_COMMIT_GRANULE)) {
+        reserve = RoundUp(reserve/2, ARENA_COMMIT_GRANULE);
+    }
+    arena.reserved = (arena.base != NULL)? reserve : 0;
+
+    return arena;
+}
+
+void UnloadArena(Arena *arena) {
+    if (arena->base != NULL) ReleaseMemory(arena->base, arena->reserved);
+    *arena = (Arena){ 0 };
+}
+
+// Everything allocated so far is dropped, the committed memory stays for the next round
+void ResetArena(Arena *arena) {
+    arena->used = 0;
+    arena->abandoned = 0;
+    for (int t = 0; t < ARENA_TAG_COUNT; t++) arena->tagBytes[t] = 0;
+}
+
+// Makes sure the first end bytes are backed by memory
+static bool CommitArena(Arena *arena, size_t end) {
+    if (end <= arena->committed) return true;
+
+    size_t committed = RoundUp(end, ARENA_COMMIT_GRANULE);
+    if (committed > arena->reserved) committed = arena->reserved;
+    if (!CommitMemory(arena->base + arena->committed, committed - arena->committed)) return false;
+
+    arena->committed = committed;
+    return true;
+}
+
+// Moves the bump offset to end, false when the reservation is used up
+static bool ExtendArena(Arena *arena, size_t end) {
+    if ((end > arena->reserved) || !CommitArena(arena, end)) return false;
+
+    // Memory past the peak has never been handed out and is still zero
+    size_t start = arena->used;
+    if (start < arena->peak) memset(arena->base + start, 0, ((end < arena->peak)? end : arena->peak) - start);
+
+    arena->used = end;
+    arena->peak = (end > arena->peak)? end : arena->peak;
+    return true;
+}
+
+// No caller has anything sensible to do without its memory, so running out stops the program
+// here, naming what the memory was for, rather than at a write through NULL somewhere later
+static void FailArenaAlloc(const Arena *arena, size_t size, ArenaTag tag) {
+    if (arena == NULL) fprintf(stderr, "ARENA: Out of memory: %zu bytes of %s from the heap\n", size, GetArenaTagName(tag));
+    else {
+        fprintf(stderr, "ARENA: Out of memory: %zu bytes of %s, %zu of %zu reserved bytes used\n", size, GetArenaTagName(tag),
+                arena->used, arena->reserved);
+    }
+    abort();
+}
+
+// Zeroed and ARENA_ALIGNMENT aligned. Aborts once the reservation is used up.
+void *ArenaAlloc(Arena *arena, size_t size, ArenaTag tag) {
+    if (arena == NULL) {
+        void *buffer = calloc(1, (size > 0)? size : 1);
+        if (buffer == NULL) FailArenaAlloc(arena, size, tag);
+        return buffer;
+    }
+
+    size_t used = arena->used;
+    size_t start = RoundUp(used, ARENA_ALIGNMENT);
+    if ((arena->base == NULL) || !ExtendArena(arena, start + size)) FailArenaAlloc(arena, size, tag);
+
+    arena->abandoned += start - used;
+    arena->tagBytes[tag] += size;
+    return arena->base + start;
+}
+
+static bool IsLastAllocation(const Arena *arena, const void *buffer, size_t size) {
+    return ((const unsigned char *)buffer + size == arena->base + arena->used);
+}
+
+// Keeps the first oldSize bytes. The newest allocation grows in place, anything else is
+// copied to the end and its old bytes are abandoned. Bytes past oldSize are zero in an arena
+// and undefined on the heap, like realloc(). Aborts once the reservation is used up.
+void *ArenaGrow(Arena *arena, void *buffer, size_t oldSize, size_t newSize, ArenaTag tag) {
+    if (arena == NULL) {
+        void *grown = realloc(buffer, (newSize > 0)? newSize : 1);
+        if (grown == NULL) FailArenaAlloc(arena, newSize, tag);
+        return grown;
+    }
+    if (buffer == NULL) return ArenaAlloc(arena, newSize, tag);
+    if (newSize <= oldSize) return buffer;
+
+    if (IsLastAllocation(arena, buffer, oldSize)) {
+        if (!ExtendArena(arena, arena->used + (newSize - oldSize))) FailArenaAlloc(arena, newSize, tag);
+        arena->tagBytes[tag] += newSize - oldSize;
+        return buffer;
+    }
+
+    void *grown = ArenaAlloc(arena, newSize, tag);
+    memcpy(grown, buffer, oldSize);
+    ArenaFree(arena, buffer, oldSize, tag);
+    return grown;
+}
+
+// Only the newest allocation gives its bytes back, anything else is abandoned until the
+// arena is reset or unloaded
+void ArenaFree(Arena *arena, void *buffer, size_t size, ArenaTag tag) {
+    if (arena == NULL) {
+        free(buffer);
+        return;
+    }
+    if (buffer == NULL) return;
+
+    arena->tagBytes[tag] -= size;
+    if (IsLastAllocation(arena, buffer, size)) arena->used -= size;
+    else arena->abandoned += size;
+}
+
+const char *GetArenaTagName(ArenaTag tag) {
+    switch (tag) {
+        case ARENA_TAG_STATE: return "boid state";
+        case ARENA_TAG_NEIGHBOUR_SEARCH: return "neighbour search";
+        case ARENA_TAG_NEIGHBOUR_LISTS: return "neighbour lists";
+        case ARENA_TAG_SNAPSHOTS: return "snapshots";
+        case ARENA_TAG_SCRATCH: return "scratch";
+        default: return "unknown";
+    }
+}
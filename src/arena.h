@@ -0,0 +1,69 @@
+/*******************************************************************************************
+*
+*   arena - Bump allocated memory from one up-front reservation
+*
+*   LoadArena() reserves address space once and commits it a granule at a time as the bump
+*   offset passes, so reserving far more than will ever be used costs nothing. Allocations
+*   are never moved or freed one by one: a buffer that grows is copied to the end of the
+*   arena and its old bytes are abandoned, which buffers that double bound to their size
+*   again. ResetArena() drops everything at once, for scratch that only lives for one step.
+*
+*   Every allocation carries a tag, the arena keeps the live bytes of each so the footprint
+*   of a subsystem can be read off exactly.
+*
+*   Passing a NULL arena allocates from the heap instead, for structures used on their own.
+*
+*   Running out of the reservation, or of heap, is fatal: the allocation logs how many bytes
+*   of which tag it wanted to stderr and aborts. Nothing that allocates checks for NULL.
+*
+*   Targets without virtual memory (web) allocate the whole reservation up front, so it is
+*   kept small there.
+*
+********************************************************************************************/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_ALIGNMENT 64              // Bytes, a cache line and the widest vector
+#define ARENA_COMMIT_GRANULE (1 << 20)  // Bytes committed at a time
+
+#if defined(__EMSCRIPTEN__) || (SIZE_MAX <= 0xFFFFFFFFu)
+    #define ARENA_DEFAULT_RESERVE ((size_t)32 << 20)
+#else
+    #define ARENA_DEFAULT_RESERVE ((size_t)64 << 30)
+#endif
+
+// What an allocation is for, footprints are reported per tag
+typedef enum {
+    ARENA_TAG_STATE = 0,            // Positions, velocities, ids and slots
+    ARENA_TAG_NEIGHBOUR_SEARCH,     // Grids, octree, Verlet lists and the packed copies
+    ARENA_TAG_NEIGHBOUR_LISTS,      // Stored neighbour lists of unfused steering
+    ARENA_TAG_SNAPSHOTS,            // State published for rendering
+    ARENA_TAG_SCRATCH,              // Per-step temporaries
+    ARENA_TAG_COUNT
+} ArenaTag;
+
+typedef struct Arena {
+    unsigned char *base;
+    size_t reserved;                // Address space held
+    size_t committed;               // Bytes backed by memory
+    size_t used;                    // Bump offset
+    size_t peak;                    // Largest used since loading, kept by ResetArena()
+    size_t abandoned;               // Bytes of buffers freed or grown out of, back only on reset
+    size_t tagBytes[ARENA_TAG_COUNT];   // Live bytes of every tag
+} Arena;
+
+Arena LoadArena(size_t reserve);
+void UnloadArena(Arena *arena);
+void ResetArena(Arena *arena);
+
+void *ArenaAlloc(Arena *arena, size_t size, ArenaTag tag);
+void *ArenaGrow(Arena *arena, void *buffer, size_t oldSize, size_t newSize, ArenaTag tag);
+void ArenaFree(Arena *arena, void *buffer, size_t size, ArenaTag tag);
+
+const char *GetArenaTagName(ArenaTag tag);
+
+#endif // ARENA_H
@@ -12,27 +12,79 @@
 #include "raylib.h"
 #include "raymath.h"
 
+#include "flock.h"
+#include "neighbour_kernel.h"
+#include "thread_pool.h"
+#include "simulation.h"
+#include "frame_timer.h"
+#include "trace.h"
+#include "rng.h"
+#include "flock_file.h"
+#include "recorder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
 #if defined(PLATFORM_WEB)
     #include <emscripten/emscripten.h>
 #endif
 
-#define MAX_BOIDS 600
-#define MAX_NEIGHBOURS 30
-
-typedef struct {
-    Vector3 position;
-    Vector3 velocity;
-    int neighbourBoidIndexes[MAX_NEIGHBOURS];
-} Boid;
-
 //----------------------------------------------------------------------------------
 // Local Variables Definition (local to this module)
 //----------------------------------------------------------------------------------
 Camera camera = { 0 };
 Vector3 cubePosition = { 0 };
-int numBoids = MAX_BOIDS;
-int maxNeighbours = MAX_NEIGHBOURS;
-Boid boids[MAX_BOIDS] = { 0 };
+int numBoids = DEFAULT_BOID_COUNT;    // Grown and shrunk at runtime with + and -
+Flock flock = { 0 };
+ThreadPool threadPool = { 0 };
+int threadCount = 0;                // 0 runs one thread per CPU
+ThreadPoolSchedule threadSchedule = THREAD_POOL_WORK_STEALING;
+bool scalingReport = false;
+bool footprintReport = false;
+bool compactReport = false;
+int headlessSteps = 0;              // Steps to run without a window, 0 opens one
+const char *dumpPath = NULL;        // Where a headless run writes the final state, NULL for nowhere
+
+// Starting state, the same seed gives the same run
+unsigned long long seed = 0;        // 0 picks one from the clock
+Rng rng = { 0 };
+const char *checksumPath = NULL;    // Where to write state checksums, NULL for nowhere
+int checksumInterval = 1;           // Steps between checksums
+FILE *checksumFile = NULL;
+const char *loadPath = NULL;        // Flock file to start from instead of a random scatter
+const char *savePath = NULL;        // Where to save the flock on exit
+const char *recordPath = NULL;      // Where to stream every step's positions, NULL for nowhere
+int recordSlabs = RECORDER_DEFAULT_SLABS;
+int recordBits = TRAJECTORY_DEFAULT_BITS;   // 0 records floats
+int recordKeyframes = TRAJECTORY_DEFAULT_KEYFRAME_INTERVAL;
+const char *recordingReportPath = NULL; // Recording to decode and time, NULL for none
+Recorder recorder = { 0 };
+
+// Fixed timestep, stepped on its own thread and drawn from snapshots
+Simulation simulation = { 0 };
+float simulationHz = 60.0f;
+int maxCatchUpSteps = 8;            // Catch-up cap, past it the simulation runs slow instead
+bool simulationThread = true;
+
+// Phases of a frame, timed for the overlay
+typedef enum {
+    FRAME_PHASE_SIMULATE = 0,       // Steps run here without a simulation thread, and taking the snapshot
+    FRAME_PHASE_SPHERES,
+    FRAME_PHASE_SCENE,              // The plane, FPS and overlay
+    FRAME_PHASE_GRAIN,
+    FRAME_PHASE_PRESENT,            // Swapping buffers, which waits for the next frame
+    FRAME_PHASE_COUNT
+} FramePhase;
+
+// Frames and simulation steps are always timed, F3 shows the times next to the FPS
+FrameTimer frameTimer = { 0 };
+FrameTimer stepTimer = { 0 };
+int timedStep = 0;                  // Last step whose phase times went into stepTimer
+bool showTimings = false;
+const char *tracePath = NULL;       // Where to write a Chrome trace, NULL for no tracing
+int traceEvents = TRACE_DEFAULT_EVENTS;
 
 // Shader
 float timeCounter = 0.0f;
@@ -52,24 +104,79 @@ Vector3 worldBounds = {
 //----------------------------------------------------------------------------------
 static void UpdateDrawFrame(void);          // Update and draw one frame
 static void InitBoids(void);
-static void UpdateBoidNeighbours(void);
-static void KeepWithinBounds(void);
-static void SteerSeparation(void);
-static void SteerAlignment(void);
-static void SteerCohesion(void);
-static void ConstrainSpeed(void);
-static void UpdateBoidPosition(void);
+static void LoadBoids(void);
+static void SaveBoids(void);
+static void ParseArguments(int argc, char *argv[]);
+static void ReportThreadScaling(void);
+static void LogThreadPoolStats(const ThreadPool *pool);
+static void ReportFootprint(void);
+static void ReportCompactState(void);
+static void ReportRecording(void);
+static void RunHeadless(void);
+static bool DumpFlockState(const Flock *flock, const char *path);
+static size_t GetFlockFootprint(const Flock *flock);
+static void LogFlockFootprint(const Flock *flock);
+static void InitTimers(void);
+static void StartTracing(void);
+static void StopTracing(void);
+static void StartChecksums(void);
+static void WriteChecksum(const Flock *flock);
+static void StopChecksums(void);
+static void StartRecording(void);
+static void StopRecording(void);
+static void AfterFlockStep(const Flock *flock, void *context);
+static void LogFrameTimer(const FrameTimer *timer, const char *title);
+static int DrawFrameTimer(const FrameTimer *timer, const char *title, int x, int y);
 
 //----------------------------------------------------------------------------------
 // Main entry point
 //----------------------------------------------------------------------------------
-int main()
+int main(int argc, char *argv[])
 {
     // Initialization
     //--------------------------------------------------------------------------------------
     const int screenWidth = 1920;
     const int screenHeight = 1080;
 
+    InitFlock(&flock, numBoids, worldBounds.x, worldBounds.y, worldBounds.z);
+    ParseArguments(argc, argv);
+    StartTracing();
+    ResizeFlock(&flock, numBoids);
+    if (seed == 0) seed = (unsigned long long)time(NULL);
+    SeedRng(&rng, seed);
+    if (loadPath != NULL) LoadBoids();
+    else InitBoids();
+    StartChecksums();
+    StartRecording();
+    InitThreadPool(&threadPool, threadCount);
+    InitTimers();
+    threadPool.schedule = threadSchedule;
+    flock.threadPool = &threadPool;
+    TraceLog(LOG_INFO, "BOIDS: Neighbour kernel: %s", GetNeighbourKernelName(GetNeighbourKernel()));
+    TraceLog(LOG_INFO, "BOIDS: Neighbour search: %s, %d %s", GetNeighbourSearchName(flock.neighbourSearch),
+             flock.neighbourLimit, GetNeighbourSelectionName(flock.neighbourSelection));
+    TraceLog(LOG_INFO, "BOIDS: Steering: %s, %s state", (flock.fusedSteering)? "fused" : "separate passes",
+             (flock.compactState)? "compact" : "float");
+    TraceLog(LOG_INFO, "BOIDS: Boids: %d, seed %llu", flock.count, seed);
+    TraceLog(LOG_INFO, "BOIDS: Threads: %d, %s", threadPool.threadCount, GetThreadPoolScheduleName(threadPool.schedule));
+    TraceLog(LOG_INFO, "BOIDS: Simulation: %.1f Hz, up to %d steps to catch up", simulationHz, maxCatchUpSteps);
+
+    // Nothing to draw, the reports and headless runs need no window or GL context
+    if (scalingReport || footprintReport || compactReport || (recordingReportPath != NULL) || (headlessSteps > 0)) {
+        if (scalingReport) ReportThreadScaling();
+        if (footprintReport) ReportFootprint();
+        if (compactReport) ReportCompactState();
+        if (recordingReportPath != NULL) ReportRecording();
+        if (headlessSteps > 0) RunHeadless();
+        StopChecksums();
+        StopRecording();
+        SaveBoids();
+        UnloadFlock(&flock);
+        UnloadThreadPool(&threadPool);
+        StopTracing();
+        return 0;
+    }
+
     InitWindow(screenWidth, screenHeight, "raylib - birdwatching");
     SetWindowState(FLAG_WINDOW_RESIZABLE);
 
@@ -79,14 +186,16 @@ int main()
     float grainIntensity = 0.1f;
     float timeCounter = 0.0f;
 
-    InitBoids();
-
     camera.position = (Vector3){ 0.0f, -20.0f, 50.0f };
     camera.target = (Vector3){ 0.0f, 0.0f, 0.0f };
     camera.up = (Vector3){ 0.0f, 1.0f, 0.0f };
     camera.fovy = 60.0f;
     camera.projection = CAMERA_PERSPECTIVE;
 
+    // From here on only the simulation touches the flock, drawing reads its snapshots
+    StartSimulation(&simulation, &flock, simulationHz, maxCatchUpSteps, simulationThread);
+    TraceLog(LOG_INFO, "BOIDS: Simulation thread: %s", (simulation.threaded)? "on" : "off");
+
 #if defined(PLATFORM_WEB)
     emscripten_set_main_loop(UpdateDrawFrame, 60, 1);
 #else
@@ -102,6 +211,18 @@ int main()
 
     // De-Initialization
     //--------------------------------------------------------------------------------------
+    StopSimulation(&simulation);
+    StopChecksums();
+    StopRecording();
+    SaveBoids();
+    LogThreadPoolStats(&threadPool);
+    LogFlockFootprint(&flock);
+    LogFrameTimer(&frameTimer, "Frame");
+    LogFrameTimer(&stepTimer, "Step");
+    UnloadSimulation(&simulation);
+    UnloadFlock(&flock);
+    UnloadThreadPool(&threadPool);
+    StopTracing();
     UnloadShader(grainShader);
     UnloadRenderTexture(target);
     CloseWindow();                  // Close window and OpenGL context
@@ -110,204 +231,602 @@ int main()
     return 0;
 }
 
+// Random scatter inside the world bounds
 static void InitBoids(void) {
     for (int i = 0; i < numBoids; i++) {
-        boids[i].position.x = GetRandomValue(- worldBounds.x,  worldBounds.x);
-        boids[i].position.y = GetRandomValue(- worldBounds.y,  worldBounds.y);
-        boids[i].position.z = GetRandomValue(-worldBounds.z, worldBounds.z);
-        boids[i].velocity.x = GetRandomValue(-1.0, 1.0);
-        boids[i].velocity.y = GetRandomValue(-1.0, 1.0);
-        boids[i].velocity.z = GetRandomValue(-1.0, 1.0);
-
-        // Reset neighbours
-        for (int y = 0; y < maxNeighbours; y++) {
-            boids[i].neighbourBoidIndexes[y] = -1;
-        }
+        flock.positionX[i] = NextRngInt(&rng, -(int)worldBounds.x, (int)worldBounds.x);
+        flock.positionY[i] = NextRngInt(&rng, -(int)worldBounds.y, (int)worldBounds.y);
+        flock.positionZ[i] = NextRngInt(&rng, -(int)worldBounds.z, (int)worldBounds.z);
+        flock.velocityX[i] = NextRngInt(&rng, -1, 1);
+        flock.velocityY[i] = NextRngInt(&rng, -1, 1);
+        flock.velocityZ[i] = NextRngInt(&rng, -1, 1);
     }
 }
 
-static void UpdateBoidNeighbours(void) {
-    for (int i = 0; i < numBoids; i++) {
-        // Reset neighbours
-        for (int y = 0; y < maxNeighbours; y++) {
-            boids[i].neighbourBoidIndexes[y] = -1;
-        }
-
-        int neighbourIndex = 0;
-		for (int y = 0; y < numBoids; y++) {
-            if (i == y) {
-                continue;
-            }
+// Replaces the flock with the saved one, the search and threading flags given still apply.
+// Falls back to the random scatter when the file cannot be loaded.
+static void LoadBoids(void) {
+    double start = GetWallTime();
+    FlockFileResult result = LoadFlockFile(&flock, &rng, loadPath);
 
-            float distance = Vector3Distance(boids[i].position, boids[y].position);
-            if (distance < 5.0f) {
-                // Check alignment using dot product
-                if (Vector3DotProduct(boids[i].velocity, boids[y].velocity) > 0) {
-					boids[i].neighbourBoidIndexes[neighbourIndex] = y;
-					neighbourIndex++;
-                }
-
-                if (neighbourIndex == 10) {
-                    break;
-                }
-            }
-		}
+    if (result != FLOCK_FILE_OK) {
+        TraceLog(LOG_WARNING, "BOIDS: Could not load %s: %s", loadPath, GetFlockFileResultName(result));
+        InitBoids();
+        return;
     }
+
+    numBoids = flock.count;
+    TraceLog(LOG_INFO, "BOIDS: Loaded %d boids at step %d from %s in %.2f ms", flock.count, flock.stepCounter, loadPath,
+             1000.0*(GetWallTime() - start));
 }
 
-static void KeepWithinBounds(void) {
-    float turnFactor = 0.1f; // Smaller value for smoother turning
-    for (int i = 0; i < numBoids; i++) {
-        Vector3 steering = Vector3Zero();
+// Once nothing steps the flock any more
+static void SaveBoids(void) {
+    if (savePath == NULL) return;
+
+    FlockFileResult result = SaveFlockFile(&flock, &rng, savePath);
+    if (result == FLOCK_FILE_OK) TraceLog(LOG_INFO, "BOIDS: Saved %d boids at step %d to %s", flock.count, flock.stepCounter, savePath);
+    else TraceLog(LOG_WARNING, "BOIDS: Could not save %s: %s", savePath, GetFlockFileResultName(result));
+}
 
-        if (boids[i].position.x > worldBounds.x) {
-            steering.x = -1.0f; // Steer left
+// Command line options, applied on top of the flock defaults:
+//   --boids=n                     Boids at startup, up to MAX_BOID_COUNT
+//   --search=grid|octree|brute|verlet|incremental
+//                                 Structure used to find neighbours
+//   --skin=d                      Verlet list skin, added to the perception radius
+//   --select=first|nearest        Keep the first neighbours by id or the nearest ones
+//   --neighbours=k                Neighbours kept per boid, 1 to MAX_NEIGHBOURS
+//   --threads=n                   Threads running the step, 0 for one per CPU
+//   --scheduler=stealing|static   Work stealing tasks or one fixed chunk per thread
+//   --scaling-report              Time the step on 1 to n threads and exit
+//   --footprint-report            Log the memory the flock needs once it has settled and exit
+//   --fused=on|off                Steer while finding neighbours or from stored lists
+//   --compact=on|off              Search the state packed in 16 bits or in floats
+//   --compact-report              Log the error and speed of compact state against floats and exit
+//   --headless=n                  Run n steps without a window, log the time per step and exit
+//   --dump=path                   Write the state after a headless run to path, one boid per line
+//   --hz=f                        Simulation steps per second, independent of the frame rate
+//   --max-steps=n                 Most simulation steps run at once to catch up
+//   --sim-thread=on|off           Step the simulation on its own thread or in the render loop
+//   --trace=path                  Record a Chrome trace of every phase to path, F4 flushes it
+//   --trace-events=n              Events each thread holds between flushes
+//   --seed=n                      Seed of the starting state, logged so a run can be repeated
+//   --checksums=path              Write a hash of the whole state to path after every step
+//   --checksum-every=n            Steps between checksums
+//   --load=path                   Start from a flock saved with --save, its boids, bounds and step
+//   --save=path                   Save the flock to path on exit
+//   --record=path                 Stream every step's positions to path from a writer thread
+//   --record-slabs=n              Slabs queued for the writer before steps are dropped
+//   --record-bits=n               Bits a recorded position is quantised to, 0 records floats
+//   --record-keyframes=n          Recorded steps from one keyframe to the next
+//   --recording-report=path       Decode a recording, log its size and decoding speed and exit
+static void ParseArguments(int argc, char *argv[]) {
+    for (int a = 1; a < argc; a++) {
+        if (strncmp(argv[a], "--boids=", 8) == 0) {
+            int count = atoi(argv[a] + 8);
+            numBoids = (count < 1)? 1 : (count > MAX_BOID_COUNT)? MAX_BOID_COUNT : count;
         }
-        else if (boids[i].position.x < -worldBounds.x) {
-            steering.x = 1.0f; // Steer right
+        else if (strcmp(argv[a], "--search=grid") == 0) flock.neighbourSearch = NEIGHBOUR_SEARCH_GRID;
+        else if (strcmp(argv[a], "--search=octree") == 0) flock.neighbourSearch = NEIGHBOUR_SEARCH_OCTREE;
+        else if (strcmp(argv[a], "--search=brute") == 0) flock.neighbourSearch = NEIGHBOUR_SEARCH_BRUTE_FORCE;
+        else if (strcmp(argv[a], "--search=verlet") == 0) flock.neighbourSearch = NEIGHBOUR_SEARCH_VERLET;
+        else if (strcmp(argv[a], "--search=incremental") == 0) flock.neighbourSearch = NEIGHBOUR_SEARCH_INCREMENTAL_GRID;
+        else if (strncmp(argv[a], "--skin=", 7) == 0) flock.verletSkin = (float)atof(argv[a] + 7);
+        else if (strcmp(argv[a], "--select=first") == 0) flock.neighbourSelection = NEIGHBOUR_SELECTION_FIRST_BY_ID;
+        else if (strcmp(argv[a], "--select=nearest") == 0) flock.neighbourSelection = NEIGHBOUR_SELECTION_NEAREST;
+        else if (strncmp(argv[a], "--neighbours=", 13) == 0) {
+            int limit = atoi(argv[a] + 13);
+            flock.neighbourLimit = (limit < 1)? 1 : (limit > MAX_NEIGHBOURS)? MAX_NEIGHBOURS : limit;
         }
-
-        if (boids[i].position.y > worldBounds.y) {
-            steering.y = -1.0f; // Steer down
+        else if (strncmp(argv[a], "--threads=", 10) == 0) threadCount = atoi(argv[a] + 10);
+        else if (strcmp(argv[a], "--scheduler=stealing") == 0) threadSchedule = THREAD_POOL_WORK_STEALING;
+        else if (strcmp(argv[a], "--scheduler=static") == 0) threadSchedule = THREAD_POOL_STATIC;
+        else if (strcmp(argv[a], "--scaling-report") == 0) scalingReport = true;
+        else if (strcmp(argv[a], "--footprint-report") == 0) footprintReport = true;
+        else if (strcmp(argv[a], "--fused=on") == 0) flock.fusedSteering = true;
+        else if (strcmp(argv[a], "--fused=off") == 0) flock.fusedSteering = false;
+        else if (strcmp(argv[a], "--compact=on") == 0) flock.compactState = true;
+        else if (strcmp(argv[a], "--compact=off") == 0) flock.compactState = false;
+        else if (strcmp(argv[a], "--compact-report") == 0) compactReport = true;
+        else if (strncmp(argv[a], "--headless=", 11) == 0) {
+            int steps = atoi(argv[a] + 11);
+            headlessSteps = (steps > 1)? steps : 1;
         }
-        else if (boids[i].position.y < -worldBounds.y) {
-            steering.y = 1.0f; // Steer up
+        else if (strncmp(argv[a], "--dump=", 7) == 0) dumpPath = argv[a] + 7;
+        else if (strncmp(argv[a], "--hz=", 5) == 0) {
+            float hz = (float)atof(argv[a] + 5);
+            simulationHz = (hz > 1.0f)? hz : 1.0f;
         }
-
-        if (boids[i].position.z > worldBounds.z) {
-            steering.z = -1.0f; // Steer back
+        else if (strncmp(argv[a], "--max-steps=", 12) == 0) {
+            int steps = atoi(argv[a] + 12);
+            maxCatchUpSteps = (steps > 1)? steps : 1;
         }
-        else if (boids[i].position.z < -worldBounds.z) {
-            steering.z = 1.0f; // Steer forward
+        else if (strcmp(argv[a], "--sim-thread=on") == 0) simulationThread = true;
+        else if (strcmp(argv[a], "--sim-thread=off") == 0) simulationThread = false;
+        else if (strncmp(argv[a], "--trace=", 8) == 0) tracePath = argv[a] + 8;
+        else if (strncmp(argv[a], "--load=", 7) == 0) loadPath = argv[a] + 7;
+        else if (strncmp(argv[a], "--save=", 7) == 0) savePath = argv[a] + 7;
+        else if (strncmp(argv[a], "--record=", 9) == 0) recordPath = argv[a] + 9;
+        else if (strncmp(argv[a], "--record-slabs=", 15) == 0) {
+            int slabs = atoi(argv[a] + 15);
+            recordSlabs = (slabs > 2)? slabs : 2;
         }
-
-        // Normalize the steering vector and scale it
-        if (Vector3Length(steering) > 0) {
-            steering = Vector3Normalize(steering);
-            steering = Vector3Scale(steering, turnFactor);
-            boids[i].velocity = Vector3Add(boids[i].velocity, steering);
+        else if (strncmp(argv[a], "--record-bits=", 14) == 0) {
+            int bits = atoi(argv[a] + 14);
+            recordBits = (bits <= 0)? 0 : (bits < TRAJECTORY_MIN_BITS)? TRAJECTORY_MIN_BITS : (bits > TRAJECTORY_MAX_BITS)? TRAJECTORY_MAX_BITS : bits;
+        }
+        else if (strncmp(argv[a], "--record-keyframes=", 19) == 0) {
+            int interval = atoi(argv[a] + 19);
+            recordKeyframes = (interval > 1)? interval : 1;
         }
+        else if (strncmp(argv[a], "--recording-report=", 19) == 0) recordingReportPath = argv[a] + 19;
+        else if (strncmp(argv[a], "--seed=", 7) == 0) seed = strtoull(argv[a] + 7, NULL, 10);
+        else if (strncmp(argv[a], "--checksums=", 12) == 0) checksumPath = argv[a] + 12;
+        else if (strncmp(argv[a], "--checksum-every=", 17) == 0) {
+            int interval = atoi(argv[a] + 17);
+            checksumInterval = (interval > 1)? interval : 1;
+        }
+        else if (strncmp(argv[a], "--trace-events=", 15) == 0) {
+            int events = atoi(argv[a] + 15);
+            traceEvents = (events > 1)? events : 1;
+        }
+        else TraceLog(LOG_WARNING, "BOIDS: Unknown argument: %s", argv[a]);
     }
 }
 
-static void SteerSeparation(void) {
-    float avoidFactor = 0.02;
-    for (int i = 0; i < numBoids; i++) {
-        Vector3 direction = Vector3Zero();
-		int neighbourCount = 0;
-		for (int y = 0; y < maxNeighbours; y++) {
-            if (boids[i].neighbourBoidIndexes[y] > -1) {
-                int neighborIndex = boids[i].neighbourBoidIndexes[y];
-                Vector3 neighborPosition = boids[neighborIndex].position;
-
-                direction.x += boids[i].position.x - boids[neighborIndex].position.x;
-                direction.y += boids[i].position.y - boids[neighborIndex].position.y;
-                direction.z += boids[i].position.z - boids[neighborIndex].position.z;
-                neighbourCount++;
-            }
-		}
+// Busy and idle time of every thread since the stats were last reset, a thread that idles
+// much more than the others means the work is badly balanced
+static void LogThreadPoolStats(const ThreadPool *pool) {
+    for (int t = 0; t < pool->threadCount; t++) {
+        const ThreadPoolStats *stats = &pool->workers[t].stats;
+        double total = stats->busyTime + stats->idleTime;
+        TraceLog(LOG_INFO, "BOIDS:     thread %2d: busy %9.3f ms, idle %9.3f ms (%5.1f%%), %d tasks, %d steals", t,
+                 1000.0*stats->busyTime, 1000.0*stats->idleTime, (total > 0.0)? 100.0*stats->idleTime/total : 0.0,
+                 stats->tasks, stats->steals);
+    }
+}
 
-        if (neighbourCount > 0) {
-            direction = Vector3Scale(direction, 1.0f / neighbourCount);  // Normalize
-            direction = Vector3Normalize(direction);  // Ensure unit length
-            boids[i].velocity = Vector3Add(boids[i].velocity, Vector3Scale(direction, avoidFactor));
-        }
+// A flock with the starting boids and settings of the main one, stepped on pool
+static void InitFlockCopy(Flock *copy, ThreadPool *pool) {
+    InitFlock(copy, flock.count, flock.boundsX, flock.boundsY, flock.boundsZ);
+    copy->neighbourLimit = flock.neighbourLimit;
+    copy->fusedSteering = flock.fusedSteering;
+    copy->compactState = flock.compactState;
+    copy->neighbourSearch = flock.neighbourSearch;
+    copy->neighbourSelection = flock.neighbourSelection;
+    copy->verletSkin = flock.verletSkin;
+    copy->threadPool = pool;
+    for (int i = 0; i < flock.count; i++) {
+        copy->positionX[i] = flock.positionX[i];
+        copy->positionY[i] = flock.positionY[i];
+        copy->positionZ[i] = flock.positionZ[i];
+        copy->velocityX[i] = flock.velocityX[i];
+        copy->velocityY[i] = flock.velocityY[i];
+        copy->velocityZ[i] = flock.velocityZ[i];
     }
 }
 
-static void SteerAlignment(void) {
-    float matchingFactor = 0.05;
-    for (int i = 0; i < numBoids; i++) {
-        Vector3 velocityAvg = Vector3Zero();
-		int neighbourCount = 0;
-        for (int y = 0; y < maxNeighbours; y++) {
-            if (boids[i].neighbourBoidIndexes[y] > -1) {
-                int neighbourIndex = boids[i].neighbourBoidIndexes[y];
-                
-                velocityAvg.x += boids[neighbourIndex].velocity.x;
-                velocityAvg.y += boids[neighbourIndex].velocity.y;
-                velocityAvg.z += boids[neighbourIndex].velocity.z;
-                neighbourCount++;
-            }
-        }
+// Runs the same steps from the starting flock on 1 to threadPool.threadCount threads and
+// logs the time per step, the speedup over one thread and how busy every thread was
+static void ReportThreadScaling(void) {
+    static Flock timed = { 0 };
+    const int warmupSteps = 10;
+    const int timedSteps = 200;
+    double oneThreadTime = 0.0;
+
+    for (int threads = 1; threads <= threadPool.threadCount; threads++) {
+        ThreadPool pool = { 0 };
+        InitThreadPool(&pool, threads);
+        pool.schedule = threadPool.schedule;
+
+        InitFlockCopy(&timed, &pool);
+
+        for (int step = 0; step < warmupSteps; step++) UpdateFlock(&timed, 1.0f/60.0f);
+        ResetThreadPoolStats(&pool);
+        double start = GetWallTime();
+        for (int step = 0; step < timedSteps; step++) UpdateFlock(&timed, 1.0f/60.0f);
+        double stepTime = (GetWallTime() - start)/timedSteps;
+
+        if (threads == 1) oneThreadTime = stepTime;
+        TraceLog(LOG_INFO, "BOIDS: %2d threads: %8.3f ms/step, %5.2fx", threads, 1000.0*stepTime, oneThreadTime/stepTime);
+        LogThreadPoolStats(&pool);
+
+        UnloadFlock(&timed);
+        UnloadThreadPool(&pool);
+    }
+}
+
+// Steps a copy of the starting flock past its first reorder, so the scratch peak includes
+// one, and logs what it then holds with the snapshots of a simulation added. Verlet lists
+// still grow while the boids clump. The main flock is left where it starts, for the headless
+// run, checksums and recording after it.
+static void ReportFootprint(void) {
+    static Flock stepped = { 0 };
+
+    InitFlockCopy(&stepped, &threadPool);
+    for (int step = 0; step < stepped.reorderInterval + 10; step++) UpdateFlock(&stepped, 1.0f/simulationHz);
+    StartSimulation(&simulation, &stepped, simulationHz, maxCatchUpSteps, false);
+    LogFlockFootprint(&stepped);
+    UnloadSimulation(&simulation);
+    UnloadFlock(&stepped);
+}
 
-        if (neighbourCount > 0) {
-            velocityAvg.x = velocityAvg.x / neighbourCount;
-            velocityAvg.y = velocityAvg.y / neighbourCount;
-            velocityAvg.z = velocityAvg.z / neighbourCount;
+// Steps float and compact copies of the starting flock side by side and logs how far the
+// compact one drifts from the float path, by id, then times both and compares what they hold.
+// The first step shows the rounding itself, later ones how the flock's own chaos grows it.
+static void ReportCompactState(void) {
+    static Flock exact = { 0 };
+    static Flock compact = { 0 };
+    const int comparedSteps = 120;
+    const int timedSteps = 200;
+    double stepTimes[2] = { 0.0 };
+
+    InitFlockCopy(&exact, &threadPool);
+    InitFlockCopy(&compact, &threadPool);
+    exact.compactState = false;
+    compact.compactState = true;
+    for (int step = 1; step <= comparedSteps; step++) {
+        UpdateFlock(&exact, 1.0f/simulationHz);
+        UpdateFlock(&compact, 1.0f/simulationHz);
+        if ((step != 1) && (step%30 != 0)) continue;
+
+        float maxPosition = 0.0f, maxVelocity = 0.0f;
+        double sumPosition = 0.0, sumVelocity = 0.0;
+        for (int id = 0; id < exact.count; id++) {
+            int i = exact.slots[id];
+            int j = compact.slots[id];
+            float dx = exact.positionX[i] - compact.positionX[j];
+            float dy = exact.positionY[i] - compact.positionY[j];
+            float dz = exact.positionZ[i] - compact.positionZ[j];
+            float position = sqrtf(dx*dx + dy*dy + dz*dz);
+            dx = exact.velocityX[i] - compact.velocityX[j];
+            dy = exact.velocityY[i] - compact.velocityY[j];
+            dz = exact.velocityZ[i] - compact.velocityZ[j];
+            float velocity = sqrtf(dx*dx + dy*dy + dz*dz);
+            maxPosition = (position > maxPosition)? position : maxPosition;
+            maxVelocity = (velocity > maxVelocity)? velocity : maxVelocity;
+            sumPosition += position;
+            sumVelocity += velocity;
         }
+        TraceLog(LOG_INFO, "BOIDS: Compact step %3d: position error max %.2e mean %.2e, velocity error max %.2e mean %.2e", step,
+                 maxPosition, sumPosition/exact.count, maxVelocity, sumVelocity/exact.count);
+    }
 
-        boids[i].velocity.x += (velocityAvg.x - boids[i].velocity.x) * matchingFactor;
-        boids[i].velocity.y += (velocityAvg.y - boids[i].velocity.y) * matchingFactor;
-        boids[i].velocity.z += (velocityAvg.z - boids[i].velocity.z) * matchingFactor;
+    Flock *timed[2] = { &exact, &compact };
+    for (int f = 0; f < 2; f++) {
+        double start = GetWallTime();
+        for (int step = 0; step < timedSteps; step++) UpdateFlock(timed[f], 1.0f/simulationHz);
+        stepTimes[f] = (GetWallTime() - start)/timedSteps;
     }
+
+    CompactCandidates range = GetCompactCandidates(&compact);
+    TraceLog(LOG_INFO, "BOIDS: Compact position step %.2e x %.2e x %.2e, half float velocities", range.scaleX, range.scaleY, range.scaleZ);
+    size_t footprints[2] = { GetFlockFootprint(&exact), GetFlockFootprint(&compact) };
+    TraceLog(LOG_INFO, "BOIDS: Float:   %8.3f ms/step, %2zu bytes per candidate, %10zu bytes", 1000.0*stepTimes[0], 6*sizeof(float),
+             footprints[0]);
+    TraceLog(LOG_INFO, "BOIDS: Compact: %8.3f ms/step, %2zu bytes per candidate, %10zu bytes, %5.2fx, %+.1f bytes per boid",
+             1000.0*stepTimes[1], 6*sizeof(uint16_t), footprints[1], stepTimes[0]/stepTimes[1],
+             (exact.count > 0)? ((double)footprints[1] - (double)footprints[0])/exact.count : 0.0);
+
+    UnloadFlock(&exact);
+    UnloadFlock(&compact);
 }
 
-static void SteerCohesion(void) {
-    float centeringFactor = 0.004;
-    for (int i = 0; i < numBoids; i++) {
-        Vector3 positionAvg = Vector3Zero();
-        int neighbourCount = 0;
-        for (int y = 0; y < maxNeighbours; y++) {
-            if (boids[i].neighbourBoidIndexes[y] > -1) {
-                int neighbourIndex = boids[i].neighbourBoidIndexes[y];
-                positionAvg = Vector3Add(positionAvg, boids[neighbourIndex].position);
-                neighbourCount++;
-            }
-        }
+// Reads a recording back as playback would, and logs its size against the floats it holds
+// and how fast it decodes against the rate it was recorded at
+static void ReportRecording(void) {
+    RecordingReader reader = { 0 };
+    if (!OpenRecording(&reader, recordingReportPath)) {
+        TraceLog(LOG_WARNING, "BOIDS: Could not read the recording %s", recordingReportPath);
+        return;
+    }
 
-        if (neighbourCount > 0) {
-            positionAvg.x /= neighbourCount;
-            positionAvg.y /= neighbourCount;
-            positionAvg.z /= neighbourCount;
-        }
+    long long frames = 0, positionBytes = 0;
+    int step = 0, count = 0, firstStep = 0, lastStep = 0;
+    double start = GetWallTime();
+    while (ReadRecordedFrame(&reader, &step, &count) != NULL) {
+        firstStep = (frames == 0)? step : firstStep;
+        lastStep = step;
+        positionBytes += 3*(long long)count*(long long)sizeof(float);
+        frames++;
+    }
+    double readTime = GetWallTime() - start;
+    long fileBytes = (fseek(reader.file, 0, SEEK_END) == 0)? ftell(reader.file) : 0;
 
-        boids[i].velocity.x += (positionAvg.x - boids[i].position.x) * centeringFactor;
-        boids[i].velocity.y += (positionAvg.y - boids[i].position.y) * centeringFactor;
-        boids[i].velocity.z += (positionAvg.z - boids[i].position.z) * centeringFactor;
+    TraceLog(LOG_INFO, "BOIDS: Recording %s: %lld frames, steps %d to %d, %d boids", recordingReportPath, frames, firstStep, lastStep, count);
+    if (reader.header.quantBits > 0) {
+        TraceLog(LOG_INFO, "BOIDS: Coded in %u bits, within %.5f, a keyframe every %u steps", reader.header.quantBits,
+                 GetTrajectoryCodecError(&reader.codec), reader.header.keyframeInterval);
+    }
+    else TraceLog(LOG_INFO, "BOIDS: Floats, in slabs of %llu bytes", (unsigned long long)reader.header.slabBytes);
+    TraceLog(LOG_INFO, "BOIDS: %.1f MB of positions in %.1f MB, %.2fx smaller", positionBytes/1e6, fileBytes/1e6,
+             (fileBytes > 0)? (double)positionBytes/fileBytes : 0.0);
+    if (readTime > 0.0) {
+        TraceLog(LOG_INFO, "BOIDS: Read and decoded in %.3f s, %.0f MB/s, %.0f frames/s, %.1fx real time", readTime,
+                 positionBytes/1e6/readTime, frames/readTime, frames*reader.header.stepTime/readTime);
     }
+    CloseRecording(&reader);
 }
 
-static void ConstrainSpeed(void) {
-    float maxSpeed = 3.0;
-    float minSpeed = 2.0;
-    for (int i = 0; i < numBoids; i++) {
-        float speed = sqrt(
-            boids[i].velocity.x * boids[i].velocity.x + 
-            boids[i].velocity.y * boids[i].velocity.y + 
-            boids[i].velocity.z * boids[i].velocity.z);
+static int CompareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
 
-        if (speed > maxSpeed) {
-            boids[i].velocity = Vector3Scale(Vector3Normalize(boids[i].velocity), maxSpeed);
-        }
-        else if (speed < minSpeed) {
-            boids[i].velocity = Vector3Scale(Vector3Normalize(boids[i].velocity), minSpeed);
-        }
+// Steps the flock headlessSteps times at the simulation rate, as fast as it goes, and logs
+// the wall time per step. The state reached is written to dumpPath if there is one.
+static void RunHeadless(void) {
+    double *stepTimes = (double *)calloc(headlessSteps, sizeof(double));
+    if (stepTimes == NULL) {
+        TraceLog(LOG_ERROR, "BOIDS: Could not allocate the times of %d steps", headlessSteps);
+        return;
+    }
+
+    double totalTime = 0.0;
+    long long crossings = 0;
+
+    for (int step = 0; step < headlessSteps; step++) {
+        double start = GetWallTime();
+        UpdateFlock(&flock, 1.0f/simulationHz);
+        stepTimes[step] = GetWallTime() - start;
+        totalTime += stepTimes[step];
+        crossings += flock.incrementalGrid.crossings;
+
+        for (int p = 0; p < FLOCK_PHASE_COUNT; p++) SetFramePhaseTime(&stepTimer, p, flock.phaseTimes[p]);
+        EndFrameTimer(&stepTimer);
+    }
+
+    qsort(stepTimes, headlessSteps, sizeof(double), CompareDoubles);
+    TraceLog(LOG_INFO, "BOIDS: Headless: %d steps in %.3f s, %.3f ms/step", headlessSteps, totalTime, 1000.0*totalTime/headlessSteps);
+    TraceLog(LOG_INFO, "BOIDS:     min %.3f ms, p50 %.3f ms, p99 %.3f ms, max %.3f ms", 1000.0*stepTimes[0],
+             1000.0*stepTimes[headlessSteps/2], 1000.0*stepTimes[(int)(0.99*(headlessSteps - 1))], 1000.0*stepTimes[headlessSteps - 1]);
+    LogFrameTimer(&stepTimer, "Step");
+    free(stepTimes);
+
+    if (flock.neighbourSearch == NEIGHBOUR_SEARCH_INCREMENTAL_GRID) {
+        DynamicSpatialGridStats grid = GetDynamicSpatialGridStats(&flock.incrementalGrid);
+        TraceLog(LOG_INFO, "BOIDS: Incremental grid: %.1f crossings/step, cells laid out %d times", (double)crossings/headlessSteps,
+                 flock.incrementalGrid.layouts);
+        TraceLog(LOG_INFO, "BOIDS:     %d occupied cells, up to %d boids, %.2f on average", grid.occupiedCells, grid.maxOccupancy,
+                 grid.meanOccupancy);
+    }
+
+    if (dumpPath != NULL) {
+        if (DumpFlockState(&flock, dumpPath)) TraceLog(LOG_INFO, "BOIDS: State written to %s", dumpPath);
+        else TraceLog(LOG_WARNING, "BOIDS: Could not write the state to %s", dumpPath);
     }
 }
 
-static void UpdateBoidPosition(void) {
-    for (int i = 0; i < numBoids; i++) {
-        Vector3 displacement = Vector3Scale(boids[i].velocity, 3 * GetFrameTime());
-        boids[i].position = Vector3Add(boids[i].position, displacement);
+// Text, one boid per line by id: id, position and velocity. Printed with enough digits to
+// read the floats back exactly, so two dumps can be compared bit for bit.
+static bool DumpFlockState(const Flock *flock, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) return false;
+
+    fprintf(file, "# %d boids after %d steps: id x y z vx vy vz\n", flock->count, flock->stepCounter);
+    for (int id = 0; id < flock->count; id++) {
+        int i = flock->slots[id];
+        fprintf(file, "%d %.9g %.9g %.9g %.9g %.9g %.9g\n", id, flock->positionX[i], flock->positionY[i], flock->positionZ[i],
+                flock->velocityX[i], flock->velocityY[i], flock->velocityZ[i]);
     }
+
+    return (fclose(file) == 0);
+}
+
+// Everything the flock holds, with the most its scratch arena has held in a step
+static size_t GetFlockFootprint(const Flock *flock) {
+    return flock->arena.used + flock->scratch.peak;
+}
+
+// Bytes the flock holds by subsystem, to size a machine for a boid count. Abandoned bytes are
+// buffers that grew and moved, the arena gets them back only when it is unloaded.
+static void LogFlockFootprint(const Flock *flock) {
+    const Arena *arena = &flock->arena;
+    size_t total = GetFlockFootprint(flock);
+
+    TraceLog(LOG_INFO, "BOIDS: Footprint: %zu bytes for %d boids, %zu per boid", total, flock->count,
+             (flock->count > 0)? total/flock->count : 0);
+    for (int t = 0; t < ARENA_TAG_COUNT; t++) {
+        if (t == ARENA_TAG_SCRATCH) continue;
+        TraceLog(LOG_INFO, "BOIDS:     %-16s %12zu bytes", GetArenaTagName((ArenaTag)t), arena->tagBytes[t]);
+    }
+    TraceLog(LOG_INFO, "BOIDS:     %-16s %12zu bytes", "abandoned", arena->abandoned);
+    TraceLog(LOG_INFO, "BOIDS:     %-16s %12zu bytes at most", GetArenaTagName(ARENA_TAG_SCRATCH), flock->scratch.peak);
+    TraceLog(LOG_INFO, "BOIDS:     committed %zu of %zu bytes reserved", arena->committed + flock->scratch.committed,
+             arena->reserved + flock->scratch.reserved);
+}
+
+static void InitTimers(void) {
+    static const char *frameNames[FRAME_PHASE_COUNT] = { "simulate", "spheres", "scene", "grain", "present" };
+    const char *stepNames[FLOCK_PHASE_COUNT] = { 0 };
+
+    for (int p = 0; p < FLOCK_PHASE_COUNT; p++) stepNames[p] = GetFlockPhaseName((FlockPhase)p);
+    InitFrameTimer(&frameTimer, FRAME_PHASE_COUNT, frameNames);
+    InitFrameTimer(&stepTimer, FLOCK_PHASE_COUNT, stepNames);
+}
+
+// Before any thread that records is started, so they all see the trace on
+static void StartTracing(void) {
+    if (tracePath == NULL) return;
+
+    if (StartTrace(tracePath, traceEvents)) {
+        NameTraceThread("main");
+        TraceLog(LOG_INFO, "BOIDS: Tracing to %s", tracePath);
+    }
+    else TraceLog(LOG_WARNING, "BOIDS: Could not open the trace %s", tracePath);
+}
+
+// Once every thread that records has stopped
+static void StopTracing(void) {
+    if (!traceEnabled) return;
+
+    StopTrace();
+    TraceLog(LOG_INFO, "BOIDS: Trace written to %s: %d events, %d dropped", tracePath, GetTraceEventCount(), GetTraceDropped());
+}
+
+// Hashes of the starting state and then of every checksumInterval-th step, one "step hash"
+// line each. Two runs from the same seed can be diffed to find the first step they differ.
+static void StartChecksums(void) {
+    if (checksumPath == NULL) return;
+
+    checksumFile = fopen(checksumPath, "w");
+    if (checksumFile == NULL) {
+        TraceLog(LOG_WARNING, "BOIDS: Could not open the checksums %s", checksumPath);
+        return;
+    }
+
+    fprintf(checksumFile, "# seed %llu, %d boids, every %d steps\n", seed, flock.count, checksumInterval);
+    WriteChecksum(&flock);
+    flock.stepCallback = AfterFlockStep;
+}
+
+static void WriteChecksum(const Flock *flock) {
+    if (flock->stepCounter%checksumInterval != 0) return;
+
+    fprintf(checksumFile, "%d %016llx\n", flock->stepCounter, (unsigned long long)HashFlockState(flock));
+}
+
+// Once nothing steps the flock any more
+static void StopChecksums(void) {
+    if (checksumFile == NULL) return;
+
+    fclose(checksumFile);
+    checksumFile = NULL;
+    TraceLog(LOG_INFO, "BOIDS: Checksums written to %s", checksumPath);
+}
+
+// Streams the starting state and every step after it, the step only pays for the copy
+static void StartRecording(void) {
+    if (recordPath == NULL) return;
+
+    if (!StartRecorder(&recorder, recordPath, &flock, 1.0f/simulationHz, RECORDER_DEFAULT_SLAB_BYTES, recordSlabs, recordBits,
+                       recordKeyframes)) {
+        TraceLog(LOG_WARNING, "BOIDS: Could not open the recording %s", recordPath);
+        return;
+    }
+    flock.stepCallback = AfterFlockStep;
+    TraceLog(LOG_INFO, "BOIDS: Recording to %s, %d slabs of %zu bytes", recordPath, recorder.slabCount, recorder.slabBytes);
+    if (recordBits > 0) {
+        TraceLog(LOG_INFO, "BOIDS: Recording coded in %d bits, within %.5f, a keyframe every %d steps", recorder.codec.quantBits,
+                 GetTrajectoryCodecError(&recorder.codec), recorder.codec.keyframeInterval);
+    }
+}
+
+// Once nothing steps the flock any more, waits for the writer to finish
+static void StopRecording(void) {
+    if (!recorder.recording) return;
+
+    StopRecorder(&recorder);
+    RecorderStats stats = GetRecorderStats(&recorder);
+    TraceLog(LOG_INFO, "BOIDS: Recorded %lld steps to %s, %lld dropped, %lld write errors", stats.framesRecorded, recordPath,
+             stats.framesDropped, stats.writeErrors);
+    TraceLog(LOG_INFO, "BOIDS: Recording: %.1f MB in %.3f s %s, queue peaked at %lld of %d slabs", stats.bytesWritten/1e6,
+             stats.writeTime, (recorder.direct)? "direct" : "buffered", stats.queueHighWater, recorder.slabCount);
+    if (recordBits > 0) {
+        TraceLog(LOG_INFO, "BOIDS: Recording: %.1f MB of positions coded to %.1f MB, %.1fx smaller, at %.0f MB/s",
+                 stats.bytesRecorded/1e6, stats.bytesWritten/1e6, (stats.bytesWritten > 0)? (double)stats.bytesRecorded/stats.bytesWritten : 0.0,
+                 (stats.encodeTime > 0.0)? stats.bytesRecorded/1e6/stats.encodeTime : 0.0);
+    }
+}
+
+// After every step, on whichever thread stepped the flock
+static void AfterFlockStep(const Flock *flock, void *context) {
+    if (checksumFile != NULL) WriteChecksum(flock);
+    RecordFlockFrame(&recorder, flock);
+}
+
+// Recent average time of every phase, on one line
+static void LogFrameTimer(const FrameTimer *timer, const char *title) {
+    char line[256] = { 0 };
+    int length = 0;
+
+    for (int p = 0; (p < timer->phaseCount) && (length < (int)sizeof(line)); p++) {
+        length += snprintf(line + length, sizeof(line) - length, "%s%s %.3f ms", (p > 0)? ", " : "",
+                           timer->phaseNames[p], 1000.0*timer->averages[p]);
+    }
+    TraceLog(LOG_INFO, "BOIDS: %s: %.3f ms, %s", title, 1000.0*GetFrameTimerAverageTotal(timer), line);
+}
+
+// The history as stacked bars, newest on the right and scaled to the slowest frame in it,
+// then the average of every phase. Returns the y below it all.
+static int DrawFrameTimer(const FrameTimer *timer, const char *title, int x, int y) {
+    static const Color phaseColors[FRAME_TIMER_MAX_PHASES] = { SKYBLUE, ORANGE, LIME, PURPLE, GOLD, MAROON, DARKBLUE, PINK };
+    const int graphWidth = 2*FRAME_TIMER_HISTORY;
+    const int graphHeight = 48;
+    float scale = 0.001f;           // Seconds at the top of the graph, at least 1 ms
+
+    for (int age = 0; GetFrameTimerHistory(timer, age) != NULL; age++) {
+        const float *times = GetFrameTimerHistory(timer, age);
+        float total = 0.0f;
+        for (int p = 0; p < timer->phaseCount; p++) total += times[p];
+        if (total > scale) scale = total;
+    }
+
+    DrawText(TextFormat("%s %.2f ms, graph to %.1f ms", title, 1000.0*GetFrameTimerAverageTotal(timer), 1000.0f*scale), x, y, 10, DARKGRAY);
+    y += 14;
+
+    DrawRectangle(x, y, graphWidth, graphHeight, Fade(LIGHTGRAY, 0.5f));
+    for (int age = 0; GetFrameTimerHistory(timer, age) != NULL; age++) {
+        const float *times = GetFrameTimerHistory(timer, age);
+        int bottom = y + graphHeight;
+        for (int p = 0; p < timer->phaseCount; p++) {
+            int height = (int)(graphHeight*times[p]/scale + 0.5f);
+            DrawRectangle(x + graphWidth - 2*(age + 1), bottom - height, 2, height, phaseColors[p]);
+            bottom -= height;
+        }
+    }
+    y += graphHeight + 4;
+
+    for (int p = 0; p < timer->phaseCount; p++) {
+        DrawRectangle(x, y + 1, 8, 8, phaseColors[p]);
+        DrawText(TextFormat("%s %.3f ms", timer->phaseNames[p], 1000.0*timer->averages[p]), x + 12, y, 10, DARKGRAY);
+        y += 12;
+    }
+
+    return y + 8;
 }
 
 // Update and draw game frame
 static void UpdateDrawFrame(void)
 {
+    TraceBegin("frame");
+    BeginFramePhase(&frameTimer, FRAME_PHASE_SIMULATE);
     timeCounter += GetFrameTime();
 
     // Update
     //----------------------------------------------------------------------------------
     UpdateCamera(&camera, CAMERA_FREE);
-    UpdateBoidNeighbours();
-    SteerSeparation();
-    SteerAlignment();
-    SteerCohesion();
-    KeepWithinBounds();
-    ConstrainSpeed();
-    UpdateBoidPosition();
+
+    // Double or halve the population, the simulation resizes the flock before its next step
+    if (IsKeyPressed(KEY_EQUAL) || IsKeyPressed(KEY_MINUS)) {
+        numBoids = IsKeyPressed(KEY_EQUAL)? ((numBoids < MAX_BOID_COUNT/2)? 2*numBoids : MAX_BOID_COUNT) : (numBoids + 1)/2;
+        ResizeSimulation(&simulation, numBoids);
+        TraceLog(LOG_INFO, "BOIDS: Boids: %d", numBoids);
+    }
+
+    // Steps at a fixed rate, so the simulation does not depend on the frame rate and one slow
+    // frame cannot throw boids through the bounds. Only runs them here without a thread.
+    UpdateSimulation(&simulation);
+
+    // The newest published step, and how far the frame is past it
+    const FlockSnapshot *snapshot = GetLatestSnapshot(&simulation);
+    float alpha = GetSnapshotAlpha(&simulation, snapshot);
+
+    // Phase times of each step once, from the thread that ran it through the snapshot
+    if (snapshot->step != timedStep) {
+        for (int p = 0; p < FLOCK_PHASE_COUNT; p++) SetFramePhaseTime(&stepTimer, p, snapshot->phaseTimes[p]);
+        EndFrameTimer(&stepTimer);
+        timedStep = snapshot->step;
+    }
+
+    if (IsKeyPressed(KEY_F3)) showTimings = !showTimings;
+
+    // Writes out what the trace holds so far, while it carries on recording
+    if (IsKeyPressed(KEY_F4) && traceEnabled) {
+        FlushTrace();
+        TraceLog(LOG_INFO, "BOIDS: Trace flushed to %s: %d events, %d dropped", tracePath, GetTraceEventCount(), GetTraceDropped());
+    }
     //----------------------------------------------------------------------------------
 
     // Draw
@@ -318,26 +837,47 @@ static void UpdateDrawFrame(void)
 
         BeginMode3D(camera);
 
-			for (int i = 0; i < numBoids; i++) {
-                DrawSphere(boids[i].position, 0.08, DARKGRAY);
-               // DrawLine3D(boids[i].position, Vector3Add(boids[i].velocity, boids[i].position), RED);
+            BeginFramePhase(&frameTimer, FRAME_PHASE_SPHERES);
+
+			// Draw in id order so the on-screen order does not change when boids are reordered
+			for (int id = 0; id < snapshot->count; id++) {
+                Vector3 position = { 0 };
+                InterpolateSnapshotPosition(snapshot, id, alpha, &position.x, &position.y, &position.z);
+                DrawSphere(position, 0.08, DARKGRAY);
+               // DrawLine3D(position, Vector3Add(position, (Vector3){ flock.velocityX[i], flock.velocityY[i], flock.velocityZ[i] }), RED);
 
                 /*
-                for (int y = 0; y < 10; y++) {
-                    if (boids[i].neighbourBoidIndexes[y] > -1) {
-                        DrawLine3D(boids[i].position, boids[boids[i].neighbourBoidIndexes[y]].position, LIGHTGRAY);
-                    }
+                for (int n = 0; n < flock.neighbourCounts[i]; n++) {
+                    int y = flock.neighbourIndexes[i][n];
+                    DrawLine3D(position, (Vector3){ flock.positionX[y], flock.positionY[y], flock.positionZ[y] }, LIGHTGRAY);
                 }
                 */
             }
+            BeginFramePhase(&frameTimer, FRAME_PHASE_SCENE);
             DrawPlane((Vector3){0.0f, -20.0f, 0.0f}, (Vector2) { 300.0f, 100.0f }, RED);
 
         EndMode3D();
 
         DrawFPS(10, 10);
+        if (showTimings) {
+            int y = DrawFrameTimer(&frameTimer, "Frame", 10, 40);
+            y = DrawFrameTimer(&stepTimer, "Step", 10, y);
+            if (recordPath != NULL) {
+                RecorderStats stats = GetRecorderStats(&recorder);
+                DrawText(TextFormat("Recording %lld steps, %lld dropped, queue peaked at %lld of %d", stats.framesRecorded,
+                                    stats.framesDropped, stats.queueHighWater, recorder.slabCount), 10, y, 10, DARKGRAY);
+                y += 12;
+            }
+            if (flock.neighbourSearch == NEIGHBOUR_SEARCH_INCREMENTAL_GRID) {
+                DynamicSpatialGridStats grid = GetDynamicSpatialGridStats(&flock.incrementalGrid);
+                DrawText(TextFormat("Incremental grid %d crossings, cells up to %d boids, %.2f on average", flock.incrementalGrid.crossings,
+                                    grid.maxOccupancy, grid.meanOccupancy), 10, y, 10, DARKGRAY);
+            }
+        }
 
     EndTextureMode();
 
+    BeginFramePhase(&frameTimer, FRAME_PHASE_GRAIN);
     BeginDrawing();
 		ClearBackground(BLACK);
 
@@ -346,6 +886,9 @@ static void UpdateDrawFrame(void)
             SetShaderValue(grainShader, GetShaderLocation(grainShader, "grainIntensity"), &grainIntensity, SHADER_UNIFORM_FLOAT);
             DrawTextureRec(target.texture, (Rectangle) { 0, 0, GetScreenWidth(), -GetScreenHeight() }, (Vector2) { 0, 0 }, WHITE);
         EndShaderMode();
+    BeginFramePhase(&frameTimer, FRAME_PHASE_PRESENT);
     EndDrawing();
+    EndFrameTimer(&frameTimer);
+    TraceEnd("frame");
     //----------------------------------------------------------------------------------
 }
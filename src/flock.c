@@ -0,0 +1,1420 @@
+/*******************************************************************************************
+*
+*   flock - Boid state and the steps that move it
+*
+********************************************************************************************/
+
+#include "flock.h"
+#include "neighbour_kernel.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define NEIGHBOUR_BLOCK 16          // Candidates tested per kernel call
+
+// Points the current and next state at states[current] and the other buffer
+static void SelectFlockState(Flock *flock, int current) {
+    FlockState *state = &flock->states[current];
+    FlockState *next = &flock->states[1 - current];
+
+    flock->currentState = current;
+    flock->positionX = state->positionX;
+    flock->positionY = state->positionY;
+    flock->positionZ = state->positionZ;
+    flock->velocityX = state->velocityX;
+    flock->velocityY = state->velocityY;
+    flock->velocityZ = state->velocityZ;
+    flock->nextPositionX = next->positionX;
+    flock->nextPositionY = next->positionY;
+    flock->nextPositionZ = next->positionZ;
+    flock->nextVelocityX = next->velocityX;
+    flock->nextVelocityY = next->velocityY;
+    flock->nextVelocityZ = next->velocityZ;
+}
+
+// The next state becomes the current one, no boid state is copied
+static void SwapFlockState(Flock *flock) {
+    SelectFlockState(flock, 1 - flock->currentState);
+}
+
+// Grows a per-boid array from the old capacity to capacity elements, keeping its contents
+#define GROW_FLOCK_ARRAY(flock, array, capacity, tag) \
+    ((array) = ArenaGrow(&(flock)->arena, (array), (size_t)(flock)->capacity*sizeof(*(array)), \
+                         (size_t)(capacity)*sizeof(*(array)), (tag)))
+
+// Grows an array indexed by packed position from the old packed capacity to capacity
+#define GROW_PACKED_ARRAY(flock, array, capacity, tag) \
+    ((array) = ArenaGrow(&(flock)->arena, (array), (size_t)(flock)->packedCapacity*sizeof(*(array)), \
+                         (size_t)(capacity)*sizeof(*(array)), (tag)))
+
+// Grows the compact copies from the old packed capacity to capacity, or allocates them. They
+// have room for the entries the compact kernels read past the end.
+static void ReserveCompactState(Flock *flock, int capacity) {
+    size_t oldSize = (size_t)(flock->packedCapacity + NEIGHBOUR_KERNEL_SLACK)*sizeof(uint16_t);
+    size_t size = (size_t)(capacity + NEIGHBOUR_KERNEL_SLACK)*sizeof(uint16_t);
+
+    flock->compactPositionX = ArenaGrow(&flock->arena, flock->compactPositionX, oldSize, size, ARENA_TAG_NEIGHBOUR_SEARCH);
+    flock->compactPositionY = ArenaGrow(&flock->arena, flock->compactPositionY, oldSize, size, ARENA_TAG_NEIGHBOUR_SEARCH);
+    flock->compactPositionZ = ArenaGrow(&flock->arena, flock->compactPositionZ, oldSize, size, ARENA_TAG_NEIGHBOUR_SEARCH);
+    flock->compactVelocityX = ArenaGrow(&flock->arena, flock->compactVelocityX, oldSize, size, ARENA_TAG_NEIGHBOUR_SEARCH);
+    flock->compactVelocityY = ArenaGrow(&flock->arena, flock->compactVelocityY, oldSize, size, ARENA_TAG_NEIGHBOUR_SEARCH);
+    flock->compactVelocityZ = ArenaGrow(&flock->arena, flock->compactVelocityZ, oldSize, size, ARENA_TAG_NEIGHBOUR_SEARCH);
+}
+
+// Grows the float packed copies from the old packed capacity to capacity, or allocates them
+static void ReservePackedState(Flock *flock, int capacity) {
+    GROW_PACKED_ARRAY(flock, flock->packedPositionX, capacity, ARENA_TAG_NEIGHBOUR_SEARCH);
+    GROW_PACKED_ARRAY(flock, flock->packedPositionY, capacity, ARENA_TAG_NEIGHBOUR_SEARCH);
+    GROW_PACKED_ARRAY(flock, flock->packedPositionZ, capacity, ARENA_TAG_NEIGHBOUR_SEARCH);
+    GROW_PACKED_ARRAY(flock, flock->packedVelocityX, capacity, ARENA_TAG_NEIGHBOUR_SEARCH);
+    GROW_PACKED_ARRAY(flock, flock->packedVelocityY, capacity, ARENA_TAG_NEIGHBOUR_SEARCH);
+    GROW_PACKED_ARRAY(flock, flock->packedVelocityZ, capacity, ARENA_TAG_NEIGHBOUR_SEARCH);
+}
+
+// Grows everything indexed by packed position to capacity entries. The copies not
+// allocated yet are left to their first use.
+static void ReservePackedCapacity(Flock *flock, int capacity) {
+    GROW_PACKED_ARRAY(flock, flock->packedIds, capacity, ARENA_TAG_NEIGHBOUR_SEARCH);
+    if (flock->packedSlots != NULL) GROW_PACKED_ARRAY(flock, flock->packedSlots, capacity, ARENA_TAG_NEIGHBOUR_SEARCH);
+    if (flock->packedPositionX != NULL) ReservePackedState(flock, capacity);
+    if (flock->compactPositionX != NULL) ReserveCompactState(flock, capacity);
+    flock->packedCapacity = capacity;
+}
+
+// Grows every per-boid array to capacity, no less than the current one, keeping the boids
+// there are. The search structures are sized to the capacity and rebuilt for the current
+// bounds and perception radius, they are rebuilt before their next use anyway.
+void ReserveFlock(Flock *flock, int capacity) {
+    for (int s = 0; s < 2; s++) {
+        FlockState *state = &flock->states[s];
+        GROW_FLOCK_ARRAY(flock, state->positionX, capacity, ARENA_TAG_STATE);
+        GROW_FLOCK_ARRAY(flock, state->positionY, capacity, ARENA_TAG_STATE);
+        GROW_FLOCK_ARRAY(flock, state->positionZ, capacity, ARENA_TAG_STATE);
+        GROW_FLOCK_ARRAY(flock, state->velocityX, capacity, ARENA_TAG_STATE);
+        GROW_FLOCK_ARRAY(flock, state->velocityY, capacity, ARENA_TAG_STATE);
+        GROW_FLOCK_ARRAY(flock, state->velocityZ, capacity, ARENA_TAG_STATE);
+    }
+    SelectFlockState(flock, flock->currentState);
+
+    GROW_FLOCK_ARRAY(flock, flock->ids, capacity, ARENA_TAG_STATE);
+    GROW_FLOCK_ARRAY(flock, flock->slots, capacity, ARENA_TAG_STATE);
+    GROW_FLOCK_ARRAY(flock, flock->neighbourCounts, capacity, ARENA_TAG_NEIGHBOUR_LISTS);
+    if (flock->neighbourIndexes != NULL) GROW_FLOCK_ARRAY(flock, flock->neighbourIndexes, capacity, ARENA_TAG_NEIGHBOUR_LISTS);
+
+    if (capacity > flock->packedCapacity) ReservePackedCapacity(flock, capacity);
+    flock->verletStart = ArenaGrow(&flock->arena, flock->verletStart, (flock->capacity + 1)*sizeof(int),
+                                   (capacity + 1)*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    GROW_FLOCK_ARRAY(flock, flock->verletPositionX, capacity, ARENA_TAG_NEIGHBOUR_SEARCH);
+    GROW_FLOCK_ARRAY(flock, flock->verletPositionY, capacity, ARENA_TAG_NEIGHBOUR_SEARCH);
+    GROW_FLOCK_ARRAY(flock, flock->verletPositionZ, capacity, ARENA_TAG_NEIGHBOUR_SEARCH);
+    GROW_FLOCK_ARRAY(flock, flock->crossedSlots, capacity, ARENA_TAG_NEIGHBOUR_SEARCH);
+    flock->capacity = capacity;
+
+    UnloadSpatialGrid(&flock->grid);
+    UnloadOctree(&flock->octree);
+    UnloadDynamicSpatialGrid(&flock->incrementalGrid);
+    flock->grid = LoadSpatialGrid(flock->boundsX, flock->boundsY, flock->boundsZ, flock->perceptionRadius, capacity, &flock->arena);
+    flock->octree = LoadOctree(flock->boundsX, flock->boundsY, flock->boundsZ, capacity, &flock->arena);
+    flock->incrementalGrid = LoadDynamicSpatialGrid(flock->boundsX, flock->boundsY, flock->boundsZ, flock->perceptionRadius,
+                                                    capacity, &flock->arena);
+    InvalidateNeighbourSearch(flock);
+}
+
+void InitFlock(Flock *flock, int count, float boundsX, float boundsY, float boundsZ) {
+    *flock = (Flock){ 0 };
+    flock->neighbourLimit = 10;
+    flock->fusedSteering = false;
+    flock->compactState = false;
+    flock->threadPool = NULL;
+    flock->neighbourSearch = NEIGHBOUR_SEARCH_GRID;
+    flock->neighbourSelection = NEIGHBOUR_SELECTION_FIRST_BY_ID;
+    flock->reorderInterval = 120;
+    flock->stepCounter = 0;
+    flock->perceptionRadius = 5.0f;
+    flock->verletSkin = 1.5f;
+    flock->verletValid = false;
+    flock->verletSortedById = false;
+    flock->verletRebuilds = 0;
+    flock->verletCapacity = 0;
+    flock->verletNeighbours = NULL;
+    flock->verletGrid = (SpatialGrid){ 0 };
+    flock->neighbourIndexes = NULL;
+    flock->packedCapacity = 0;
+    flock->packedPositionX = NULL;
+    flock->packedSlots = NULL;
+    flock->compactPositionX = NULL;
+    flock->boundsX = boundsX;
+    flock->boundsY = boundsY;
+    flock->boundsZ = boundsZ;
+    flock->previousStateValid = false;
+    flock->arena = LoadArena(ARENA_DEFAULT_RESERVE);
+    flock->scratch = LoadArena(ARENA_DEFAULT_RESERVE);
+
+    ReserveFlock(flock, (count > 0)? count : 1);
+    flock->count = count;
+    for (int i = 0; i < count; i++) {
+        flock->positionX[i] = 0.0f;
+        flock->positionY[i] = 0.0f;
+        flock->positionZ[i] = 0.0f;
+        flock->velocityX[i] = 0.0f;
+        flock->velocityY[i] = 0.0f;
+        flock->velocityZ[i] = 0.0f;
+        flock->ids[i] = i;
+        flock->slots[i] = i;
+        flock->neighbourCounts[i] = 0;
+    }
+
+    flock->incrementalGridValid = false;
+    flock->crossedCount = 0;
+    InitNeighbourKernel();
+}
+
+// Everything the flock allocated lives in its two arenas
+void UnloadFlock(Flock *flock) {
+    UnloadArena(&flock->arena);
+    UnloadArena(&flock->scratch);
+    *flock = (Flock){ 0 };
+}
+
+// Hashes an integer to a float in [-1, 1), the same on every platform
+static float HashToUnit(unsigned int x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return (float)(x >> 8)/8388608.0f - 1.0f;
+}
+
+// Grows or shrinks the flock to count boids. Added boids take the next ids and are spread
+// over the bounds by their id, removing boids drops the highest ids and keeps the rest in
+// their order. The capacity at least doubles when it grows, so growing one boid at a time
+// stays cheap, and never shrinks.
+void ResizeFlock(Flock *flock, int count) {
+    if (count < 0) count = 0;
+    if (count > flock->capacity) ReserveFlock(flock, (count > 2*flock->capacity)? count : 2*flock->capacity);
+
+    if (count < flock->count) {
+        int kept = 0;
+        for (int i = 0; i < flock->count; i++) {
+            int id = flock->ids[i];
+            if (id >= count) continue;
+
+            flock->positionX[kept] = flock->positionX[i];
+            flock->positionY[kept] = flock->positionY[i];
+            flock->positionZ[kept] = flock->positionZ[i];
+            flock->velocityX[kept] = flock->velocityX[i];
+            flock->velocityY[kept] = flock->velocityY[i];
+            flock->velocityZ[kept] = flock->velocityZ[i];
+            flock->ids[kept] = id;
+            flock->slots[id] = kept;
+            flock->neighbourCounts[kept] = 0;
+            kept++;
+        }
+    }
+    else {
+        for (int id = flock->count; id < count; id++) {
+            unsigned int seed = 6u*(unsigned int)id;
+            flock->positionX[id] = flock->boundsX*HashToUnit(seed);
+            flock->positionY[id] = flock->boundsY*HashToUnit(seed + 1);
+            flock->positionZ[id] = flock->boundsZ*HashToUnit(seed + 2);
+            flock->velocityX[id] = HashToUnit(seed + 3);
+            flock->velocityY[id] = HashToUnit(seed + 4);
+            flock->velocityZ[id] = HashToUnit(seed + 5);
+            flock->ids[id] = id;
+            flock->slots[id] = id;
+            flock->neighbourCounts[id] = 0;
+        }
+    }
+
+    flock->count = count;
+    flock->previousStateValid = false;
+    InvalidateNeighbourSearch(flock);
+}
+
+// A per-boid pass over boids [start, end)
+typedef struct FlockJob {
+    Flock *flock;
+    float dt;
+} FlockJob;
+
+// Runs pass over every boid, split into chunks when the flock has a thread pool. Returns
+// once every chunk is done.
+static void RunFlockPass(Flock *flock, ThreadPoolTask pass, float dt) {
+    FlockJob job = { flock, dt };
+
+    if (flock->threadPool != NULL) RunThreadPool(flock->threadPool, pass, &job, flock->count);
+    else pass(&job, 0, flock->count, 0);
+}
+
+static uint64_t HashFloat(uint64_t hash, float value) {
+    uint32_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    return (hash ^ bits)*0x100000001b3ULL;
+}
+
+// FNV-1a over the bits of every position and velocity, 32 bits at a time, in id order. The
+// same state gives the same hash however the slots are sorted, and a single bit of
+// difference anywhere changes it.
+uint64_t HashFlockState(const Flock *flock) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (int id = 0; id < flock->count; id++) {
+        int i = flock->slots[id];
+        hash = HashFloat(hash, flock->positionX[i]);
+        hash = HashFloat(hash, flock->positionY[i]);
+        hash = HashFloat(hash, flock->positionZ[i]);
+        hash = HashFloat(hash, flock->velocityX[i]);
+        hash = HashFloat(hash, flock->velocityY[i]);
+        hash = HashFloat(hash, flock->velocityZ[i]);
+    }
+
+    return hash;
+}
+
+// Drops the search state kept from step to step, for when positions or slots were changed
+// outside UpdateFlock()
+void InvalidateNeighbourSearch(Flock *flock) {
+    flock->verletValid = false;
+    flock->incrementalGridValid = false;
+}
+
+// Fixed point origin and step of the compact positions, a 16 bit range over COMPACT_POSITION_RANGE
+// times the bounds. With the default bounds a step is about 0.003 along x.
+CompactCandidates GetCompactCandidates(const Flock *flock) {
+    return (CompactCandidates){
+        flock->compactPositionX, flock->compactPositionY, flock->compactPositionZ,
+        flock->compactVelocityX, flock->compactVelocityY, flock->compactVelocityZ,
+        -COMPACT_POSITION_RANGE*flock->boundsX, -COMPACT_POSITION_RANGE*flock->boundsY, -COMPACT_POSITION_RANGE*flock->boundsZ,
+        2.0f*COMPACT_POSITION_RANGE*flock->boundsX/65535.0f, 2.0f*COMPACT_POSITION_RANGE*flock->boundsY/65535.0f,
+        2.0f*COMPACT_POSITION_RANGE*flock->boundsZ/65535.0f
+    };
+}
+
+// Packed position k as the search sees it, decoded when the copies are compact
+static inline void ReadPackedPosition(const Flock *flock, const CompactCandidates *compact, int k, float *x, float *y, float *z) {
+    if (flock->compactState) {
+        *x = DecodeFixed(compact->x[k], compact->originX, compact->scaleX);
+        *y = DecodeFixed(compact->y[k], compact->originY, compact->scaleY);
+        *z = DecodeFixed(compact->z[k], compact->originZ, compact->scaleZ);
+    }
+    else {
+        *x = flock->packedPositionX[k];
+        *y = flock->packedPositionY[k];
+        *z = flock->packedPositionZ[k];
+    }
+}
+
+static inline void ReadPackedVelocity(const Flock *flock, const CompactCandidates *compact, int k, float *x, float *y, float *z) {
+    if (flock->compactState) {
+        *x = DecodeHalf(compact->velocityX[k]);
+        *y = DecodeHalf(compact->velocityY[k]);
+        *z = DecodeHalf(compact->velocityZ[k]);
+    }
+    else {
+        *x = flock->packedVelocityX[k];
+        *y = flock->packedVelocityY[k];
+        *z = flock->packedVelocityZ[k];
+    }
+}
+
+static void PermuteFloats(const float *restrict values, const int *restrict order, int count, float *restrict permuted) {
+    for (int i = 0; i < count; i++) permuted[i] = values[order[i]];
+}
+
+// Sorts boids along a Morton curve so boids that are close in space are close in memory.
+// Neighbour indexes are remapped to the new slots and slots follows every id, the ids
+// themselves never change.
+void ReorderBoids(Flock *flock) {
+    int count = flock->count;
+    unsigned int *keys = ArenaAlloc(&flock->scratch, count*sizeof(unsigned int), ARENA_TAG_SCRATCH);
+    unsigned int *keyScratch = ArenaAlloc(&flock->scratch, count*sizeof(unsigned int), ARENA_TAG_SCRATCH);
+    int *order = ArenaAlloc(&flock->scratch, count*sizeof(int), ARENA_TAG_SCRATCH);
+    int *newSlots = ArenaAlloc(&flock->scratch, count*sizeof(int), ARENA_TAG_SCRATCH);
+
+    for (int i = 0; i < count; i++) {
+        keys[i] = SpatialGridMortonCode(&flock->grid, flock->positionX[i], flock->positionY[i], flock->positionZ[i]);
+        order[i] = i;
+    }
+    SortIndexesByKey(keys, order, count, keyScratch, newSlots);
+
+    for (int i = 0; i < count; i++) newSlots[order[i]] = i;
+
+    // Sorted into the next state, which then becomes the current one
+    PermuteFloats(flock->positionX, order, count, flock->nextPositionX);
+    PermuteFloats(flock->positionY, order, count, flock->nextPositionY);
+    PermuteFloats(flock->positionZ, order, count, flock->nextPositionZ);
+    PermuteFloats(flock->velocityX, order, count, flock->nextVelocityX);
+    PermuteFloats(flock->velocityY, order, count, flock->nextVelocityY);
+    PermuteFloats(flock->velocityZ, order, count, flock->nextVelocityZ);
+    SwapFlockState(flock);
+    flock->previousStateValid = false;
+
+    if (flock->neighbourIndexes != NULL) {
+        int *neighbourCounts = ArenaAlloc(&flock->scratch, count*sizeof(int), ARENA_TAG_SCRATCH);
+        int (*neighbourIndexes)[MAX_NEIGHBOURS] = ArenaAlloc(&flock->scratch, count*sizeof(*neighbourIndexes), ARENA_TAG_SCRATCH);
+
+        for (int i = 0; i < count; i++) {
+            int from = order[i];
+            neighbourCounts[i] = flock->neighbourCounts[from];
+            for (int n = 0; n < neighbourCounts[i]; n++) {
+                neighbourIndexes[i][n] = newSlots[flock->neighbourIndexes[from][n]];
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            flock->neighbourCounts[i] = neighbourCounts[i];
+            for (int n = 0; n < neighbourCounts[i]; n++) flock->neighbourIndexes[i][n] = neighbourIndexes[i][n];
+        }
+    }
+
+    // Verlet lists hold slots of the old order. The incremental grid holds ids and is kept.
+    flock->verletValid = false;
+
+    // order doubles as the id scratch, it is not needed once the arrays are moved
+    for (int i = 0; i < count; i++) order[i] = flock->ids[order[i]];
+    for (int i = 0; i < count; i++) {
+        flock->ids[i] = order[i];
+        flock->slots[flock->ids[i]] = i;
+    }
+}
+
+const char *GetNeighbourSearchName(NeighbourSearch search) {
+    switch (search) {
+        case NEIGHBOUR_SEARCH_GRID: return "grid";
+        case NEIGHBOUR_SEARCH_OCTREE: return "octree";
+        case NEIGHBOUR_SEARCH_BRUTE_FORCE: return "brute force";
+        case NEIGHBOUR_SEARCH_VERLET: return "verlet lists";
+        case NEIGHBOUR_SEARCH_INCREMENTAL_GRID: return "incremental grid";
+        default: return "unknown";
+    }
+}
+
+const char *GetNeighbourSelectionName(NeighbourSelection selection) {
+    switch (selection) {
+        case NEIGHBOUR_SELECTION_FIRST_BY_ID: return "first by id";
+        case NEIGHBOUR_SELECTION_NEAREST: return "nearest";
+        default: return "unknown";
+    }
+}
+
+const char *GetFlockPhaseName(FlockPhase phase) {
+    switch (phase) {
+        case FLOCK_PHASE_REORDER: return "reorder";
+        case FLOCK_PHASE_SEARCH: return "search";
+        case FLOCK_PHASE_NEIGHBOURS: return "neighbours";
+        case FLOCK_PHASE_STEERING: return "steering";
+        case FLOCK_PHASE_MOVE: return "move";
+        default: return "unknown";
+    }
+}
+
+// True when the Verlet lists can no longer be trusted: never built, boids were reordered,
+// sorted for the other selection, or some boid has moved more than half the skin since the build. Two boids closing in on
+// each other by that much each can then have crossed the whole skin.
+static bool IsVerletRebuildNeeded(const Flock *flock) {
+    if (!flock->verletValid) return true;
+    if (flock->verletSortedById != (flock->neighbourSelection == NEIGHBOUR_SELECTION_FIRST_BY_ID)) return true;
+
+    float halfSkin = 0.5f*flock->verletSkin;
+    float maxMoveSq = 0.0f;
+    for (int i = 0; i < flock->count; i++) {
+        float dx = flock->positionX[i] - flock->verletPositionX[i];
+        float dy = flock->positionY[i] - flock->verletPositionY[i];
+        float dz = flock->positionZ[i] - flock->verletPositionZ[i];
+        float moveSq = dx*dx + dy*dy + dz*dz;
+        maxMoveSq = (moveSq > maxMoveSq)? moveSq : maxMoveSq;
+    }
+
+    return (maxMoveSq > halfSkin*halfSkin);
+}
+
+// Buckets the boids in a grid as wide as the list radius, so the lists and the packed order
+// stay fixed until the next rebuild
+static void BuildVerletGrid(Flock *flock) {
+    float radius = flock->perceptionRadius + flock->verletSkin;
+    SpatialGrid *grid = &flock->verletGrid;
+
+    if ((grid->cellSize != radius) || (grid->capacity < flock->capacity)) {
+        UnloadSpatialGrid(grid);
+        *grid = LoadSpatialGrid(flock->boundsX, flock->boundsY, flock->boundsZ, radius, flock->capacity, &flock->arena);
+    }
+
+    for (int i = 0; i < flock->count; i++) {
+        SpatialGridInsert(grid, i, flock->positionX[i], flock->positionY[i], flock->positionZ[i]);
+        flock->verletPositionX[i] = flock->positionX[i];
+        flock->verletPositionY[i] = flock->positionY[i];
+        flock->verletPositionZ[i] = flock->positionZ[i];
+    }
+    SpatialGridBuild(grid, flock->count, flock->slots);
+}
+
+// Lists everything within the list radius, whatever its heading, from the packed copies
+static void BuildVerletLists(Flock *flock) {
+    unsigned int *keys = ArenaAlloc(&flock->scratch, flock->count*sizeof(unsigned int), ARENA_TAG_SCRATCH);
+    unsigned int *keyScratch = ArenaAlloc(&flock->scratch, flock->count*sizeof(unsigned int), ARENA_TAG_SCRATCH);
+    int *indexScratch = ArenaAlloc(&flock->scratch, flock->count*sizeof(int), ARENA_TAG_SCRATCH);
+    const SpatialGrid *grid = &flock->verletGrid;
+    CompactCandidates compact = GetCompactCandidates(flock);
+    float radius = flock->perceptionRadius + flock->verletSkin;
+    float radiusSq = radius*radius;
+    int cells[SPATIAL_GRID_MAX_NEIGHBOUR_CELLS];
+    int total = 0;
+
+    flock->verletSortedById = (flock->neighbourSelection == NEIGHBOUR_SELECTION_FIRST_BY_ID);
+    for (int i = 0; i < flock->count; i++) {
+        int cellCount = SpatialGridNeighbourCells(grid, grid->pointCells[i], cells);
+        int listStart = total;
+
+        for (int c = 0; c < cellCount; c++) {
+            int start = grid->cellStart[cells[c]];
+            int end = grid->cellStart[cells[c] + 1];
+
+            if (total + (end - start) > flock->verletCapacity) {
+                int capacity = (flock->verletCapacity > 0)? flock->verletCapacity : 16*flock->capacity;
+                while (total + (end - start) > capacity) capacity *= 2;
+                flock->verletNeighbours = (int *)ArenaGrow(&flock->arena, flock->verletNeighbours, flock->verletCapacity*sizeof(int),
+                                                           capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+                flock->verletCapacity = capacity;
+            }
+
+            // Branch-free: every candidate is written, only the ones in range advance the count
+            for (int k = start; k < end; k++) {
+                float x, y, z;
+                ReadPackedPosition(flock, &compact, k, &x, &y, &z);
+                float dx = x - flock->positionX[i];
+                float dy = y - flock->positionY[i];
+                float dz = z - flock->positionZ[i];
+                flock->verletNeighbours[total] = k;
+                total += (dx*dx + dy*dy + dz*dz < radiusSq) & (grid->cellIndexes[k] != i);
+            }
+        }
+
+        // Cells come out one after another, in packed order. Selecting by id needs the list in
+        // id order so the scan can stop early.
+        if (flock->verletSortedById) {
+            int listCount = total - listStart;
+            int *list = flock->verletNeighbours + listStart;
+            for (int n = 0; n < listCount; n++) keys[n] = (unsigned int)flock->packedIds[list[n]];
+            SortIndexesByKey(keys, list, listCount, keyScratch, indexScratch);
+        }
+
+        flock->verletStart[i] = listStart;
+    }
+    flock->verletStart[flock->count] = total;
+
+    flock->verletValid = true;
+    flock->verletRebuilds++;
+}
+
+// Builds the search structure and copies the current state into its order. Packed
+// positions no boid is at, the gaps of the incremental grid, are skipped.
+static void BuildNeighbourSearch(Flock *flock) {
+    bool verletRebuild = false;
+    int packedCount = flock->count;
+
+    switch (flock->neighbourSearch) {
+        case NEIGHBOUR_SEARCH_OCTREE: {
+            BuildOctree(&flock->octree, flock->positionX, flock->positionY, flock->positionZ, flock->count, flock->slots);
+            ReserveOctreeQueues(&flock->octree, (flock->threadPool != NULL)? flock->threadPool->threadCount : 1);
+            flock->packedIndexes = flock->octree.pointIndexes;
+        } break;
+        case NEIGHBOUR_SEARCH_BRUTE_FORCE: {
+            flock->packedIndexes = flock->slots;
+        } break;
+        case NEIGHBOUR_SEARCH_VERLET: {
+            verletRebuild = IsVerletRebuildNeeded(flock);
+            if (verletRebuild) BuildVerletGrid(flock);
+            flock->packedIndexes = flock->verletGrid.cellIndexes;
+        } break;
+        case NEIGHBOUR_SEARCH_INCREMENTAL_GRID: {
+            // The grid's entries are the packed positions, cells and gaps alike, so nothing is
+            // laid out here. It holds ids, so a reorder leaves it valid. Selecting by id wants
+            // the cells in id order, only those moves left out of it are sorted.
+            DynamicSpatialGrid *grid = &flock->incrementalGrid;
+            if (!flock->incrementalGridValid) {
+                DynamicSpatialGridClear(grid);
+                for (int id = 0; id < flock->count; id++) {
+                    int i = flock->slots[id];
+                    DynamicSpatialGridInsert(grid, id, flock->positionX[i], flock->positionY[i], flock->positionZ[i]);
+                }
+                flock->incrementalGridValid = true;
+            }
+            if (flock->neighbourSelection == NEIGHBOUR_SELECTION_FIRST_BY_ID) DynamicSpatialGridSortCells(grid);
+
+            if (grid->indexCapacity > flock->packedCapacity) ReservePackedCapacity(flock, grid->indexCapacity);
+            if (flock->packedSlots == NULL) flock->packedSlots = ArenaAlloc(&flock->arena, flock->packedCapacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+            for (int k = 0; k < grid->indexCount; k++) {
+                int id = grid->cellIndexes[k];
+                flock->packedSlots[k] = (id >= 0)? flock->slots[id] : -1;
+            }
+            flock->packedIndexes = flock->packedSlots;
+            packedCount = grid->indexCount;
+        } break;
+        default: {
+            SpatialGrid *grid = &flock->grid;
+            for (int i = 0; i < flock->count; i++) {
+                SpatialGridInsert(grid, i, flock->positionX[i], flock->positionY[i], flock->positionZ[i]);
+            }
+            SpatialGridBuild(grid, flock->count, flock->slots);
+            flock->packedIndexes = grid->cellIndexes;
+        } break;
+    }
+
+    if (flock->compactState) {
+        CompactCandidates compact = GetCompactCandidates(flock);
+        float inverseScaleX = 1.0f/compact.scaleX;
+        float inverseScaleY = 1.0f/compact.scaleY;
+        float inverseScaleZ = 1.0f/compact.scaleZ;
+
+        if (flock->compactPositionX == NULL) ReserveCompactState(flock, flock->packedCapacity);
+        for (int k = 0; k < packedCount; k++) {
+            int y = flock->packedIndexes[k];
+            if (y < 0) continue;
+            flock->compactPositionX[k] = EncodeFixed(flock->positionX[y], compact.originX, inverseScaleX);
+            flock->compactPositionY[k] = EncodeFixed(flock->positionY[y], compact.originY, inverseScaleY);
+            flock->compactPositionZ[k] = EncodeFixed(flock->positionZ[y], compact.originZ, inverseScaleZ);
+            flock->compactVelocityX[k] = EncodeHalf(flock->velocityX[y]);
+            flock->compactVelocityY[k] = EncodeHalf(flock->velocityY[y]);
+            flock->compactVelocityZ[k] = EncodeHalf(flock->velocityZ[y]);
+            flock->packedIds[k] = flock->ids[y];
+        }
+    }
+    else {
+        if (flock->packedPositionX == NULL) ReservePackedState(flock, flock->packedCapacity);
+        for (int k = 0; k < packedCount; k++) {
+            int y = flock->packedIndexes[k];
+            if (y < 0) continue;
+            flock->packedPositionX[k] = flock->positionX[y];
+            flock->packedPositionY[k] = flock->positionY[y];
+            flock->packedPositionZ[k] = flock->positionZ[y];
+            flock->packedVelocityX[k] = flock->velocityX[y];
+            flock->packedVelocityY[k] = flock->velocityY[y];
+            flock->packedVelocityZ[k] = flock->velocityZ[y];
+            flock->packedIds[k] = flock->ids[y];
+        }
+    }
+
+    if (verletRebuild) BuildVerletLists(flock);
+}
+
+// Neighbours kept for one boid while the search runs, as packed positions. Sorted by id when
+// selecting by id, a max-heap on distance when selecting the nearest.
+typedef struct NeighbourList {
+    const Flock *flock;
+    int boid;
+    int thread;                 // Picks the query scratch, one per thread
+    int limit;
+    int count;
+    bool nearest;
+    int *neighbours;
+    float distancesSq[MAX_NEIGHBOURS];
+    NeighbourCandidates candidates;
+    CompactCandidates compact;  // Read instead of candidates with compactState
+    NeighbourQuery query;
+} NeighbourList;
+
+// Inserts packed position k keeping the list sorted by id, dropping the largest id when full
+static void InsertNeighbour(NeighbourList *list, int k) {
+    const int *packedIds = list->flock->packedIds;
+    int *neighbours = list->neighbours;
+    int slot = (list->count < list->limit)? list->count++ : list->count - 1;
+    while ((slot > 0) && (packedIds[neighbours[slot - 1]] > packedIds[k])) {
+        neighbours[slot] = neighbours[slot - 1];
+        slot--;
+    }
+    neighbours[slot] = k;
+}
+
+// True once the list is full and every id from packed position k up is too large to get in
+static bool IsNeighbourListClosed(const NeighbourList *list, int k) {
+    const int *packedIds = list->flock->packedIds;
+    return (list->count == list->limit) && (packedIds[k] > packedIds[list->neighbours[list->count - 1]]);
+}
+
+// Distance then id, so the nearest set does not depend on the order candidates come in
+static bool IsFartherNeighbour(const NeighbourList *list, float distanceSqA, int a, float distanceSqB, int b) {
+    const int *packedIds = list->flock->packedIds;
+    return (distanceSqA > distanceSqB) || ((distanceSqA == distanceSqB) && (packedIds[a] > packedIds[b]));
+}
+
+static void SiftNearestNeighbourDown(NeighbourList *list, int slot, float distanceSq, int k) {
+    for (;;) {
+        int child = 2*slot + 1;
+        if (child >= list->count) break;
+        if ((child + 1 < list->count) && IsFartherNeighbour(list, list->distancesSq[child + 1], list->neighbours[child + 1],
+                                                            list->distancesSq[child], list->neighbours[child])) child++;
+        if (!IsFartherNeighbour(list, list->distancesSq[child], list->neighbours[child], distanceSq, k)) break;
+        list->neighbours[slot] = list->neighbours[child];
+        list->distancesSq[slot] = list->distancesSq[child];
+        slot = child;
+    }
+    list->neighbours[slot] = k;
+    list->distancesSq[slot] = distanceSq;
+}
+
+// Bounded max-heap insert. Once the heap is full the query radius shrinks to the farthest
+// kept distance, so the kernel rejects anything that could not get in. The radius is nudged
+// up one float step because a tie on distance can still win on id.
+static void InsertNearestNeighbour(NeighbourList *list, int k) {
+    float x, y, z;
+    ReadPackedPosition(list->flock, &list->compact, k, &x, &y, &z);
+    float dx = x - list->query.x;
+    float dy = y - list->query.y;
+    float dz = z - list->query.z;
+    float distanceSq = dx*dx + dy*dy + dz*dz;
+
+    if (list->count < list->limit) {
+        int slot = list->count++;
+        while ((slot > 0) && IsFartherNeighbour(list, distanceSq, k, list->distancesSq[(slot - 1)/2], list->neighbours[(slot - 1)/2])) {
+            list->neighbours[slot] = list->neighbours[(slot - 1)/2];
+            list->distancesSq[slot] = list->distancesSq[(slot - 1)/2];
+            slot = (slot - 1)/2;
+        }
+        list->neighbours[slot] = k;
+        list->distancesSq[slot] = distanceSq;
+    }
+    else if (IsFartherNeighbour(list, list->distancesSq[0], list->neighbours[0], distanceSq, k)) {
+        SiftNearestNeighbourDown(list, 0, distanceSq, k);
+    }
+    else return;
+
+    if (list->count == list->limit) list->query.radiusSq = nextafterf(list->distancesSq[0], INFINITY);
+}
+
+// Tests the packed run [start, end), a block at a time through the vectorised neighbour
+// kernel. When selecting by id from a run in id order, the scan stops at the first id too
+// large to keep.
+static void ScanNeighbourRun(NeighbourList *list, int start, int end, bool sortedById) {
+    int accepted[NEIGHBOUR_BLOCK + NEIGHBOUR_KERNEL_SLACK];
+
+    for (int block = start; block < end; block += NEIGHBOUR_BLOCK) {
+        int blockEnd = (block + NEIGHBOUR_BLOCK < end)? block + NEIGHBOUR_BLOCK : end;
+        int acceptedCount = (list->flock->compactState)? FilterCompactNeighbours(&list->compact, block, blockEnd, &list->query, accepted) :
+                                                         FilterNeighbours(&list->candidates, block, blockEnd, &list->query, accepted);
+
+        for (int a = 0; a < acceptedCount; a++) {
+            int k = accepted[a];
+            if (list->nearest) {
+                if (list->flock->packedIndexes[k] != list->boid) InsertNearestNeighbour(list, k);
+                continue;
+            }
+            if (IsNeighbourListClosed(list, k)) {
+                if (sortedById) return;
+            }
+            else if (list->flock->packedIndexes[k] != list->boid) InsertNeighbour(list, k);
+        }
+    }
+}
+
+// Tests the packed positions listed in indexes, gathered a block at a time so the neighbour
+// kernel can test them. The scan stops early only when the indexes are sorted by id.
+static void ScanNeighbourIndexes(NeighbourList *list, const int *indexes, int count, bool sortedById) {
+    const Flock *flock = list->flock;
+    float x[NEIGHBOUR_BLOCK], y[NEIGHBOUR_BLOCK], z[NEIGHBOUR_BLOCK];
+    float velocityX[NEIGHBOUR_BLOCK], velocityY[NEIGHBOUR_BLOCK], velocityZ[NEIGHBOUR_BLOCK];
+    uint16_t compactX[NEIGHBOUR_BLOCK + NEIGHBOUR_KERNEL_SLACK], compactY[NEIGHBOUR_BLOCK + NEIGHBOUR_KERNEL_SLACK];
+    uint16_t compactZ[NEIGHBOUR_BLOCK + NEIGHBOUR_KERNEL_SLACK], compactVelocityX[NEIGHBOUR_BLOCK + NEIGHBOUR_KERNEL_SLACK];
+    uint16_t compactVelocityY[NEIGHBOUR_BLOCK + NEIGHBOUR_KERNEL_SLACK], compactVelocityZ[NEIGHBOUR_BLOCK + NEIGHBOUR_KERNEL_SLACK];
+    NeighbourCandidates gathered = { x, y, z, velocityX, velocityY, velocityZ };
+    CompactCandidates gatheredCompact = list->compact;
+    int accepted[NEIGHBOUR_BLOCK + NEIGHBOUR_KERNEL_SLACK];
+
+    gatheredCompact.x = compactX;
+    gatheredCompact.y = compactY;
+    gatheredCompact.z = compactZ;
+    gatheredCompact.velocityX = compactVelocityX;
+    gatheredCompact.velocityY = compactVelocityY;
+    gatheredCompact.velocityZ = compactVelocityZ;
+
+    for (int block = 0; block < count; block += NEIGHBOUR_BLOCK) {
+        int blockCount = (count - block < NEIGHBOUR_BLOCK)? count - block : NEIGHBOUR_BLOCK;
+        int acceptedCount = 0;
+
+        if (flock->compactState) {
+            for (int b = 0; b < blockCount; b++) {
+                int k = indexes[block + b];
+                compactX[b] = flock->compactPositionX[k];
+                compactY[b] = flock->compactPositionY[k];
+                compactZ[b] = flock->compactPositionZ[k];
+                compactVelocityX[b] = flock->compactVelocityX[k];
+                compactVelocityY[b] = flock->compactVelocityY[k];
+                compactVelocityZ[b] = flock->compactVelocityZ[k];
+            }
+            acceptedCount = FilterCompactNeighbours(&gatheredCompact, 0, blockCount, &list->query, accepted);
+        }
+        else {
+            for (int b = 0; b < blockCount; b++) {
+                int k = indexes[block + b];
+                x[b] = flock->packedPositionX[k];
+                y[b] = flock->packedPositionY[k];
+                z[b] = flock->packedPositionZ[k];
+                velocityX[b] = flock->packedVelocityX[k];
+                velocityY[b] = flock->packedVelocityY[k];
+                velocityZ[b] = flock->packedVelocityZ[k];
+            }
+            acceptedCount = FilterNeighbours(&gathered, 0, blockCount, &list->query, accepted);
+        }
+
+        for (int a = 0; a < acceptedCount; a++) {
+            int k = indexes[block + accepted[a]];
+            if (flock->packedIndexes[k] == list->boid) continue;
+
+            if (list->nearest) InsertNearestNeighbour(list, k);
+            else if (IsNeighbourListClosed(list, k)) {
+                if (sortedById) return;
+            }
+            else InsertNeighbour(list, k);
+        }
+    }
+}
+
+// Filters the boid's Verlet list by true distance and heading
+static void FindVerletNeighbours(NeighbourList *list) {
+    const Flock *flock = list->flock;
+    int start = flock->verletStart[list->boid];
+
+    ScanNeighbourIndexes(list, flock->verletNeighbours + start, flock->verletStart[list->boid + 1] - start, flock->verletSortedById);
+}
+
+// Cells around cell, the cell itself first: the nearest neighbours are usually there, so
+// the radius shrinks early when selecting the nearest
+static int SurroundingCells(const SpatialGrid *grid, int cell, int *cells) {
+    int cellCount = SpatialGridNeighbourCells(grid, cell, cells);
+
+    for (int c = 1; c < cellCount; c++) {
+        if (cells[c] == cell) {
+            cells[c] = cells[0];
+            cells[0] = cell;
+            break;
+        }
+    }
+
+    return cellCount;
+}
+
+static void FindGridNeighbours(NeighbourList *list) {
+    const SpatialGrid *grid = &list->flock->grid;
+    int cells[SPATIAL_GRID_MAX_NEIGHBOUR_CELLS];
+    int cellCount = SurroundingCells(grid, grid->pointCells[list->boid], cells);
+
+    for (int c = 0; c < cellCount; c++) ScanNeighbourRun(list, grid->cellStart[cells[c]], grid->cellStart[cells[c] + 1], true);
+}
+
+// Every cell is a packed run. When selecting by id the cells are sorted, so like the rebuilt
+// grid the scan of a cell stops at the first id too large to keep.
+static void FindIncrementalGridNeighbours(NeighbourList *list) {
+    const DynamicSpatialGrid *grid = &list->flock->incrementalGrid;
+    int cells[SPATIAL_GRID_MAX_NEIGHBOUR_CELLS];
+    int cellCount = SurroundingCells(&grid->layout, grid->pointCells[list->flock->ids[list->boid]], cells);
+
+    for (int c = 0; c < cellCount; c++) ScanNeighbourRun(list, grid->cellStart[cells[c]], grid->cellStart[cells[c]] + grid->cellCounts[cells[c]], true);
+}
+
+// True when no point in the node can get into the list: it is out of reach, or the list is
+// full and the node's smallest id is too large. The tree is built in id order, so build
+// positions are ids.
+static bool IsOctreeNodeSkipped(const NeighbourList *list, const OctreeNode *node, float distanceSq) {
+    const int *packedIds = list->flock->packedIds;
+    if (!list->nearest && (list->count == list->limit) && (node->firstOrder > packedIds[list->neighbours[list->count - 1]])) return true;
+    return (distanceSq >= list->query.radiusSq);
+}
+
+// Non-negative floats order the same as their bit patterns
+static int DistanceOrder(float distanceSq) {
+    int bits;
+    memcpy(&bits, &distanceSq, sizeof(bits));
+    return bits;
+}
+
+// Min-heap of cursors keyed on their smallest build position
+static void PushOctreeCursor(OctreeCursor *queue, int *queueSize, OctreeCursor cursor) {
+    int slot = (*queueSize)++;
+    while ((slot > 0) && (queue[(slot - 1)/2].order > cursor.order)) {
+        queue[slot] = queue[(slot - 1)/2];
+        slot = (slot - 1)/2;
+    }
+    queue[slot] = cursor;
+}
+
+static OctreeCursor PopOctreeCursor(OctreeCursor *queue, int *queueSize) {
+    OctreeCursor top = queue[0];
+    OctreeCursor last = queue[--(*queueSize)];
+    int slot = 0;
+
+    for (;;) {
+        int child = 2*slot + 1;
+        if (child >= *queueSize) break;
+        if ((child + 1 < *queueSize) && (queue[child + 1].order < queue[child].order)) child++;
+        if (last.order <= queue[child].order) break;
+        queue[slot] = queue[child];
+        slot = child;
+    }
+    queue[slot] = last;
+
+    return top;
+}
+
+// When selecting by id, merges the leaves in reach in id order, a kernel block at a time:
+// the smallest id waiting is always scanned next, so the candidates tested are close to what
+// a scan over every boid in id order would test before it stops. The tree is built in id
+// order, so build positions are ids. When selecting the nearest, nodes are walked nearest
+// first instead, whole leaves at a time, until the nearest waiting node is beyond the shrunk
+// radius. The queue never holds a node together with one of its ancestors, so it fits in the
+// thread's query scratch.
+static void FindOctreeNeighbours(NeighbourList *list) {
+    const Octree *tree = &list->flock->octree;
+    const int *packedIds = list->flock->packedIds;
+    OctreeCursor *queue = GetOctreeQueue(tree, list->thread);
+    int queueSize = 0;
+
+    if (tree->nodeCount > 0) {
+        float distanceSq = OctreeNodeDistanceSq(&tree->nodes[0], list->query.x, list->query.y, list->query.z);
+        int order = list->nearest? DistanceOrder(distanceSq) : tree->nodes[0].firstOrder;
+        if (!IsOctreeNodeSkipped(list, &tree->nodes[0], distanceSq)) PushOctreeCursor(queue, &queueSize, (OctreeCursor){ order, 0, 0 });
+    }
+    while (queueSize > 0) {
+        OctreeCursor cursor = PopOctreeCursor(queue, &queueSize);
+        const OctreeNode *node = &tree->nodes[cursor.node];
+
+        // Cursors come out in order, once one is out of reach every other one is too
+        if (list->nearest) {
+            if (cursor.order >= DistanceOrder(list->query.radiusSq)) break;
+        }
+        else if ((list->count == list->limit) && (cursor.order > packedIds[list->neighbours[list->count - 1]])) break;
+
+        if (node->firstChild < 0) {
+            int blockEnd = (cursor.start + NEIGHBOUR_BLOCK < node->end)? cursor.start + NEIGHBOUR_BLOCK : node->end;
+            if (list->nearest) blockEnd = node->end;
+            ScanNeighbourRun(list, cursor.start, blockEnd, true);
+            if (blockEnd < node->end) PushOctreeCursor(queue, &queueSize, (OctreeCursor){ packedIds[blockEnd], cursor.node, blockEnd });
+        }
+        else {
+            for (int c = node->firstChild; c < node->firstChild + node->childCount; c++) {
+                const OctreeNode *child = &tree->nodes[c];
+                float distanceSq = OctreeNodeDistanceSq(child, list->query.x, list->query.y, list->query.z);
+                int order = list->nearest? DistanceOrder(distanceSq) : child->firstOrder;
+                if (!IsOctreeNodeSkipped(list, child, distanceSq)) PushOctreeCursor(queue, &queueSize, (OctreeCursor){ order, c, child->start });
+            }
+        }
+    }
+}
+
+// Puts a nearest heap back in id order, so steering sums neighbours in the same order
+// whatever order they were found in
+static void SortNeighboursById(NeighbourList *list) {
+    const int *packedIds = list->flock->packedIds;
+    for (int n = 1; n < list->count; n++) {
+        int k = list->neighbours[n];
+        int slot = n;
+        while ((slot > 0) && (packedIds[list->neighbours[slot - 1]] > packedIds[k])) {
+            list->neighbours[slot] = list->neighbours[slot - 1];
+            slot--;
+        }
+        list->neighbours[slot] = k;
+    }
+}
+
+// Neighbours are picked by flock->neighbourSelection out of the matches within the
+// perception radius, the same set a scan over every boid would pick, and independent of
+// where boids sit in the arrays or which search structure finds them. Writes the packed
+// positions of the neighbours of boid i, sorted by id, and returns how many there are.
+static int FindNeighbours(const Flock *flock, int i, int *neighbours, int thread) {
+    NeighbourList list = {
+        flock, i, thread, flock->neighbourLimit, 0, (flock->neighbourSelection == NEIGHBOUR_SELECTION_NEAREST), neighbours, { 0 },
+        { flock->packedPositionX, flock->packedPositionY, flock->packedPositionZ,
+          flock->packedVelocityX, flock->packedVelocityY, flock->packedVelocityZ },
+        GetCompactCandidates(flock),
+        { flock->positionX[i], flock->positionY[i], flock->positionZ[i],
+          flock->velocityX[i], flock->velocityY[i], flock->velocityZ[i],
+          flock->perceptionRadius*flock->perceptionRadius }
+    };
+
+    switch (flock->neighbourSearch) {
+        case NEIGHBOUR_SEARCH_OCTREE: FindOctreeNeighbours(&list); break;
+        case NEIGHBOUR_SEARCH_BRUTE_FORCE: ScanNeighbourRun(&list, 0, flock->count, true); break;
+        case NEIGHBOUR_SEARCH_VERLET: FindVerletNeighbours(&list); break;
+        case NEIGHBOUR_SEARCH_INCREMENTAL_GRID: FindIncrementalGridNeighbours(&list); break;
+        default: FindGridNeighbours(&list); break;
+    }
+    if (list.nearest) SortNeighboursById(&list);
+
+    return list.count;
+}
+
+static void ReserveNeighbourLists(Flock *flock) {
+    if (flock->neighbourIndexes == NULL) {
+        flock->neighbourIndexes = ArenaAlloc(&flock->arena, flock->capacity*sizeof(*flock->neighbourIndexes), ARENA_TAG_NEIGHBOUR_LISTS);
+    }
+}
+
+static void UpdateBoidNeighboursRange(void *context, int start, int end, int thread) {
+    Flock *flock = ((FlockJob *)context)->flock;
+
+    for (int i = start; i < end; i++) {
+        int *neighbours = flock->neighbourIndexes[i];
+        int neighbourCount = FindNeighbours(flock, i, neighbours, thread);
+
+        for (int n = 0; n < neighbourCount; n++) neighbours[n] = flock->packedIndexes[neighbours[n]];
+        flock->neighbourCounts[i] = neighbourCount;
+    }
+}
+
+void UpdateBoidNeighbours(Flock *flock) {
+    ReserveNeighbourLists(flock);
+    BuildNeighbourSearch(flock);
+    RunFlockPass(flock, UpdateBoidNeighboursRange, 0.0f);
+}
+
+static void SteerSeparationRange(void *context, int start, int end, int thread) {
+    Flock *flock = ((FlockJob *)context)->flock;
+    float avoidFactor = 0.02f;
+
+    for (int i = start; i < end; i++) {
+        float directionX = 0.0f;
+        float directionY = 0.0f;
+        float directionZ = 0.0f;
+        int neighbourCount = flock->neighbourCounts[i];
+
+        for (int n = 0; n < neighbourCount; n++) {
+            int neighbourIndex = flock->neighbourIndexes[i][n];
+            directionX += flock->positionX[i] - flock->positionX[neighbourIndex];
+            directionY += flock->positionY[i] - flock->positionY[neighbourIndex];
+            directionZ += flock->positionZ[i] - flock->positionZ[neighbourIndex];
+        }
+
+        float velocityX = flock->velocityX[i];
+        float velocityY = flock->velocityY[i];
+        float velocityZ = flock->velocityZ[i];
+
+        if (neighbourCount > 0) {
+            // Average, then normalize to unit length
+            float scale = 1.0f/neighbourCount;
+            directionX *= scale;
+            directionY *= scale;
+            directionZ *= scale;
+
+            float length = sqrtf(directionX*directionX + directionY*directionY + directionZ*directionZ);
+            if (length != 0.0f) {
+                float inverseLength = 1.0f/length;
+                directionX *= inverseLength;
+                directionY *= inverseLength;
+                directionZ *= inverseLength;
+            }
+
+            velocityX += directionX*avoidFactor;
+            velocityY += directionY*avoidFactor;
+            velocityZ += directionZ*avoidFactor;
+        }
+
+        flock->nextVelocityX[i] = velocityX;
+        flock->nextVelocityY[i] = velocityY;
+        flock->nextVelocityZ[i] = velocityZ;
+    }
+}
+
+// Writes every next velocity from the current one, so it runs before the other passes
+void SteerSeparation(Flock *flock) {
+    RunFlockPass(flock, SteerSeparationRange, 0.0f);
+}
+
+static void SteerAlignmentRange(void *context, int start, int end, int thread) {
+    Flock *flock = ((FlockJob *)context)->flock;
+    float matchingFactor = 0.05f;
+
+    for (int i = start; i < end; i++) {
+        float velocityAvgX = 0.0f;
+        float velocityAvgY = 0.0f;
+        float velocityAvgZ = 0.0f;
+        int neighbourCount = flock->neighbourCounts[i];
+
+        for (int n = 0; n < neighbourCount; n++) {
+            int neighbourIndex = flock->neighbourIndexes[i][n];
+            velocityAvgX += flock->velocityX[neighbourIndex];
+            velocityAvgY += flock->velocityY[neighbourIndex];
+            velocityAvgZ += flock->velocityZ[neighbourIndex];
+        }
+
+        if (neighbourCount > 0) {
+            velocityAvgX = velocityAvgX/neighbourCount;
+            velocityAvgY = velocityAvgY/neighbourCount;
+            velocityAvgZ = velocityAvgZ/neighbourCount;
+        }
+
+        flock->nextVelocityX[i] += (velocityAvgX - flock->nextVelocityX[i])*matchingFactor;
+        flock->nextVelocityY[i] += (velocityAvgY - flock->nextVelocityY[i])*matchingFactor;
+        flock->nextVelocityZ[i] += (velocityAvgZ - flock->nextVelocityZ[i])*matchingFactor;
+    }
+}
+
+void SteerAlignment(Flock *flock) {
+    RunFlockPass(flock, SteerAlignmentRange, 0.0f);
+}
+
+static void SteerCohesionRange(void *context, int start, int end, int thread) {
+    Flock *flock = ((FlockJob *)context)->flock;
+    float centeringFactor = 0.004f;
+
+    for (int i = start; i < end; i++) {
+        float positionAvgX = 0.0f;
+        float positionAvgY = 0.0f;
+        float positionAvgZ = 0.0f;
+        int neighbourCount = flock->neighbourCounts[i];
+
+        for (int n = 0; n < neighbourCount; n++) {
+            int neighbourIndex = flock->neighbourIndexes[i][n];
+            positionAvgX += flock->positionX[neighbourIndex];
+            positionAvgY += flock->positionY[neighbourIndex];
+            positionAvgZ += flock->positionZ[neighbourIndex];
+        }
+
+        if (neighbourCount > 0) {
+            positionAvgX /= neighbourCount;
+            positionAvgY /= neighbourCount;
+            positionAvgZ /= neighbourCount;
+        }
+
+        flock->nextVelocityX[i] += (positionAvgX - flock->positionX[i])*centeringFactor;
+        flock->nextVelocityY[i] += (positionAvgY - flock->positionY[i])*centeringFactor;
+        flock->nextVelocityZ[i] += (positionAvgZ - flock->positionZ[i])*centeringFactor;
+    }
+}
+
+void SteerCohesion(Flock *flock) {
+    RunFlockPass(flock, SteerCohesionRange, 0.0f);
+}
+
+static void SteerFusedRange(void *context, int start, int end, int thread) {
+    Flock *flock = ((FlockJob *)context)->flock;
+    float avoidFactor = 0.02f;
+    float matchingFactor = 0.05f;
+    float centeringFactor = 0.004f;
+    int neighbours[MAX_NEIGHBOURS];
+    CompactCandidates compact = GetCompactCandidates(flock);
+
+    for (int i = start; i < end; i++) {
+        int neighbourCount = FindNeighbours(flock, i, neighbours, thread);
+        float positionX = flock->positionX[i];
+        float positionY = flock->positionY[i];
+        float positionZ = flock->positionZ[i];
+        float directionX = 0.0f;
+        float directionY = 0.0f;
+        float directionZ = 0.0f;
+        float velocityAvgX = 0.0f;
+        float velocityAvgY = 0.0f;
+        float velocityAvgZ = 0.0f;
+        float positionAvgX = 0.0f;
+        float positionAvgY = 0.0f;
+        float positionAvgZ = 0.0f;
+
+        for (int n = 0; n < neighbourCount; n++) {
+            float x, y, z, vx, vy, vz;
+            ReadPackedPosition(flock, &compact, neighbours[n], &x, &y, &z);
+            ReadPackedVelocity(flock, &compact, neighbours[n], &vx, &vy, &vz);
+            directionX += positionX - x;
+            directionY += positionY - y;
+            directionZ += positionZ - z;
+            velocityAvgX += vx;
+            velocityAvgY += vy;
+            velocityAvgZ += vz;
+            positionAvgX += x;
+            positionAvgY += y;
+            positionAvgZ += z;
+        }
+
+        float velocityX = flock->velocityX[i];
+        float velocityY = flock->velocityY[i];
+        float velocityZ = flock->velocityZ[i];
+
+        if (neighbourCount > 0) {
+            // Separation: average, normalize to unit length, then scale
+            float scale = 1.0f/neighbourCount;
+            directionX *= scale;
+            directionY *= scale;
+            directionZ *= scale;
+
+            float length = sqrtf(directionX*directionX + directionY*directionY + directionZ*directionZ);
+            if (length != 0.0f) {
+                float inverseLength = 1.0f/length;
+                directionX *= inverseLength;
+                directionY *= inverseLength;
+                directionZ *= inverseLength;
+            }
+
+            velocityX += directionX*avoidFactor;
+            velocityY += directionY*avoidFactor;
+            velocityZ += directionZ*avoidFactor;
+
+            velocityAvgX = velocityAvgX/neighbourCount;
+            velocityAvgY = velocityAvgY/neighbourCount;
+            velocityAvgZ = velocityAvgZ/neighbourCount;
+            positionAvgX /= neighbourCount;
+            positionAvgY /= neighbourCount;
+            positionAvgZ /= neighbourCount;
+        }
+
+        // Alignment
+        velocityX += (velocityAvgX - velocityX)*matchingFactor;
+        velocityY += (velocityAvgY - velocityY)*matchingFactor;
+        velocityZ += (velocityAvgZ - velocityZ)*matchingFactor;
+
+        // Cohesion
+        velocityX += (positionAvgX - positionX)*centeringFactor;
+        velocityY += (positionAvgY - positionY)*centeringFactor;
+        velocityZ += (positionAvgZ - positionZ)*centeringFactor;
+
+        flock->nextVelocityX[i] = velocityX;
+        flock->nextVelocityY[i] = velocityY;
+        flock->nextVelocityZ[i] = velocityZ;
+    }
+}
+
+// Separation, alignment and cohesion in one pass over each boid's neighbours, found on the
+// fly and read from the packed copies. Gives the same next velocities as the separate passes,
+// unless the copies are compact: then the neighbours are summed as the search decoded them.
+void SteerFused(Flock *flock) {
+    BuildNeighbourSearch(flock);
+    RunFlockPass(flock, SteerFusedRange, 0.0f);
+}
+
+// The per-boid passes below stream over plain arrays without branches, so they compile to
+// vector loops. Arrays come in as restrict parameters so the compiler knows they never overlap.
+static void KeepWithinBoundsStream(const float *restrict px, const float *restrict py, const float *restrict pz,
+                                   float *restrict vx, float *restrict vy, float *restrict vz,
+                                   int count, float boundsX, float boundsY, float boundsZ) {
+    float turnFactor = 0.1f; // Smaller value for smoother turning
+
+    for (int i = 0; i < count; i++) {
+        // Steer back towards the bounds on every axis that is outside them
+        float steeringX = (float)(px[i] < -boundsX) - (float)(px[i] > boundsX);
+        float steeringY = (float)(py[i] < -boundsY) - (float)(py[i] > boundsY);
+        float steeringZ = (float)(pz[i] < -boundsZ) - (float)(pz[i] > boundsZ);
+
+        // Normalize the steering vector and scale it, inside the bounds it is all zeros
+        float lengthSq = steeringX*steeringX + steeringY*steeringY + steeringZ*steeringZ;
+        float inverseLength = 1.0f/sqrtf((lengthSq > 0.0f)? lengthSq : 1.0f);
+        vx[i] += (steeringX*inverseLength)*turnFactor;
+        vy[i] += (steeringY*inverseLength)*turnFactor;
+        vz[i] += (steeringZ*inverseLength)*turnFactor;
+    }
+}
+
+static void ConstrainSpeedStream(float *restrict vx, float *restrict vy, float *restrict vz, int count) {
+    float maxSpeed = 3.0f;
+    float minSpeed = 2.0f;
+
+    for (int i = 0; i < count; i++) {
+        float speed = sqrtf(vx[i]*vx[i] + vy[i]*vy[i] + vz[i]*vz[i]);
+
+        // Rescale to the nearest limit, a zero velocity stays zero
+        int outside = (speed > maxSpeed) | (speed < minSpeed);
+        float limit = (speed > maxSpeed)? maxSpeed : minSpeed;
+        float inverseLength = 1.0f/((speed != 0.0f)? speed : 1.0f);
+        float limitedX = (vx[i]*inverseLength)*limit;
+        float limitedY = (vy[i]*inverseLength)*limit;
+        float limitedZ = (vz[i]*inverseLength)*limit;
+        vx[i] = outside? limitedX : vx[i];
+        vy[i] = outside? limitedY : vy[i];
+        vz[i] = outside? limitedZ : vz[i];
+    }
+}
+
+static void UpdateBoidPositionStream(const float *restrict px, const float *restrict py, const float *restrict pz,
+                                     const float *restrict vx, const float *restrict vy, const float *restrict vz,
+                                     float *restrict nextX, float *restrict nextY, float *restrict nextZ,
+                                     int count, float scale) {
+    for (int i = 0; i < count; i++) {
+        nextX[i] = px[i] + vx[i]*scale;
+        nextY[i] = py[i] + vy[i]*scale;
+        nextZ[i] = pz[i] + vz[i]*scale;
+    }
+}
+
+static void KeepWithinBoundsRange(void *context, int start, int end, int thread) {
+    Flock *flock = ((FlockJob *)context)->flock;
+
+    KeepWithinBoundsStream(flock->positionX + start, flock->positionY + start, flock->positionZ + start,
+                           flock->nextVelocityX + start, flock->nextVelocityY + start, flock->nextVelocityZ + start,
+                           end - start, flock->boundsX, flock->boundsY, flock->boundsZ);
+}
+
+// Steers the next velocities by the current positions
+void KeepWithinBounds(Flock *flock) {
+    RunFlockPass(flock, KeepWithinBoundsRange, 0.0f);
+}
+
+static void ConstrainSpeedRange(void *context, int start, int end, int thread) {
+    Flock *flock = ((FlockJob *)context)->flock;
+
+    ConstrainSpeedStream(flock->nextVelocityX + start, flock->nextVelocityY + start, flock->nextVelocityZ + start, end - start);
+}
+
+void ConstrainSpeed(Flock *flock) {
+    RunFlockPass(flock, ConstrainSpeedRange, 0.0f);
+}
+
+static bool IsIncrementalGridTracked(const Flock *flock) {
+    return (flock->neighbourSearch == NEIGHBOUR_SEARCH_INCREMENTAL_GRID) && flock->incrementalGridValid;
+}
+
+// Claims the next entry of the crossed list, from any thread of the job
+static int ClaimCrossedSlot(Flock *flock) {
+#if defined(THREAD_POOL_PTHREADS)
+    return __atomic_fetch_add(&flock->crossedCount, 1, __ATOMIC_RELAXED);
+#else
+    return flock->crossedCount++;
+#endif
+}
+
+// Lists the boids whose next position is in another cell of the incremental grid, so
+// finishing the step only visits them
+static void FindCrossedBoids(Flock *flock, int start, int end) {
+    const DynamicSpatialGrid *grid = &flock->incrementalGrid;
+
+    for (int i = start; i < end; i++) {
+        int cell = SpatialGridCellIndex(&grid->layout, flock->nextPositionX[i], flock->nextPositionY[i], flock->nextPositionZ[i]);
+        if (cell != grid->pointCells[flock->ids[i]]) flock->crossedSlots[ClaimCrossedSlot(flock)] = i;
+    }
+}
+
+static void UpdateBoidPositionRange(void *context, int start, int end, int thread) {
+    Flock *flock = ((FlockJob *)context)->flock;
+
+    UpdateBoidPositionStream(flock->positionX + start, flock->positionY + start, flock->positionZ + start,
+                             flock->nextVelocityX + start, flock->nextVelocityY + start, flock->nextVelocityZ + start,
+                             flock->nextPositionX + start, flock->nextPositionY + start, flock->nextPositionZ + start,
+                             end - start, 3*((FlockJob *)context)->dt);
+    if (IsIncrementalGridTracked(flock)) FindCrossedBoids(flock, start, end);
+}
+
+// Makes the next state the current one. Also moves the boids that crossed into another cell
+// of the incremental grid, on the calling thread since cells are shared, in whatever order
+// the threads listed them: only the searches that select by id need the cells in order, and
+// they sort the ones that moved. Other searches do not follow boids from step to step, so
+// the incremental grid is dropped while one of them is in use.
+static void FinishBoidPosition(Flock *flock) {
+    SwapFlockState(flock);
+    flock->previousStateValid = true;
+
+    if (IsIncrementalGridTracked(flock)) {
+        flock->incrementalGrid.crossings = 0;
+        for (int c = 0; c < flock->crossedCount; c++) {
+            int i = flock->crossedSlots[c];
+            DynamicSpatialGridMove(&flock->incrementalGrid, flock->ids[i], flock->positionX[i], flock->positionY[i], flock->positionZ[i]);
+        }
+    }
+    else flock->incrementalGridValid = false;
+    flock->crossedCount = 0;
+}
+
+// Moves the boids at their next velocities and makes the next state the current one
+void UpdateBoidPosition(Flock *flock, float dt) {
+    RunFlockPass(flock, UpdateBoidPositionRange, dt);
+    FinishBoidPosition(flock);
+}
+
+// Position of the boid in slot i blended from the previous step (alpha 0) to the current one
+// (alpha 1), for drawing between fixed steps. Before the first step there is nothing to blend
+// from and it is the current position.
+void InterpolateBoidPosition(const Flock *flock, int i, float alpha, float *x, float *y, float *z) {
+    if (!flock->previousStateValid) {
+        *x = flock->positionX[i];
+        *y = flock->positionY[i];
+        *z = flock->positionZ[i];
+        return;
+    }
+
+    *x = flock->nextPositionX[i] + (flock->positionX[i] - flock->nextPositionX[i])*alpha;
+    *y = flock->nextPositionY[i] + (flock->positionY[i] - flock->nextPositionY[i])*alpha;
+    *z = flock->nextPositionZ[i] + (flock->positionZ[i] - flock->nextPositionZ[i])*alpha;
+}
+
+// Adds the time since mark to a phase, returns the time now as the next phase's mark
+static double AddPhaseTime(double *times, FlockPhase phase, double mark) {
+    double now = GetWallTime();
+    times[phase] += now - mark;
+    return now;
+}
+
+// Every pass of the step on one chunk of boids, in the order UpdateFlock() documents
+static void UpdateFlockRange(void *context, int start, int end, int thread) {
+    Flock *flock = ((FlockJob *)context)->flock;
+    double *times = flock->threadPhaseTimes[thread];
+    double mark = GetWallTime();
+
+    if (flock->fusedSteering) {
+        SteerFusedRange(context, start, end, thread);
+    }
+    else {
+        UpdateBoidNeighboursRange(context, start, end, thread);
+        mark = AddPhaseTime(times, FLOCK_PHASE_NEIGHBOURS, mark);
+        SteerSeparationRange(context, start, end, thread);
+        SteerAlignmentRange(context, start, end, thread);
+        SteerCohesionRange(context, start, end, thread);
+    }
+    mark = AddPhaseTime(times, FLOCK_PHASE_STEERING, mark);
+    KeepWithinBoundsRange(context, start, end, thread);
+    ConstrainSpeedRange(context, start, end, thread);
+    UpdateBoidPositionRange(context, start, end, thread);
+    AddPhaseTime(times, FLOCK_PHASE_MOVE, mark);
+}
+
+// Shares the wall time of the step's job out between the per-boid phases, by how long the
+// threads spent in each, so threads waiting on a slow chunk count towards what it was doing
+static void SplitJobPhaseTimes(Flock *flock, int threadCount, double jobTime) {
+    double phaseTotals[FLOCK_PHASE_COUNT] = { 0 };
+    double total = 0.0;
+
+    for (int t = 0; t < threadCount; t++) {
+        for (int p = FLOCK_PHASE_NEIGHBOURS; p < FLOCK_PHASE_COUNT; p++) {
+            phaseTotals[p] += flock->threadPhaseTimes[t][p];
+            total += flock->threadPhaseTimes[t][p];
+        }
+    }
+
+    for (int p = FLOCK_PHASE_NEIGHBOURS; p < FLOCK_PHASE_COUNT; p++) {
+        flock->phaseTimes[p] = (total > 0.0)? jobTime*phaseTotals[p]/total : 0.0;
+    }
+}
+
+// Traces the step's phases one after another from start, each as long as the step timer has
+// it, on the stepping thread. The per-boid phases are traced once a step like this, not for
+// every chunk of boids, which would flood the trace on a large flock.
+static void TraceFlockPhases(const Flock *flock, double start) {
+    for (int p = 0; p < FLOCK_PHASE_COUNT; p++) {
+        if (flock->phaseTimes[p] > 0.0) TraceSpan(GetFlockPhaseName((FlockPhase)p), start, start + flock->phaseTimes[p]);
+        start += flock->phaseTimes[p];
+    }
+}
+
+// One simulation step, dt in seconds. Gives the same result as UpdateBoidNeighbours(), the
+// three steering passes (or SteerFused()), KeepWithinBounds(), ConstrainSpeed() and
+// UpdateBoidPosition() called one after another, with a single job for the thread pool.
+void UpdateFlock(Flock *flock, float dt) {
+    int threadCount = (flock->threadPool != NULL)? flock->threadPool->threadCount : 1;
+    TraceBegin("step");
+    double start = GetWallTime();
+    double mark = start;
+
+    // Scratch only lives for one step
+    ResetArena(&flock->scratch);
+    memset(flock->phaseTimes, 0, sizeof(flock->phaseTimes));
+    memset(flock->threadPhaseTimes, 0, threadCount*sizeof(flock->threadPhaseTimes[0]));
+
+    if ((flock->reorderInterval > 0) && (flock->stepCounter%flock->reorderInterval == 0)) ReorderBoids(flock);
+    flock->stepCounter++;
+    mark = AddPhaseTime(flock->phaseTimes, FLOCK_PHASE_REORDER, mark);
+
+    if (!flock->fusedSteering) ReserveNeighbourLists(flock);
+    BuildNeighbourSearch(flock);
+    mark = AddPhaseTime(flock->phaseTimes, FLOCK_PHASE_SEARCH, mark);
+
+    RunFlockPass(flock, UpdateFlockRange, dt);
+    FinishBoidPosition(flock);
+    SplitJobPhaseTimes(flock, threadCount, GetWallTime() - mark);
+    TraceFlockPhases(flock, start);
+    TraceEnd("step");
+
+    if (flock->stepCallback != NULL) flock->stepCallback(flock, flock->stepContext);
+}
@@ -0,0 +1,232 @@
+/*******************************************************************************************
+*
+*   flock - Boid state and the steps that move it
+*
+*   Boids are stored as a structure of arrays. Position and velocity components each get
+*   their own array so the per-boid passes stream through memory, while ids and neighbour
+*   lists live in separate cold arrays that only the neighbour passes touch.
+*
+*   The hot state is double buffered. A step reads the current state and writes the next
+*   one, and UpdateBoidPosition() swaps the two. No boid ever sees another boid's update
+*   from the same step, so the result does not depend on the order boids are visited in.
+*   SteerSeparation() or SteerFused() starts the next velocities and runs first, the passes
+*   after it adjust them. Between steps the next state still holds the previous step's state,
+*   which InterpolateBoidPosition() blends with the current one for rendering.
+*
+*   With a thread pool attached every per-boid pass is split into chunks of boids. Building
+*   the search structure and swapping the state stay on the calling thread, between them
+*   UpdateFlock() runs the whole step for a chunk in one job since no boid reads another
+*   boid's output from the same step.
+*
+*   Every per-boid array is allocated for the flock's capacity, aligned to a cache line.
+*   ResizeFlock() changes the population at any time, growing the capacity when it has to.
+*   All of it, search structures included, comes from the flock's arena, and temporaries
+*   from a scratch arena that is reset at the start of every step, so a step never calls
+*   malloc(). The arena's tag counts are the footprint of each part of the simulation.
+*
+*   With compactState set, the packed copies the neighbour search scans are stored in 16 bits
+*   instead: positions as fixed point over COMPACT_POSITION_RANGE times the bounds, velocities
+*   as half floats. That halves the bytes streamed per candidate, and the float copies are
+*   never allocated unless the flock runs without it first. The state itself stays in
+*   floats, so only the neighbours seen and their contribution to steering are rounded, never
+*   the motion integrated from step to step.
+*
+*   HashFlockState() checksums the state bit for bit by id, so two runs from the same start,
+*   on different builds or paths, can be compared step by step. stepCallback sees the flock
+*   after every step, for checksums or recording.
+*
+*   Every step times its phases into phaseTimes, cheaply enough to leave on: a clock read at
+*   each phase boundary, per chunk for the phases that run in the thread pool.
+*
+*   The module does not depend on raylib, positions are plain floats.
+*
+********************************************************************************************/
+
+#ifndef FLOCK_H
+#define FLOCK_H
+
+#include "spatial_grid.h"
+#include "octree.h"
+#include "thread_pool.h"
+#include "arena.h"
+#include "neighbour_kernel.h"
+
+#include <stdbool.h>
+
+#define DEFAULT_BOID_COUNT 600
+#define MAX_BOID_COUNT (1 << 24)        // Far past what steps in real time, and twice it still fits an int
+#define MAX_NEIGHBOURS 30
+#define COMPACT_POSITION_RANGE 2.0f     // Compact positions cover this many times the bounds on every axis
+
+// Structure used to find the neighbours of every boid, they all find the same neighbours
+typedef enum {
+    NEIGHBOUR_SEARCH_GRID = 0,
+    NEIGHBOUR_SEARCH_OCTREE,
+    NEIGHBOUR_SEARCH_BRUTE_FORCE,
+    NEIGHBOUR_SEARCH_VERLET,            // Grid built lists of candidates, reused while boids stay within the skin
+    NEIGHBOUR_SEARCH_INCREMENTAL_GRID,  // Grid that UpdateBoidPosition() keeps up to date
+    NEIGHBOUR_SEARCH_COUNT
+} NeighbourSearch;
+
+// Which neighbours a boid keeps out of the matches within its perception radius
+typedef enum {
+    NEIGHBOUR_SELECTION_FIRST_BY_ID = 0,    // The neighbourLimit matches with the smallest ids
+    NEIGHBOUR_SELECTION_NEAREST,            // The neighbourLimit nearest matches, ties to the smaller id
+    NEIGHBOUR_SELECTION_COUNT
+} NeighbourSelection;
+
+// Phases of UpdateFlock(), in the order they run
+typedef enum {
+    FLOCK_PHASE_REORDER = 0,
+    FLOCK_PHASE_SEARCH,                 // Building the neighbour search structure
+    FLOCK_PHASE_NEIGHBOURS,             // Finding the neighbour lists, part of steering when fused
+    FLOCK_PHASE_STEERING,
+    FLOCK_PHASE_MOVE,                   // Bounds, speed limit and integration
+    FLOCK_PHASE_COUNT
+} FlockPhase;
+
+struct Flock;
+
+// Called with the flock after every UpdateFlock(), on the thread that ran it
+typedef void (*FlockStepCallback)(const struct Flock *flock, void *context);
+
+// One copy of the hot state
+typedef struct FlockState {
+    float *positionX;
+    float *positionY;
+    float *positionZ;
+    float *velocityX;
+    float *velocityY;
+    float *velocityZ;
+} FlockState;
+
+typedef struct Flock {
+    int count;
+    int capacity;               // Boids every array has room for
+    int neighbourLimit;         // Neighbours kept per boid, at most MAX_NEIGHBOURS
+    bool fusedSteering;         // Steer in one pass while finding neighbours, no stored lists
+    bool compactState;          // Pack the search copies in 16 bits, see CompactCandidates
+    NeighbourSearch neighbourSearch;
+    NeighbourSelection neighbourSelection;
+    ThreadPool *threadPool;     // Runs the per-boid passes, NULL runs them on the calling thread
+    int reorderInterval;        // Steps between Morton reorders, 0 disables it
+    int stepCounter;
+    FlockStepCallback stepCallback;     // NULL for none
+    void *stepContext;
+    float perceptionRadius;
+    float boundsX;
+    float boundsY;
+    float boundsZ;
+
+    // Hot state, read by every pass. Both sets point into states, swapped after every step.
+    float *positionX;           // Current state, read-only while a step runs
+    float *positionY;
+    float *positionZ;
+    float *velocityX;
+    float *velocityY;
+    float *velocityZ;
+    float *nextPositionX;       // Next state, written by the step
+    float *nextPositionY;
+    float *nextPositionZ;
+    float *nextVelocityX;
+    float *nextVelocityY;
+    float *nextVelocityZ;
+    int currentState;
+    bool previousStateValid;    // The next state holds the previous step, slot for slot
+    FlockState states[2];
+
+    // Cold state
+    int *ids;                   // Stable identity of the boid in every slot
+    int *slots;                 // Slot of every id, changes on reorder
+    int *neighbourCounts;
+    int (*neighbourIndexes)[MAX_NEIGHBOURS];    // Allocated on first use, fused steering never needs it
+
+    // Current state copied into the search structure's order (grid cells, octree leaves or
+    // ids), so the neighbour kernel reads each cell or leaf as one contiguous run. The floats
+    // are allocated on first use, a flock that is compact from the start never has them.
+    // There is a packed position per boid, or with the incremental grid one per entry of its
+    // cells, gaps included, which is about twice as many.
+    int packedCapacity;
+    float *packedPositionX;
+    float *packedPositionY;
+    float *packedPositionZ;
+    float *packedVelocityX;
+    float *packedVelocityY;
+    float *packedVelocityZ;
+    int *packedIds;
+    const int *packedIndexes;   // Slot of the boid at every packed position
+    int *packedSlots;           // packedIndexes of the incremental grid, -1 in its gaps
+
+    // The packed copies in 16 bits, used instead of the float ones with compactState. Allocated
+    // on first use.
+    uint16_t *compactPositionX;
+    uint16_t *compactPositionY;
+    uint16_t *compactPositionZ;
+    uint16_t *compactVelocityX;
+    uint16_t *compactVelocityY;
+    uint16_t *compactVelocityZ;
+
+    SpatialGrid grid;
+    Octree octree;
+
+    // Verlet lists: every boid within perceptionRadius + verletSkin of a boid when the lists
+    // were built, as packed positions. They are rebuilt once any boid has moved more than half
+    // the skin, before that no true neighbour can be missing from them. Lists are sorted by id
+    // for first by id selection, nearest selection reads them in packed order.
+    float verletSkin;
+    bool verletValid;
+    bool verletSortedById;
+    int verletRebuilds;
+    int verletCapacity;
+    int *verletNeighbours;
+    int *verletStart;                       // capacity + 1 offsets into verletNeighbours
+    float *verletPositionX;                 // Positions at the last build
+    float *verletPositionY;
+    float *verletPositionZ;
+    SpatialGrid verletGrid;
+
+    // Cells of boid ids that UpdateBoidPosition() keeps: moving the boids lists the ones
+    // whose cell changed, and only those are moved in the cells afterwards. The cells are
+    // the packed runs as they stand, so keeping the grid costs in proportion to the
+    // crossings, not the flock; only copying the state into them, which every search does,
+    // goes over every boid. Positions set outside UpdateBoidPosition() need
+    // InvalidateNeighbourSearch().
+    bool incrementalGridValid;
+    DynamicSpatialGrid incrementalGrid;
+    int crossedCount;
+    int *crossedSlots;                      // Slots of the boids that crossed into another cell
+
+    // Seconds each phase of the last step took. The per-boid phases run as one job, its wall
+    // time is split between them by how long the threads spent in each.
+    double phaseTimes[FLOCK_PHASE_COUNT];
+    double threadPhaseTimes[THREAD_POOL_MAX_THREADS][FLOCK_PHASE_COUNT];
+
+    Arena arena;                // Everything above that is allocated
+    Arena scratch;              // Temporaries of the current step
+} Flock;
+
+void InitFlock(Flock *flock, int count, float boundsX, float boundsY, float boundsZ);
+void UnloadFlock(Flock *flock);
+void ReserveFlock(Flock *flock, int capacity);
+void ResizeFlock(Flock *flock, int count);
+void UpdateFlock(Flock *flock, float dt);
+
+const char *GetNeighbourSearchName(NeighbourSearch search);
+const char *GetNeighbourSelectionName(NeighbourSelection selection);
+const char *GetFlockPhaseName(FlockPhase phase);
+
+CompactCandidates GetCompactCandidates(const Flock *flock);
+uint64_t HashFlockState(const Flock *flock);
+void InvalidateNeighbourSearch(Flock *flock);
+void ReorderBoids(Flock *flock);
+void UpdateBoidNeighbours(Flock *flock);
+void SteerSeparation(Flock *flock);
+void SteerAlignment(Flock *flock);
+void SteerCohesion(Flock *flock);
+void SteerFused(Flock *flock);
+void KeepWithinBounds(Flock *flock);
+void ConstrainSpeed(Flock *flock);
+void UpdateBoidPosition(Flock *flock, float dt);
+void InterpolateBoidPosition(const Flock *flock, int i, float alpha, float *x, float *y, float *z);
+
+#endif // FLOCK_H
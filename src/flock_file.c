@@ -0,0 +1,262 @@
+/*******************************************************************************************
+*
+*   flock_file - The whole simulation state saved to a binary file, mapped back in
+*
+********************************************************************************************/
+
+#include "flock_file.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+#elif !defined(__EMSCRIPTEN__)
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #define FLOCK_FILE_MMAP
+    #if defined(MAP_POPULATE)
+        #define FLOCK_FILE_POPULATE MAP_POPULATE     // Maps the whole file in one go rather than a page fault at a time
+    #else
+        #define FLOCK_FILE_POPULATE 0
+    #endif
+#endif
+
+// A whole file readable in memory, mapped where the platform can, read in otherwise (web)
+typedef struct MappedFile {
+    const unsigned char *data;
+    size_t size;
+} MappedFile;
+
+static bool MapFile(MappedFile *file, const char *path) {
+    *file = (MappedFile){ 0 };
+#if defined(_WIN32)
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (handle == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size = { 0 };
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(handle, &size) && (size.QuadPart > 0)) mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping != NULL) {
+        file->data = (const unsigned char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        file->size = (size_t)size.QuadPart;
+        CloseHandle(mapping);
+    }
+    CloseHandle(handle);
+#elif defined(FLOCK_FILE_MMAP)
+    int descriptor = open(path, O_RDONLY);
+    if (descriptor < 0) return false;
+
+    struct stat status;
+    if ((fstat(descriptor, &status) == 0) && (status.st_size > 0)) {
+        void *data = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_PRIVATE | FLOCK_FILE_POPULATE, descriptor, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, (size_t)status.st_size, MADV_SEQUENTIAL);
+            file->data = (const unsigned char *)data;
+            file->size = (size_t)status.st_size;
+        }
+    }
+    close(descriptor);
+#else
+    FILE *stream = fopen(path, "rb");
+    if (stream == NULL) return false;
+
+    long size = (fseek(stream, 0, SEEK_END) == 0)? ftell(stream) : -1;
+    unsigned char *data = (size > 0)? (unsigned char *)malloc((size_t)size) : NULL;
+    if ((data != NULL) && (fseek(stream, 0, SEEK_SET) == 0) && (fread(data, 1, (size_t)size, stream) == (size_t)size)) {
+        file->data = data;
+        file->size = (size_t)size;
+    }
+    else free(data);
+    fclose(stream);
+#endif
+    // An empty file opens but has nothing to map
+    return true;
+}
+
+static void UnmapFile(MappedFile *file) {
+    if (file->data == NULL) return;
+#if defined(_WIN32)
+    UnmapViewOfFile(file->data);
+#elif defined(FLOCK_FILE_MMAP)
+    munmap((void *)file->data, file->size);
+#else
+    free((void *)file->data);
+#endif
+    *file = (MappedFile){ 0 };
+}
+
+static int GetFlockFileStride(int count) {
+    int lineElements = ARENA_ALIGNMENT/(int)sizeof(float);
+    return (count + lineElements - 1)/lineElements*lineElements;
+}
+
+static uint64_t GetFlockFileDataOffset(void) {
+    return (sizeof(FlockFileHeader) + ARENA_ALIGNMENT - 1)/ARENA_ALIGNMENT*ARENA_ALIGNMENT;
+}
+
+// Array a of the file, every array is 32 bits per element
+static const void *GetFlockFileArray(const MappedFile *file, int a) {
+    const FlockFileHeader *header = (const FlockFileHeader *)file->data;
+    return file->data + header->dataOffset + (size_t)a*header->stride*sizeof(float);
+}
+
+// The search structures are built from the bounds and radius, so they have to give a grid of
+// sensible size: a positive radius and positive, finite bounds
+static bool CheckFlockFileModel(const FlockFileHeader *header) {
+    const float bounds[3] = { header->boundsX, header->boundsY, header->boundsZ };
+    double cells = 1.0;
+
+    if (!isfinite(header->perceptionRadius) || !(header->perceptionRadius > 0.0f)) return false;
+    for (int a = 0; a < 3; a++) {
+        if (!isfinite(bounds[a]) || !(bounds[a] > 0.0f)) return false;
+        cells *= ceil(2.0*bounds[a]/header->perceptionRadius) + 2.0;
+    }
+
+    return (cells <= FLOCK_FILE_MAX_CELLS);
+}
+
+// Everything is checked before the flock is touched, so a bad file changes nothing
+static FlockFileResult CheckFlockFile(const MappedFile *file) {
+    const FlockFileHeader *header = (const FlockFileHeader *)file->data;
+
+    if ((file->size < sizeof(header->magic)) || (memcmp(header->magic, FLOCK_FILE_MAGIC, sizeof(header->magic)) != 0)) {
+        return FLOCK_FILE_NOT_A_FLOCK;
+    }
+    if (file->size < sizeof(FlockFileHeader)) return FLOCK_FILE_TRUNCATED;
+    if (header->byteOrder != FLOCK_FILE_BYTE_ORDER) return FLOCK_FILE_NOT_A_FLOCK;
+    if (header->version != FLOCK_FILE_VERSION) return FLOCK_FILE_WRONG_VERSION;
+    if (header->headerSize != sizeof(FlockFileHeader)) return FLOCK_FILE_NOT_A_FLOCK;
+    if ((header->count < 1) || (header->stride < header->count) || (header->dataOffset < sizeof(FlockFileHeader)) ||
+        (header->dataOffset%ARENA_ALIGNMENT != 0)) {
+        return FLOCK_FILE_CORRUPT;
+    }
+    if (!CheckFlockFileModel(header)) return FLOCK_FILE_CORRUPT;
+
+    // The offset is checked on its own first, added to the array bytes it could wrap around
+    uint64_t arrayBytes = (uint64_t)FLOCK_FILE_ARRAYS*header->stride*sizeof(float);
+    if ((header->dataOffset > file->size) || (file->size - header->dataOffset < arrayBytes)) return FLOCK_FILE_TRUNCATED;
+
+    // Every slot holds a different id, and the slots say where each one is
+    const int32_t *ids = (const int32_t *)GetFlockFileArray(file, 12);
+    const int32_t *slots = (const int32_t *)GetFlockFileArray(file, 13);
+    for (int i = 0; i < header->count; i++) {
+        if ((ids[i] < 0) || (ids[i] >= header->count) || (slots[ids[i]] != i)) return FLOCK_FILE_CORRUPT;
+    }
+
+    return FLOCK_FILE_OK;
+}
+
+static bool WriteFlockFileArray(FILE *stream, const void *array, int count, int stride) {
+    static const char zeros[ARENA_ALIGNMENT] = { 0 };
+
+    return (fwrite(array, sizeof(float), (size_t)count, stream) == (size_t)count) &&
+           (fwrite(zeros, sizeof(float), (size_t)(stride - count), stream) == (size_t)(stride - count));
+}
+
+// Writes the flock as it is between steps, with the generator's state if there is one
+FlockFileResult SaveFlockFile(const Flock *flock, const Rng *rng, const char *path) {
+    FILE *stream = fopen(path, "wb");
+    if (stream == NULL) return FLOCK_FILE_OPEN_FAILED;
+
+    FlockFileHeader header = { 0 };
+    memcpy(header.magic, FLOCK_FILE_MAGIC, sizeof(header.magic));
+    header.version = FLOCK_FILE_VERSION;
+    header.headerSize = sizeof(FlockFileHeader);
+    header.byteOrder = FLOCK_FILE_BYTE_ORDER;
+    header.flags = ((flock->fusedSteering)? FLOCK_FILE_FUSED : 0) | ((flock->compactState)? FLOCK_FILE_COMPACT : 0) |
+                   ((flock->previousStateValid)? FLOCK_FILE_PREVIOUS_VALID : 0);
+    header.dataOffset = GetFlockFileDataOffset();
+    header.count = flock->count;
+    header.stride = GetFlockFileStride(flock->count);
+    header.stepCounter = flock->stepCounter;
+    header.neighbourLimit = flock->neighbourLimit;
+    header.neighbourSearch = flock->neighbourSearch;
+    header.neighbourSelection = flock->neighbourSelection;
+    header.reorderInterval = flock->reorderInterval;
+    header.perceptionRadius = flock->perceptionRadius;
+    header.boundsX = flock->boundsX;
+    header.boundsY = flock->boundsY;
+    header.boundsZ = flock->boundsZ;
+    header.verletSkin = flock->verletSkin;
+    header.rngState = (rng != NULL)? rng->state : 0;
+
+    const void *arrays[FLOCK_FILE_ARRAYS] = {
+        flock->positionX, flock->positionY, flock->positionZ, flock->velocityX, flock->velocityY, flock->velocityZ,
+        flock->nextPositionX, flock->nextPositionY, flock->nextPositionZ, flock->nextVelocityX, flock->nextVelocityY, flock->nextVelocityZ,
+        flock->ids, flock->slots
+    };
+
+    bool written = (fwrite(&header, sizeof(header), 1, stream) == 1);
+    for (uint64_t offset = sizeof(header); written && (offset < header.dataOffset); offset++) written = (fputc(0, stream) != EOF);
+    for (int a = 0; written && (a < FLOCK_FILE_ARRAYS); a++) written = WriteFlockFileArray(stream, arrays[a], flock->count, header.stride);
+    written &= (fclose(stream) == 0);
+
+    return (written)? FLOCK_FILE_OK : FLOCK_FILE_WRITE_FAILED;
+}
+
+// Replaces the flock with the one saved in path and rng's state with the saved one, rng may
+// be NULL. The flock's arenas are reloaded; its search, steering, thread pool and callback
+// settings carry over. On failure the flock is left as it was.
+FlockFileResult LoadFlockFile(Flock *flock, Rng *rng, const char *path) {
+    MappedFile file = { 0 };
+    if (!MapFile(&file, path)) return FLOCK_FILE_OPEN_FAILED;
+
+    FlockFileResult result = CheckFlockFile(&file);
+    if (result != FLOCK_FILE_OK) {
+        UnmapFile(&file);
+        return result;
+    }
+
+    const FlockFileHeader *header = (const FlockFileHeader *)file.data;
+    Flock settings = *flock;
+
+    UnloadFlock(flock);
+    InitFlock(flock, 0, header->boundsX, header->boundsY, header->boundsZ);
+    flock->neighbourSearch = settings.neighbourSearch;
+    flock->neighbourSelection = settings.neighbourSelection;
+    flock->fusedSteering = settings.fusedSteering;
+    flock->compactState = settings.compactState;
+    flock->threadPool = settings.threadPool;
+    flock->reorderInterval = settings.reorderInterval;
+    flock->verletSkin = settings.verletSkin;
+    flock->stepCallback = settings.stepCallback;
+    flock->stepContext = settings.stepContext;
+
+    // The search structures are built for the saved radius
+    flock->perceptionRadius = header->perceptionRadius;
+    flock->neighbourLimit = (header->neighbourLimit < 1)? 1 : (header->neighbourLimit > MAX_NEIGHBOURS)? MAX_NEIGHBOURS : header->neighbourLimit;
+    flock->stepCounter = header->stepCounter;
+    ReserveFlock(flock, header->count);
+    flock->count = header->count;
+    flock->previousStateValid = ((header->flags & FLOCK_FILE_PREVIOUS_VALID) != 0);
+
+    void *arrays[FLOCK_FILE_ARRAYS] = {
+        flock->positionX, flock->positionY, flock->positionZ, flock->velocityX, flock->velocityY, flock->velocityZ,
+        flock->nextPositionX, flock->nextPositionY, flock->nextPositionZ, flock->nextVelocityX, flock->nextVelocityY, flock->nextVelocityZ,
+        flock->ids, flock->slots
+    };
+    for (int a = 0; a < FLOCK_FILE_ARRAYS; a++) memcpy(arrays[a], GetFlockFileArray(&file, a), (size_t)header->count*sizeof(float));
+
+    if (rng != NULL) rng->state = header->rngState;
+    UnmapFile(&file);
+    return FLOCK_FILE_OK;
+}
+
+const char *GetFlockFileResultName(FlockFileResult result) {
+    switch (result) {
+        case FLOCK_FILE_OK: return "ok";
+        case FLOCK_FILE_OPEN_FAILED: return "could not be opened";
+        case FLOCK_FILE_NOT_A_FLOCK: return "not a flock file";
+        case FLOCK_FILE_WRONG_VERSION: return "another version";
+        case FLOCK_FILE_TRUNCATED: return "truncated";
+        case FLOCK_FILE_CORRUPT: return "corrupt";
+        case FLOCK_FILE_WRITE_FAILED: return "could not be written";
+        default: return "unknown";
+    }
+}
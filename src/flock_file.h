@@ -0,0 +1,77 @@
+/*******************************************************************************************
+*
+*   flock_file - The whole simulation state saved to a binary file, mapped back in
+*
+*   A file is a fixed header followed by the per-boid arrays exactly as the flock holds
+*   them, in slot order, each starting on a cache line. Loading maps the file, checks the
+*   header and copies every array straight into the flock, there is nothing to parse. The
+*   slot order survives, so the restored flock keeps the Morton order it had settled into,
+*   and its steps go on bit for bit as the saved flock's would have.
+*
+*   The header holds the model: boid count, bounds, perception radius, neighbour limit, the
+*   step reached and the random generator's state. How the flock is computed (neighbour
+*   search, fused steering, compact state, threads) is saved for the record but left as the
+*   loading flock has it.
+*
+*   Files are native endian. A reader of another byte order, header layout or version
+*   rejects the file instead of misreading it, bump FLOCK_FILE_VERSION whenever the layout
+*   changes.
+*
+********************************************************************************************/
+
+#ifndef FLOCK_FILE_H
+#define FLOCK_FILE_H
+
+#include "flock.h"
+#include "rng.h"
+
+#include <stdint.h>
+
+#define FLOCK_FILE_MAGIC "BOIDFLK"      // Eight bytes with the terminator
+#define FLOCK_FILE_VERSION 1
+#define FLOCK_FILE_BYTE_ORDER 0x01020304u
+#define FLOCK_FILE_ARRAYS 14            // Current and previous positions and velocities, ids and slots
+#define FLOCK_FILE_MAX_CELLS (1 << 24)  // Most grid cells the saved bounds and radius may ask for
+
+// Flags of a saved flock
+#define FLOCK_FILE_FUSED 1u
+#define FLOCK_FILE_COMPACT 2u
+#define FLOCK_FILE_PREVIOUS_VALID 4u    // The previous state is the step before, slot for slot
+
+typedef struct FlockFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;        // sizeof(FlockFileHeader) of the writer
+    uint32_t byteOrder;         // FLOCK_FILE_BYTE_ORDER as the writer stored it
+    uint32_t flags;
+    uint64_t dataOffset;        // Where the first array starts, a multiple of ARENA_ALIGNMENT
+    int32_t count;
+    int32_t stride;             // Elements from one array to the next, count rounded to whole cache lines
+    int32_t stepCounter;
+    int32_t neighbourLimit;
+    int32_t neighbourSearch;
+    int32_t neighbourSelection;
+    int32_t reorderInterval;
+    float perceptionRadius;
+    float boundsX;
+    float boundsY;
+    float boundsZ;
+    float verletSkin;
+    uint64_t rngState;
+} FlockFileHeader;
+
+typedef enum {
+    FLOCK_FILE_OK = 0,
+    FLOCK_FILE_OPEN_FAILED,
+    FLOCK_FILE_NOT_A_FLOCK,     // Wrong magic, byte order or header size
+    FLOCK_FILE_WRONG_VERSION,
+    FLOCK_FILE_TRUNCATED,
+    FLOCK_FILE_CORRUPT,         // Ids and slots do not match up, or the model is out of range
+    FLOCK_FILE_WRITE_FAILED
+} FlockFileResult;
+
+FlockFileResult SaveFlockFile(const Flock *flock, const Rng *rng, const char *path);
+FlockFileResult LoadFlockFile(Flock *flock, Rng *rng, const char *path);
+const char *GetFlockFileResultName(FlockFileResult result);
+
+#endif // FLOCK_FILE_H
@@ -0,0 +1,65 @@
+/*******************************************************************************************
+*
+*   frame_timer - Per-phase times of a repeating piece of work, averaged and kept as history
+*
+********************************************************************************************/
+
+#include "frame_timer.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+#include <string.h>
+
+void InitFrameTimer(FrameTimer *timer, int phaseCount, const char *const *phaseNames) {
+    *timer = (FrameTimer){ 0 };
+    timer->phaseCount = (phaseCount < FRAME_TIMER_MAX_PHASES)? phaseCount : FRAME_TIMER_MAX_PHASES;
+    for (int p = 0; p < timer->phaseCount; p++) timer->phaseNames[p] = phaseNames[p];
+    timer->phase = -1;
+}
+
+// Ends the phase running, if any, and starts phase. A phase begun twice in a frame adds up.
+void BeginFramePhase(FrameTimer *timer, int phase) {
+    double now = GetWallTime();
+
+    if (timer->phase >= 0) {
+        timer->times[timer->phase] += now - timer->phaseStart;
+        TraceSpan(timer->phaseNames[timer->phase], timer->phaseStart, now);
+    }
+    timer->phase = phase;
+    timer->phaseStart = now;
+}
+
+void SetFramePhaseTime(FrameTimer *timer, int phase, double seconds) {
+    timer->times[phase] = seconds;
+}
+
+// Ends the phase running and rolls the frame into the averages and the history
+void EndFrameTimer(FrameTimer *timer) {
+    if (timer->phase >= 0) BeginFramePhase(timer, -1);
+
+    // The first frame starts the averages, rather than them creeping up from zero
+    double weight = (timer->frames == 0)? 1.0 : FRAME_TIMER_SMOOTHING;
+    for (int p = 0; p < timer->phaseCount; p++) {
+        timer->averages[p] += (timer->times[p] - timer->averages[p])*weight;
+        timer->history[timer->historyNext][p] = (float)timer->times[p];
+    }
+
+    timer->historyNext = (timer->historyNext + 1)%FRAME_TIMER_HISTORY;
+    timer->frames++;
+    memset(timer->times, 0, sizeof(timer->times));
+}
+
+// Phase times of the frame age frames before the last one ended, NULL past the history
+const float *GetFrameTimerHistory(const FrameTimer *timer, int age) {
+    if ((age < 0) || (age >= FRAME_TIMER_HISTORY) || (age >= timer->frames)) return NULL;
+
+    return timer->history[(timer->historyNext - 1 - age + FRAME_TIMER_HISTORY)%FRAME_TIMER_HISTORY];
+}
+
+double GetFrameTimerAverageTotal(const FrameTimer *timer) {
+    double total = 0.0;
+
+    for (int p = 0; p < timer->phaseCount; p++) total += timer->averages[p];
+
+    return total;
+}
@@ -0,0 +1,43 @@
+/*******************************************************************************************
+*
+*   frame_timer - Per-phase times of a repeating piece of work, averaged and kept as history
+*
+*   A frame is split into phases. BeginFramePhase() ends the phase running and starts the
+*   next, so timing a frame costs one clock read per phase boundary. Times measured
+*   elsewhere, such as the phases of a simulation step on another thread, are handed in with
+*   SetFramePhaseTime(). EndFrameTimer() closes the frame: every phase's time goes into an
+*   exponential moving average and a ring of the last FRAME_TIMER_HISTORY frames to graph.
+*   While a trace runs, every phase timed here also goes into it.
+*
+*   The module does not depend on raylib, drawing the times is up to the caller.
+*
+********************************************************************************************/
+
+#ifndef FRAME_TIMER_H
+#define FRAME_TIMER_H
+
+#define FRAME_TIMER_MAX_PHASES 8
+#define FRAME_TIMER_HISTORY 120         // Frames kept, two seconds at 60 Hz
+#define FRAME_TIMER_SMOOTHING 0.05      // Weight of the newest frame in the averages
+
+typedef struct FrameTimer {
+    int phaseCount;
+    const char *phaseNames[FRAME_TIMER_MAX_PHASES];
+    int phase;                  // Phase running, -1 when none is
+    double phaseStart;
+    int frames;                 // Frames ended so far
+    double times[FRAME_TIMER_MAX_PHASES];           // Seconds of the frame being timed
+    double averages[FRAME_TIMER_MAX_PHASES];        // Seconds, moving average over frames
+    float history[FRAME_TIMER_HISTORY][FRAME_TIMER_MAX_PHASES];    // Seconds, ring of past frames
+    int historyNext;            // Where the next frame goes, the oldest one once the ring is full
+} FrameTimer;
+
+void InitFrameTimer(FrameTimer *timer, int phaseCount, const char *const *phaseNames);
+void BeginFramePhase(FrameTimer *timer, int phase);
+void SetFramePhaseTime(FrameTimer *timer, int phase, double seconds);
+void EndFrameTimer(FrameTimer *timer);
+
+const float *GetFrameTimerHistory(const FrameTimer *timer, int age);
+double GetFrameTimerAverageTotal(const FrameTimer *timer);
+
+#endif // FRAME_TIMER_H
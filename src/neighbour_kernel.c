@@ -0,0 +1,377 @@
+/*******************************************************************************************
+*
+*   neighbour_kernel - Vectorised neighbour candidate test with runtime CPU dispatch
+*
+********************************************************************************************/
+
+#include "neighbour_kernel.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    #define NEIGHBOUR_KERNEL_X86
+    #define TARGET_AVX2 __attribute__((target("avx2")))
+    #define TARGET_SSE41 __attribute__((target("sse4.1")))
+    #include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    #define NEIGHBOUR_KERNEL_X86
+    #define TARGET_AVX2
+    #define TARGET_SSE41
+    #include <intrin.h>
+    #include <immintrin.h>
+#endif
+
+static int FilterNeighboursScalar(const NeighbourCandidates *candidates, int start, int end,
+                                  const NeighbourQuery *query, int *accepted);
+static int FilterCompactNeighboursScalar(const CompactCandidates *candidates, int start, int end,
+                                         const NeighbourQuery *query, int *accepted);
+
+FilterNeighboursFunc FilterNeighbours = FilterNeighboursScalar;
+FilterCompactNeighboursFunc FilterCompactNeighbours = FilterCompactNeighboursScalar;
+
+static NeighbourKernel currentKernel = NEIGHBOUR_KERNEL_SCALAR;
+static bool kernelInitialised = false;
+
+// Branch-free: every candidate is written, only accepted ones advance the count
+static int FilterNeighboursScalar(const NeighbourCandidates *candidates, int start, int end,
+                                  const NeighbourQuery *query, int *accepted) {
+    int count = 0;
+
+    for (int k = start; k < end; k++) {
+        float dx = candidates->x[k] - query->x;
+        float dy = candidates->y[k] - query->y;
+        float dz = candidates->z[k] - query->z;
+        float distanceSq = dx*dx + dy*dy + dz*dz;
+        float dot = query->velocityX*candidates->velocityX[k] + query->velocityY*candidates->velocityY[k] + query->velocityZ*candidates->velocityZ[k];
+
+        accepted[count] = k;
+        count += (distanceSq < query->radiusSq) & (dot > 0.0f);
+    }
+
+    return count;
+}
+
+static int FilterCompactNeighboursScalar(const CompactCandidates *candidates, int start, int end,
+                                         const NeighbourQuery *query, int *accepted) {
+    float queryX = query->x - candidates->originX;
+    float queryY = query->y - candidates->originY;
+    float queryZ = query->z - candidates->originZ;
+    float queryVelocityX = query->velocityX*HALF_REBIAS;
+    float queryVelocityY = query->velocityY*HALF_REBIAS;
+    float queryVelocityZ = query->velocityZ*HALF_REBIAS;
+    int count = 0;
+
+    for (int k = start; k < end; k++) {
+        float dx = (float)candidates->x[k]*candidates->scaleX - queryX;
+        float dy = (float)candidates->y[k]*candidates->scaleY - queryY;
+        float dz = (float)candidates->z[k]*candidates->scaleZ - queryZ;
+        float distanceSq = dx*dx + dy*dy + dz*dz;
+        float dot = queryVelocityX*WidenHalf(candidates->velocityX[k]) + queryVelocityY*WidenHalf(candidates->velocityY[k]) +
+                    queryVelocityZ*WidenHalf(candidates->velocityZ[k]);
+
+        accepted[count] = k;
+        count += (distanceSq < query->radiusSq) & (dot > 0.0f);
+    }
+
+    return count;
+}
+
+#if defined(NEIGHBOUR_KERNEL_X86)
+
+// Lane shuffles that move the accepted lanes of a comparison mask to the front
+static int compactLanes8[256][8];
+static unsigned char compactBytes4[16][16];
+static int maskCounts[256];
+
+static void InitCompactTables(void) {
+    for (int mask = 0; mask < 256; mask++) {
+        int count = 0;
+        for (int lane = 0; lane < 8; lane++) {
+            if (mask & (1 << lane)) compactLanes8[mask][count++] = lane;
+        }
+        maskCounts[mask] = count;
+        for (int lane = count; lane < 8; lane++) compactLanes8[mask][lane] = 0;
+    }
+
+    for (int mask = 0; mask < 16; mask++) {
+        for (int lane = 0; lane < 4; lane++) {
+            int source = compactLanes8[mask][lane];
+            for (int b = 0; b < 4; b++) compactBytes4[mask][lane*4 + b] = (unsigned char)(source*4 + b);
+        }
+    }
+}
+
+TARGET_SSE41 static int FilterNeighboursSse41(const NeighbourCandidates *candidates, int start, int end,
+                                              const NeighbourQuery *query, int *accepted) {
+    __m128 queryX = _mm_set1_ps(query->x);
+    __m128 queryY = _mm_set1_ps(query->y);
+    __m128 queryZ = _mm_set1_ps(query->z);
+    __m128 queryVelocityX = _mm_set1_ps(query->velocityX);
+    __m128 queryVelocityY = _mm_set1_ps(query->velocityY);
+    __m128 queryVelocityZ = _mm_set1_ps(query->velocityZ);
+    __m128 radiusSq = _mm_set1_ps(query->radiusSq);
+    __m128 zero = _mm_setzero_ps();
+    __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+    int count = 0;
+    int k = start;
+
+    // Eight candidates per iteration as two halves of four
+    for (; k + 8 <= end; k += 8) {
+        for (int half = 0; half < 8; half += 4) {
+            int base = k + half;
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(candidates->x + base), queryX);
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(candidates->y + base), queryY);
+            __m128 dz = _mm_sub_ps(_mm_loadu_ps(candidates->z + base), queryZ);
+            __m128 distanceSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+            __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(queryVelocityX, _mm_loadu_ps(candidates->velocityX + base)),
+                                               _mm_mul_ps(queryVelocityY, _mm_loadu_ps(candidates->velocityY + base))),
+                                    _mm_mul_ps(queryVelocityZ, _mm_loadu_ps(candidates->velocityZ + base)));
+            __m128 pass = _mm_and_ps(_mm_cmplt_ps(distanceSq, radiusSq), _mm_cmpgt_ps(dot, zero));
+            int mask = _mm_movemask_ps(pass);
+
+            __m128i indexes = _mm_add_epi32(_mm_set1_epi32(base), lanes);
+            __m128i shuffle = _mm_loadu_si128((const __m128i *)compactBytes4[mask]);
+            _mm_storeu_si128((__m128i *)(accepted + count), _mm_shuffle_epi8(indexes, shuffle));
+            count += maskCounts[mask];
+        }
+    }
+
+    return count + FilterNeighboursScalar(candidates, k, end, query, accepted + count);
+}
+
+// Position along one axis relative to the query, which has the origin taken off already
+TARGET_SSE41 static inline __m128 DecodeFixedSse41(const uint16_t *values, __m128 scale, __m128 query) {
+    __m128i q = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)values));
+    return _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(q), scale), query);
+}
+
+// Sign extended, so the sign lands in bit 31 and the bits copied below it are masked off
+TARGET_SSE41 static inline __m128 WidenHalfSse41(const uint16_t *values) {
+    __m128i half = _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *)values));
+    return _mm_castsi128_ps(_mm_and_si128(_mm_slli_epi32(half, 13), _mm_set1_epi32((int)0x8FFFE000u)));
+}
+
+TARGET_SSE41 static int FilterCompactNeighboursSse41(const CompactCandidates *candidates, int start, int end,
+                                                     const NeighbourQuery *query, int *accepted) {
+    __m128 scaleX = _mm_set1_ps(candidates->scaleX);
+    __m128 scaleY = _mm_set1_ps(candidates->scaleY);
+    __m128 scaleZ = _mm_set1_ps(candidates->scaleZ);
+    __m128 queryX = _mm_set1_ps(query->x - candidates->originX);
+    __m128 queryY = _mm_set1_ps(query->y - candidates->originY);
+    __m128 queryZ = _mm_set1_ps(query->z - candidates->originZ);
+    __m128 queryVelocityX = _mm_set1_ps(query->velocityX*HALF_REBIAS);
+    __m128 queryVelocityY = _mm_set1_ps(query->velocityY*HALF_REBIAS);
+    __m128 queryVelocityZ = _mm_set1_ps(query->velocityZ*HALF_REBIAS);
+    __m128 radiusSq = _mm_set1_ps(query->radiusSq);
+    __m128 zero = _mm_setzero_ps();
+    __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+    int count = 0;
+    int k = start;
+
+    for (; k + 4 <= end; k += 4) {
+        __m128 dx = DecodeFixedSse41(candidates->x + k, scaleX, queryX);
+        __m128 dy = DecodeFixedSse41(candidates->y + k, scaleY, queryY);
+        __m128 dz = DecodeFixedSse41(candidates->z + k, scaleZ, queryZ);
+        __m128 distanceSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+        __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(queryVelocityX, WidenHalfSse41(candidates->velocityX + k)),
+                                           _mm_mul_ps(queryVelocityY, WidenHalfSse41(candidates->velocityY + k))),
+                                _mm_mul_ps(queryVelocityZ, WidenHalfSse41(candidates->velocityZ + k)));
+        __m128 pass = _mm_and_ps(_mm_cmplt_ps(distanceSq, radiusSq), _mm_cmpgt_ps(dot, zero));
+        int mask = _mm_movemask_ps(pass);
+
+        __m128i indexes = _mm_add_epi32(_mm_set1_epi32(k), lanes);
+        __m128i shuffle = _mm_loadu_si128((const __m128i *)compactBytes4[mask]);
+        _mm_storeu_si128((__m128i *)(accepted + count), _mm_shuffle_epi8(indexes, shuffle));
+        count += maskCounts[mask];
+    }
+
+    return count + FilterCompactNeighboursScalar(candidates, k, end, query, accepted + count);
+}
+
+typedef struct QueryAvx2 {
+    __m256 x, y, z;
+    __m256 velocityX, velocityY, velocityZ;
+    __m256 radiusSq;
+} QueryAvx2;
+
+// Accept mask of the eight candidates at k, lanes outside valid are never loaded or accepted
+TARGET_AVX2 static inline int TestBlockAvx2(const NeighbourCandidates *candidates, int k, const QueryAvx2 *query, __m256i valid) {
+    __m256 dx = _mm256_sub_ps(_mm256_maskload_ps(candidates->x + k, valid), query->x);
+    __m256 dy = _mm256_sub_ps(_mm256_maskload_ps(candidates->y + k, valid), query->y);
+    __m256 dz = _mm256_sub_ps(_mm256_maskload_ps(candidates->z + k, valid), query->z);
+    __m256 distanceSq = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+    __m256 dot = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(query->velocityX, _mm256_maskload_ps(candidates->velocityX + k, valid)),
+                                             _mm256_mul_ps(query->velocityY, _mm256_maskload_ps(candidates->velocityY + k, valid))),
+                               _mm256_mul_ps(query->velocityZ, _mm256_maskload_ps(candidates->velocityZ + k, valid)));
+    __m256 pass = _mm256_and_ps(_mm256_cmp_ps(distanceSq, query->radiusSq, _CMP_LT_OQ), _mm256_cmp_ps(dot, _mm256_setzero_ps(), _CMP_GT_OQ));
+
+    return _mm256_movemask_ps(_mm256_and_ps(pass, _mm256_castsi256_ps(valid)));
+}
+
+// The tail goes through a masked block instead of the scalar kernel, mixing in non-VEX code
+// while the upper register halves are live costs more than the whole call
+TARGET_AVX2 static int FilterNeighboursAvx2(const NeighbourCandidates *candidates, int start, int end,
+                                            const NeighbourQuery *query, int *accepted) {
+    QueryAvx2 wide = {
+        _mm256_set1_ps(query->x), _mm256_set1_ps(query->y), _mm256_set1_ps(query->z),
+        _mm256_set1_ps(query->velocityX), _mm256_set1_ps(query->velocityY), _mm256_set1_ps(query->velocityZ),
+        _mm256_set1_ps(query->radiusSq)
+    };
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i allLanes = _mm256_set1_epi32(-1);
+    int count = 0;
+
+    for (int k = start; k < end; k += 8) {
+        __m256i valid = (k + 8 <= end)? allLanes : _mm256_cmpgt_epi32(_mm256_set1_epi32(end - k), lanes);
+        int mask = TestBlockAvx2(candidates, k, &wide, valid);
+
+        // Masked compaction: permute the accepted lanes to the front and store all eight
+        __m256i indexes = _mm256_add_epi32(_mm256_set1_epi32(k), lanes);
+        __m256i permutation = _mm256_loadu_si256((const __m256i *)compactLanes8[mask]);
+        _mm256_storeu_si256((__m256i *)(accepted + count), _mm256_permutevar8x32_epi32(indexes, permutation));
+        count += maskCounts[mask];
+    }
+
+    return count;
+}
+
+// Position along one axis relative to the query, which has the origin taken off already.
+// The arrays have slack for the lanes past the end.
+TARGET_AVX2 static inline __m256 DecodeFixedAvx2(const uint16_t *values, __m256 scale, __m256 query) {
+    __m256i q = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)values));
+    return _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(q), scale), query);
+}
+
+TARGET_AVX2 static inline __m256 WidenHalfAvx2(const uint16_t *values) {
+    __m256i half = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)values));
+    return _mm256_castsi256_ps(_mm256_and_si256(_mm256_slli_epi32(half, 13), _mm256_set1_epi32((int)0x8FFFE000u)));
+}
+
+// Accept mask of the count (at most eight) candidates at k. The query holds positions less
+// the origin and velocities times HALF_REBIAS.
+TARGET_AVX2 static inline int TestCompactBlockAvx2(const CompactCandidates *candidates, int k, int count,
+                                                   const QueryAvx2 *query, const __m256 *scale) {
+    __m256 dx = DecodeFixedAvx2(candidates->x + k, scale[0], query->x);
+    __m256 dy = DecodeFixedAvx2(candidates->y + k, scale[1], query->y);
+    __m256 dz = DecodeFixedAvx2(candidates->z + k, scale[2], query->z);
+    __m256 distanceSq = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+    __m256 dot = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(query->velocityX, WidenHalfAvx2(candidates->velocityX + k)),
+                                             _mm256_mul_ps(query->velocityY, WidenHalfAvx2(candidates->velocityY + k))),
+                               _mm256_mul_ps(query->velocityZ, WidenHalfAvx2(candidates->velocityZ + k)));
+    __m256 pass = _mm256_and_ps(_mm256_cmp_ps(distanceSq, query->radiusSq, _CMP_LT_OQ), _mm256_cmp_ps(dot, _mm256_setzero_ps(), _CMP_GT_OQ));
+
+    return _mm256_movemask_ps(pass) & ((count >= 8)? 0xFF : (1 << count) - 1);
+}
+
+TARGET_AVX2 static int FilterCompactNeighboursAvx2(const CompactCandidates *candidates, int start, int end,
+                                                   const NeighbourQuery *query, int *accepted) {
+    __m256 scale[3] = { _mm256_set1_ps(candidates->scaleX), _mm256_set1_ps(candidates->scaleY), _mm256_set1_ps(candidates->scaleZ) };
+    QueryAvx2 wide = {
+        _mm256_set1_ps(query->x - candidates->originX), _mm256_set1_ps(query->y - candidates->originY),
+        _mm256_set1_ps(query->z - candidates->originZ), _mm256_set1_ps(query->velocityX*HALF_REBIAS),
+        _mm256_set1_ps(query->velocityY*HALF_REBIAS), _mm256_set1_ps(query->velocityZ*HALF_REBIAS),
+        _mm256_set1_ps(query->radiusSq)
+    };
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    int count = 0;
+
+    for (int k = start; k < end; k += 8) {
+        int mask = TestCompactBlockAvx2(candidates, k, end - k, &wide, scale);
+
+        __m256i indexes = _mm256_add_epi32(_mm256_set1_epi32(k), lanes);
+        __m256i permutation = _mm256_loadu_si256((const __m256i *)compactLanes8[mask]);
+        _mm256_storeu_si256((__m256i *)(accepted + count), _mm256_permutevar8x32_epi32(indexes, permutation));
+        count += maskCounts[mask];
+    }
+
+    return count;
+}
+
+static void DetectCpuFeatures(bool *sse41, bool *avx2) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4] = { 0 };
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+
+    __cpuid(info, 1);
+    bool osUsesYmm = false;
+    *sse41 = (info[2] & (1 << 19)) != 0;
+    if ((info[2] & (1 << 27)) && (info[2] & (1 << 28))) osUsesYmm = ((_xgetbv(0) & 6) == 6);
+
+    *avx2 = false;
+    if (osUsesYmm && (maxLeaf >= 7)) {
+        __cpuidex(info, 7, 0);
+        *avx2 = (info[1] & (1 << 5)) != 0;
+    }
+#else
+    __builtin_cpu_init();
+    *sse41 = __builtin_cpu_supports("sse4.1");
+    *avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // NEIGHBOUR_KERNEL_X86
+
+bool IsNeighbourKernelSupported(NeighbourKernel kernel) {
+    if (kernel == NEIGHBOUR_KERNEL_SCALAR) return true;
+
+#if defined(NEIGHBOUR_KERNEL_X86)
+    bool sse41 = false;
+    bool avx2 = false;
+    DetectCpuFeatures(&sse41, &avx2);
+    if (kernel == NEIGHBOUR_KERNEL_SSE41) return sse41;
+    if (kernel == NEIGHBOUR_KERNEL_AVX2) return avx2;
+#endif
+
+    return false;
+}
+
+// Falls back to scalar when the kernel does not run on this CPU
+void SetNeighbourKernel(NeighbourKernel kernel) {
+    if (!IsNeighbourKernelSupported(kernel)) kernel = NEIGHBOUR_KERNEL_SCALAR;
+
+#if defined(NEIGHBOUR_KERNEL_X86)
+    InitCompactTables();
+#endif
+
+    switch (kernel) {
+#if defined(NEIGHBOUR_KERNEL_X86)
+        case NEIGHBOUR_KERNEL_AVX2: {
+            FilterNeighbours = FilterNeighboursAvx2;
+            FilterCompactNeighbours = FilterCompactNeighboursAvx2;
+        } break;
+        case NEIGHBOUR_KERNEL_SSE41: {
+            FilterNeighbours = FilterNeighboursSse41;
+            FilterCompactNeighbours = FilterCompactNeighboursSse41;
+        } break;
+#endif
+        default: {
+            FilterNeighbours = FilterNeighboursScalar;
+            FilterCompactNeighbours = FilterCompactNeighboursScalar;
+        } break;
+    }
+
+    currentKernel = kernel;
+    kernelInitialised = true;
+}
+
+// Picks the widest kernel the CPU supports, only the first call does anything
+void InitNeighbourKernel(void) {
+    if (kernelInitialised) return;
+
+    NeighbourKernel kernel = NEIGHBOUR_KERNEL_SCALAR;
+    if (IsNeighbourKernelSupported(NEIGHBOUR_KERNEL_AVX2)) kernel = NEIGHBOUR_KERNEL_AVX2;
+    else if (IsNeighbourKernelSupported(NEIGHBOUR_KERNEL_SSE41)) kernel = NEIGHBOUR_KERNEL_SSE41;
+
+    SetNeighbourKernel(kernel);
+}
+
+NeighbourKernel GetNeighbourKernel(void) {
+    return currentKernel;
+}
+
+const char *GetNeighbourKernelName(NeighbourKernel kernel) {
+    switch (kernel) {
+        case NEIGHBOUR_KERNEL_AVX2: return "AVX2";
+        case NEIGHBOUR_KERNEL_SSE41: return "SSE4.1";
+        default: return "scalar";
+    }
+}
@@ -0,0 +1,131 @@
+/*******************************************************************************************
+*
+*   neighbour_kernel - Vectorised neighbour candidate test with runtime CPU dispatch
+*
+*   Candidates are packed as one float array per component. A candidate is accepted when its
+*   squared distance to the query is below radiusSq and its velocity points the same way as
+*   the query velocity (positive dot product). Every kernel does the same float operations
+*   in the same order, so they all accept exactly the same candidates.
+*
+*   Compact candidates hold the same state in half the bytes: positions as 16 bit fixed point
+*   over a fixed range, velocities as IEEE half floats. The compact kernels decode them in
+*   registers, again with identical results across kernels. Positions are decoded relative
+*   to the query. Velocities only ever meet the query velocity in the dot product, so the
+*   query is scaled by 2^112 instead and a half decodes with a shift and a mask, no F16C
+*   needed. The scaling is exact, the dot product is the same as with decoded halves.
+*
+*   The kernel is picked once by InitNeighbourKernel(): AVX2, SSE4.1 or scalar on x86 with
+*   GCC, Clang or MSVC, scalar everywhere else.
+*
+********************************************************************************************/
+
+#ifndef NEIGHBOUR_KERNEL_H
+#define NEIGHBOUR_KERNEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Kernels may write up to this many entries past the accepted count
+#define NEIGHBOUR_KERNEL_SLACK 8
+
+typedef enum {
+    NEIGHBOUR_KERNEL_SCALAR = 0,
+    NEIGHBOUR_KERNEL_SSE41,
+    NEIGHBOUR_KERNEL_AVX2,
+    NEIGHBOUR_KERNEL_COUNT
+} NeighbourKernel;
+
+typedef struct NeighbourQuery {
+    float x;
+    float y;
+    float z;
+    float velocityX;
+    float velocityY;
+    float velocityZ;
+    float radiusSq;
+} NeighbourQuery;
+
+typedef struct NeighbourCandidates {
+    const float *x;
+    const float *y;
+    const float *z;
+    const float *velocityX;
+    const float *velocityY;
+    const float *velocityZ;
+} NeighbourCandidates;
+
+// Positions decode to origin + q*scale on every axis, velocities are half floats. Kernels may
+// read up to NEIGHBOUR_KERNEL_SLACK entries past the end, the arrays need room for them.
+// Query velocities have to stay below 2^16.
+typedef struct CompactCandidates {
+    const uint16_t *x;
+    const uint16_t *y;
+    const uint16_t *z;
+    const uint16_t *velocityX;
+    const uint16_t *velocityY;
+    const uint16_t *velocityZ;
+    float originX;
+    float originY;
+    float originZ;
+    float scaleX;
+    float scaleY;
+    float scaleZ;
+} CompactCandidates;
+
+// Tests candidates [start, end) and writes the positions of the accepted ones in ascending
+// order to accepted, which needs room for (end - start) + NEIGHBOUR_KERNEL_SLACK entries
+typedef int (*FilterNeighboursFunc)(const NeighbourCandidates *candidates, int start, int end,
+                                    const NeighbourQuery *query, int *accepted);
+
+typedef int (*FilterCompactNeighboursFunc)(const CompactCandidates *candidates, int start, int end,
+                                           const NeighbourQuery *query, int *accepted);
+
+extern FilterNeighboursFunc FilterNeighbours;
+extern FilterCompactNeighboursFunc FilterCompactNeighbours;
+
+void InitNeighbourKernel(void);
+bool IsNeighbourKernelSupported(NeighbourKernel kernel);
+void SetNeighbourKernel(NeighbourKernel kernel);
+NeighbourKernel GetNeighbourKernel(void);
+const char *GetNeighbourKernelName(NeighbourKernel kernel);
+
+// Rounds to the nearest step of scale, clamped to the 16 bit range
+static inline uint16_t EncodeFixed(float value, float origin, float inverseScale) {
+    float q = (value - origin)*inverseScale + 0.5f;
+    q = (q > 0.0f)? q : 0.0f;
+    return (uint16_t)((q < 65535.0f)? q : 65535.0f);
+}
+
+static inline float DecodeFixed(uint16_t q, float origin, float scale) {
+    return origin + (float)q*scale;
+}
+
+// Rounds to nearest, clamped to the largest finite half. Relative error at most 2^-11
+// down to 2^-14, below that the absolute error is at most 2^-25.
+static inline uint16_t EncodeHalf(float value) {
+    union { float f; uint32_t u; } bits = { value };
+    uint32_t sign = (bits.u >> 16) & 0x8000u;
+    float magnitude = (value < 0.0f)? -value : value;
+
+    if (!(magnitude < 65504.0f)) magnitude = 65504.0f;
+    if (magnitude < 6.103515625e-05f) return (uint16_t)(sign | (uint32_t)(magnitude*16777216.0f + 0.5f));
+
+    bits.f = magnitude;
+    bits.u += 0xFFFu + ((bits.u >> 13) & 1u);
+    return (uint16_t)(sign | ((bits.u >> 13) - (112u << 10)));
+}
+
+#define HALF_REBIAS 5.192296858534828e+33f     // 2^112, float exponent bias less the half's
+
+// The half's bits moved into float position, which is exactly its value over HALF_REBIAS
+static inline float WidenHalf(uint16_t half) {
+    union { float f; uint32_t u; } bits;
+    bits.u = ((uint32_t)(half & 0x8000u) << 16) | ((uint32_t)(half & 0x7FFFu) << 13);
+    return bits.f;
+}
+
+static inline float DecodeHalf(uint16_t half) {
+    return WidenHalf(half)*HALF_REBIAS;
+}
+
+#endif // NEIGHBOUR_KERNEL_H
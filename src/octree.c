@@ -0,0 +1,175 @@
+/*******************************************************************************************
+*
+*   octree - Adaptive octree for fixed-radius neighbour queries on clustered points
+*
+********************************************************************************************/
+
+#include "octree.h"
+
+#include <stdlib.h>
+
+// Tree over the box [-bounds, bounds], points outside it go to the nearest octant
+Octree LoadOctree(float boundsX, float boundsY, float boundsZ, int capacity, Arena *arena) {
+    Octree tree = { 0 };
+
+    tree.boundsX = boundsX;
+    tree.boundsY = boundsY;
+    tree.boundsZ = boundsZ;
+    tree.capacity = capacity;
+    tree.arena = arena;
+    tree.nodeCapacity = 2*(capacity/OCTREE_LEAF_SIZE) + 1;
+
+    tree.pointIndexes = (int *)ArenaAlloc(arena, capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    tree.pointOrders = (int *)ArenaAlloc(arena, capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    tree.indexScratch = (int *)ArenaAlloc(arena, 2*capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    tree.octants = (unsigned char *)ArenaAlloc(arena, capacity*sizeof(unsigned char), ARENA_TAG_NEIGHBOUR_SEARCH);
+    tree.nodes = (OctreeNode *)ArenaAlloc(arena, tree.nodeCapacity*sizeof(OctreeNode), ARENA_TAG_NEIGHBOUR_SEARCH);
+
+    return tree;
+}
+
+void UnloadOctree(Octree *tree) {
+    ArenaFree(tree->arena, tree->queues, tree->queueCapacity*sizeof(OctreeCursor), ARENA_TAG_NEIGHBOUR_SEARCH);
+    ArenaFree(tree->arena, tree->nodes, tree->nodeCapacity*sizeof(OctreeNode), ARENA_TAG_NEIGHBOUR_SEARCH);
+    ArenaFree(tree->arena, tree->octants, tree->capacity*sizeof(unsigned char), ARENA_TAG_NEIGHBOUR_SEARCH);
+    ArenaFree(tree->arena, tree->indexScratch, 2*tree->capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    ArenaFree(tree->arena, tree->pointOrders, tree->capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    ArenaFree(tree->arena, tree->pointIndexes, tree->capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    *tree = (Octree){ 0 };
+}
+
+// Reserves count contiguous nodes, returns the first. May move tree->nodes.
+static int AllocateNodes(Octree *tree, int count) {
+    if (tree->nodeCount + count > tree->nodeCapacity) {
+        int capacity = tree->nodeCapacity;
+        while (tree->nodeCount + count > capacity) capacity *= 2;
+        tree->nodes = (OctreeNode *)ArenaGrow(tree->arena, tree->nodes, tree->nodeCapacity*sizeof(OctreeNode),
+                                              capacity*sizeof(OctreeNode), ARENA_TAG_NEIGHBOUR_SEARCH);
+        tree->nodeCapacity = capacity;
+    }
+
+    int first = tree->nodeCount;
+    tree->nodeCount += count;
+    return first;
+}
+
+static void BuildNode(Octree *tree, const float *x, const float *y, const float *z, int nodeIndex,
+                      float centerX, float centerY, float centerZ, float halfX, float halfY, float halfZ, int depth) {
+    OctreeNode *node = &tree->nodes[nodeIndex];
+    int start = node->start;
+    int end = node->end;
+    int *pointIndexes = tree->pointIndexes;
+
+    node->minX = node->maxX = x[pointIndexes[start]];
+    node->minY = node->maxY = y[pointIndexes[start]];
+    node->minZ = node->maxZ = z[pointIndexes[start]];
+    for (int k = start + 1; k < end; k++) {
+        int i = pointIndexes[k];
+        if (x[i] < node->minX) node->minX = x[i];
+        if (x[i] > node->maxX) node->maxX = x[i];
+        if (y[i] < node->minY) node->minY = y[i];
+        if (y[i] > node->maxY) node->maxY = y[i];
+        if (z[i] < node->minZ) node->minZ = z[i];
+        if (z[i] > node->maxZ) node->maxZ = z[i];
+    }
+    node->firstChild = -1;
+    node->childCount = 0;
+    node->firstOrder = tree->pointOrders[start];
+
+    if ((end - start <= OCTREE_LEAF_SIZE) || (depth == OCTREE_MAX_DEPTH)) return;
+
+    // Stable counting sort of the range by octant, points keep their build order
+    int octantStart[9] = { 0 };
+    for (int k = start; k < end; k++) {
+        int i = pointIndexes[k];
+        int octant = (x[i] >= centerX) | ((y[i] >= centerY) << 1) | ((z[i] >= centerZ) << 2);
+        tree->octants[k] = (unsigned char)octant;
+        octantStart[octant + 1]++;
+    }
+    int childCount = 0;
+    for (int o = 0; o < 8; o++) {
+        if (octantStart[o + 1] > 0) childCount++;
+        octantStart[o + 1] += octantStart[o];
+    }
+
+    int *orderScratch = tree->indexScratch + tree->capacity;
+    int cursor[8];
+    for (int o = 0; o < 8; o++) cursor[o] = start + octantStart[o];
+    for (int k = start; k < end; k++) {
+        int slot = cursor[tree->octants[k]]++;
+        tree->indexScratch[slot] = pointIndexes[k];
+        orderScratch[slot] = tree->pointOrders[k];
+    }
+    for (int k = start; k < end; k++) {
+        pointIndexes[k] = tree->indexScratch[k];
+        tree->pointOrders[k] = orderScratch[k];
+    }
+
+    int firstChild = AllocateNodes(tree, childCount);
+    int child = firstChild;
+    tree->nodes[nodeIndex].firstChild = firstChild;
+    tree->nodes[nodeIndex].childCount = childCount;
+
+    for (int o = 0; o < 8; o++) {
+        if (octantStart[o + 1] == octantStart[o]) continue;
+
+        tree->nodes[child].start = start + octantStart[o];
+        tree->nodes[child].end = start + octantStart[o + 1];
+        BuildNode(tree, x, y, z, child,
+                  centerX + ((o & 1)? 0.5f : -0.5f)*halfX,
+                  centerY + ((o & 2)? 0.5f : -0.5f)*halfY,
+                  centerZ + ((o & 4)? 0.5f : -0.5f)*halfZ,
+                  0.5f*halfX, 0.5f*halfY, 0.5f*halfZ, depth + 1);
+        child++;
+    }
+}
+
+// Builds the tree over count points, added in the order given (index order when NULL),
+// which is the order they keep inside every node
+void BuildOctree(Octree *tree, const float *x, const float *y, const float *z, int count, const int *order) {
+    tree->nodeCount = 0;
+    if (count == 0) return;
+
+    for (int k = 0; k < count; k++) {
+        tree->pointIndexes[k] = (order != NULL)? order[k] : k;
+        tree->pointOrders[k] = k;
+    }
+
+    int root = AllocateNodes(tree, 1);
+    tree->nodes[root].start = 0;
+    tree->nodes[root].end = count;
+    BuildNode(tree, x, y, z, root, 0.0f, 0.0f, 0.0f, tree->boundsX, tree->boundsY, tree->boundsZ, 0);
+}
+
+// Room for queueCount queries to run at once on the tree as built, call after BuildOctree().
+// A query never queues more cursors than the tree has nodes.
+void ReserveOctreeQueues(Octree *tree, int queueCount) {
+    int capacity = queueCount*((tree->nodeCount > 0)? tree->nodeCount : 1);
+
+    if (capacity > tree->queueCapacity) {
+        tree->queues = (OctreeCursor *)ArenaGrow(tree->arena, tree->queues, tree->queueCapacity*sizeof(OctreeCursor),
+                                                 capacity*sizeof(OctreeCursor), ARENA_TAG_NEIGHBOUR_SEARCH);
+        tree->queueCapacity = capacity;
+    }
+    tree->queueCount = queueCount;
+}
+
+OctreeCursor *GetOctreeQueue(const Octree *tree, int queue) {
+    return tree->queues + queue*tree->nodeCount;
+}
+
+static float AxisGap(float value, float min, float max) {
+    if (value < min) return min - value;
+    if (value > max) return value - max;
+    return 0.0f;
+}
+
+// Squared distance from a point to the node's bounding box, never more than the squared
+// distance to any point inside it, so it is safe to prune with
+float OctreeNodeDistanceSq(const OctreeNode *node, float x, float y, float z) {
+    float dx = AxisGap(x, node->minX, node->maxX);
+    float dy = AxisGap(y, node->minY, node->maxY);
+    float dz = AxisGap(z, node->minZ, node->maxZ);
+
+    return dx*dx + dy*dy + dz*dz;
+}
@@ -0,0 +1,69 @@
+/*******************************************************************************************
+*
+*   octree - Adaptive octree for fixed-radius neighbour queries on clustered points
+*
+*   Nodes split in half on every axis while they hold more than OCTREE_LEAF_SIZE points, so
+*   dense clumps end up in small leaves and empty space costs nothing. Every node keeps the
+*   bounding box of its points rather than its split region, which keeps queries correct
+*   for points that stray past the bounds and lets them skip loosely filled nodes.
+*
+*   The tree is rebuilt from scratch by BuildOctree(), there is no incremental update.
+*
+********************************************************************************************/
+
+#ifndef OCTREE_H
+#define OCTREE_H
+
+#include "arena.h"
+
+#define OCTREE_LEAF_SIZE 64
+#define OCTREE_MAX_DEPTH 12
+
+typedef struct OctreeNode {
+    float minX;             // Bounding box of the points in the node
+    float minY;
+    float minZ;
+    float maxX;
+    float maxY;
+    float maxZ;
+    int start;              // Range of pointIndexes held by the node
+    int end;
+    int firstChild;         // Children are contiguous, -1 for a leaf
+    int childCount;
+    int firstOrder;         // Smallest build position of the points in the node
+} OctreeNode;
+
+// A node waiting in a query queue, or for a leaf the part of it not scanned yet
+typedef struct OctreeCursor {
+    int order;              // Smallest build position left in the node
+    int node;
+    int start;
+} OctreeCursor;
+
+typedef struct Octree {
+    float boundsX;
+    float boundsY;
+    float boundsZ;
+    int capacity;
+    Arena *arena;           // Where the arrays live, NULL for the heap
+    int nodeCount;
+    int nodeCapacity;
+    OctreeNode *nodes;      // Root first, grows as needed
+    int queueCount;
+    int queueCapacity;
+    OctreeCursor *queues;   // Query scratch, queueCount queues of nodeCount cursors one after another
+    int *pointIndexes;      // Point indexes ordered by leaf, in build order within a node
+    int *pointOrders;       // Build position of every entry of pointIndexes
+    int *indexScratch;
+    unsigned char *octants;
+} Octree;
+
+Octree LoadOctree(float boundsX, float boundsY, float boundsZ, int capacity, Arena *arena);
+void UnloadOctree(Octree *tree);
+
+void BuildOctree(Octree *tree, const float *x, const float *y, const float *z, int count, const int *order);
+void ReserveOctreeQueues(Octree *tree, int queueCount);
+OctreeCursor *GetOctreeQueue(const Octree *tree, int queue);
+float OctreeNodeDistanceSq(const OctreeNode *node, float x, float y, float z);
+
+#endif // OCTREE_H
@@ -0,0 +1,501 @@
+/*******************************************************************************************
+*
+*   recorder - Every step's boid positions streamed to a file by a background writer
+*
+********************************************************************************************/
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE                 // O_DIRECT
+#endif
+
+#include "recorder.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+// Without threads there is no other side to order against, plain accesses do
+static unsigned int LoadUnsigned(const unsigned int *value) {
+#if defined(THREAD_POOL_PTHREADS)
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#else
+    return *value;
+#endif
+}
+
+static void StoreUnsigned(unsigned int *value, unsigned int newValue) {
+#if defined(THREAD_POOL_PTHREADS)
+    __atomic_store_n(value, newValue, __ATOMIC_RELEASE);
+#else
+    *value = newValue;
+#endif
+}
+
+static long long LoadLong(const long long *value) {
+#if defined(THREAD_POOL_PTHREADS)
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+#else
+    return *value;
+#endif
+}
+
+static void StoreLong(long long *value, long long newValue) {
+#if defined(THREAD_POOL_PTHREADS)
+    __atomic_store_n(value, newValue, __ATOMIC_RELAXED);
+#else
+    *value = newValue;
+#endif
+}
+
+// Every counter has a single writer, so a load and a store add up
+static void AddLong(long long *value, long long amount) {
+    StoreLong(value, LoadLong(value) + amount);
+}
+
+static double LoadDouble(const double *value) {
+#if defined(THREAD_POOL_PTHREADS)
+    double result = 0.0;
+    __atomic_load(value, &result, __ATOMIC_RELAXED);
+    return result;
+#else
+    return *value;
+#endif
+}
+
+static void AddDouble(double *value, double amount) {
+#if defined(THREAD_POOL_PTHREADS)
+    double result = LoadDouble(value) + amount;
+    __atomic_store(value, &result, __ATOMIC_RELAXED);
+#else
+    *value += amount;
+#endif
+}
+
+static size_t RoundUpToBlock(size_t size) {
+    return (size + RECORDER_BLOCK - 1)/RECORDER_BLOCK*RECORDER_BLOCK;
+}
+
+static size_t GetFrameBytes(int count) {
+    return sizeof(RecorderFrameHeader) + 3*(size_t)count*sizeof(float);
+}
+
+// Writes size bytes from a block aligned buffer, false when the file took less. A file system
+// that accepts O_DIRECT on open but not on write gets written normally from then on.
+static bool WriteBlocks(Recorder *recorder, const unsigned char *data, size_t size) {
+#if defined(_WIN32)
+    return (fwrite(data, 1, size, recorder->file) == size);
+#else
+    while (size > 0) {
+        ssize_t written = write(recorder->descriptor, data, size);
+        if (written > 0) {
+            data += written;
+            size -= (size_t)written;
+        }
+        else if ((written < 0) && (errno == EINTR)) continue;
+#if defined(O_DIRECT)
+        else if ((written < 0) && (errno == EINVAL) && recorder->direct) {
+            fcntl(recorder->descriptor, F_SETFL, fcntl(recorder->descriptor, F_GETFL) & ~O_DIRECT);
+            recorder->direct = false;
+        }
+#endif
+        else return false;
+    }
+    return true;
+#endif
+}
+
+static unsigned char *GetSlab(const Recorder *recorder, unsigned int sequence) {
+    return recorder->slabs + (size_t)(sequence%(unsigned int)recorder->slabCount)*recorder->slabBytes;
+}
+
+static void WriteToFile(Recorder *recorder, const unsigned char *data, size_t size) {
+    double start = GetWallTime();
+
+    TraceBegin("write");
+    if (WriteBlocks(recorder, data, size)) AddLong(&recorder->stats.bytesWritten, (long long)size);
+    else AddLong(&recorder->stats.writeErrors, 1);
+    TraceEnd("write");
+
+    AddDouble(&recorder->stats.writeTime, GetWallTime() - start);
+}
+
+// Writes the whole blocks of the coded bytes and keeps the rest for later, or at the end
+// pads the rest with zeros to a block and writes it too
+static void WriteEncodedBlocks(Recorder *recorder, bool last) {
+    size_t used = recorder->encodedUsed;
+    size_t size = used/RECORDER_BLOCK*RECORDER_BLOCK;
+
+    if (last && (size < used)) {
+        size = RoundUpToBlock(used);
+        memset(recorder->encoded + used, 0, size - used);
+    }
+    if (size == 0) return;
+
+    WriteToFile(recorder, recorder->encoded, size);
+    recorder->encodedUsed = (used > size)? used - size : 0;
+    memmove(recorder->encoded, recorder->encoded + size, recorder->encodedUsed);
+}
+
+// Codes every frame of a slab onto the end of the coded bytes
+static void EncodeSlab(Recorder *recorder, const unsigned char *slab) {
+    RecorderSlabHeader header = { 0 };
+    size_t offset = sizeof(header);
+
+    memcpy(&header, slab, sizeof(header));
+    for (uint32_t f = 0; f < header.frames; f++) {
+        RecorderFrameHeader frame = { 0 };
+        memcpy(&frame, slab + offset, sizeof(frame));
+        if (recorder->encodedCapacity - recorder->encodedUsed < GetTrajectoryFrameBound(frame.count)) WriteEncodedBlocks(recorder, false);
+
+        double start = GetWallTime();
+        TraceBegin("encode");
+        size_t bytes = EncodeTrajectoryFrame(&recorder->codec, frame.step, frame.count, (const float *)(slab + offset + sizeof(frame)),
+                                             recorder->encoded + recorder->encodedUsed, recorder->encodedCapacity - recorder->encodedUsed);
+        TraceEnd("encode");
+        AddDouble(&recorder->stats.encodeTime, GetWallTime() - start);
+
+        if (bytes > 0) recorder->encodedUsed += bytes;
+        else AddLong(&recorder->stats.writeErrors, 1);
+        offset += GetFrameBytes(frame.count);
+    }
+    WriteEncodedBlocks(recorder, false);
+}
+
+// Writes out the oldest queued slab, coded or as it is, on the writer thread or the stepping
+// thread without one
+static void WriteSlab(Recorder *recorder) {
+    unsigned int sequence = recorder->written;
+
+    if (recorder->codec.quantBits > 0) EncodeSlab(recorder, GetSlab(recorder, sequence));
+    else WriteToFile(recorder, GetSlab(recorder, sequence), recorder->slabBytes);
+
+    AddLong(&recorder->stats.slabsWritten, 1);
+    StoreUnsigned(&recorder->written, sequence + 1);
+}
+
+#if defined(THREAD_POOL_PTHREADS)
+
+// Writes slabs as they are queued, and the ones still queued once stopping
+static void *RunRecorderThread(void *argument) {
+    Recorder *recorder = (Recorder *)argument;
+
+    NameTraceThread("recorder");
+    pthread_mutex_lock(&recorder->mutex);
+    for (;;) {
+        while ((recorder->written == LoadUnsigned(&recorder->queued)) && !recorder->stopping) {
+            pthread_cond_wait(&recorder->wake, &recorder->mutex);
+        }
+        if (recorder->written == LoadUnsigned(&recorder->queued)) break;
+
+        pthread_mutex_unlock(&recorder->mutex);
+        WriteSlab(recorder);
+        pthread_mutex_lock(&recorder->mutex);
+    }
+    pthread_mutex_unlock(&recorder->mutex);
+
+    return NULL;
+}
+
+#endif // THREAD_POOL_PTHREADS
+
+// Closes the slab being filled and hands it to the writer
+static void QueueSlab(Recorder *recorder) {
+    unsigned char *slab = GetSlab(recorder, recorder->queued);
+    RecorderSlabHeader header = { recorder->queued, (uint32_t)recorder->slabUsed, recorder->slabFrames };
+
+    memcpy(slab, &header, sizeof(header));
+    memset(slab + recorder->slabUsed, 0, recorder->slabBytes - recorder->slabUsed);
+    recorder->slabUsed = 0;
+
+    unsigned int queued = recorder->queued + 1;
+    long long depth = (long long)(queued - LoadUnsigned(&recorder->written));
+    if (depth > recorder->stats.queueHighWater) StoreLong(&recorder->stats.queueHighWater, depth);
+
+#if defined(THREAD_POOL_PTHREADS)
+    if (recorder->threaded) {
+        pthread_mutex_lock(&recorder->mutex);
+        StoreUnsigned(&recorder->queued, queued);
+        pthread_cond_signal(&recorder->wake);
+        pthread_mutex_unlock(&recorder->mutex);
+        return;
+    }
+#endif
+    StoreUnsigned(&recorder->queued, queued);
+    WriteSlab(recorder);
+}
+
+// Starts recording flock to a new file at path, recording its current state as the first
+// frame. slabBytes is rounded up to whole blocks and to at least one frame of the flock.
+// quantBits 0 writes the slabs as floats, anything else codes them, see trajectory_codec.h.
+// False when the file could not be opened or the slabs allocated.
+bool StartRecorder(Recorder *recorder, const char *path, const Flock *flock, float stepTime, size_t slabBytes, int slabCount,
+                   int quantBits, int keyframeInterval) {
+    *recorder = (Recorder){ 0 };
+
+    size_t smallest = RoundUpToBlock(sizeof(RecorderSlabHeader) + GetFrameBytes(flock->count));
+    recorder->slabBytes = RoundUpToBlock(slabBytes);
+    if (recorder->slabBytes < smallest) recorder->slabBytes = smallest;
+    recorder->slabCount = (slabCount > 1)? slabCount : 2;
+
+    // The coded bytes take the largest frame a slab can hold with every value escaped, and the
+    // part of a block left over from the last one
+    if (quantBits > 0) {
+        int largest = (int)((recorder->slabBytes - sizeof(RecorderSlabHeader) - sizeof(RecorderFrameHeader))/(3*sizeof(float)));
+        recorder->encodedCapacity = RoundUpToBlock(GetTrajectoryFrameBound(largest)) + RECORDER_BLOCK;
+        InitTrajectoryCodec(&recorder->codec, flock->boundsX, flock->boundsY, flock->boundsZ, quantBits, keyframeInterval);
+    }
+
+    // A block to align on, the header block, the slabs and the coded bytes
+    recorder->allocation = malloc(2*RECORDER_BLOCK + (size_t)recorder->slabCount*recorder->slabBytes + recorder->encodedCapacity);
+    if (recorder->allocation == NULL) {
+        UnloadTrajectoryCodec(&recorder->codec);
+        return false;
+    }
+    recorder->header = (unsigned char *)RoundUpToBlock((uintptr_t)recorder->allocation);
+    recorder->slabs = recorder->header + RECORDER_BLOCK;
+    recorder->encoded = recorder->slabs + (size_t)recorder->slabCount*recorder->slabBytes;
+
+#if defined(_WIN32)
+    recorder->file = fopen(path, "wb");
+    bool opened = (recorder->file != NULL);
+#else
+    recorder->descriptor = -1;
+#if defined(O_DIRECT)
+    recorder->descriptor = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    recorder->direct = (recorder->descriptor >= 0);
+#endif
+    if (recorder->descriptor < 0) recorder->descriptor = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#if defined(F_NOCACHE)
+    if (recorder->descriptor >= 0) recorder->direct = (fcntl(recorder->descriptor, F_NOCACHE, 1) == 0);
+#endif
+    bool opened = (recorder->descriptor >= 0);
+#endif
+    if (!opened) {
+        UnloadTrajectoryCodec(&recorder->codec);
+        free(recorder->allocation);
+        *recorder = (Recorder){ 0 };
+        return false;
+    }
+
+    RecorderFileHeader header = { 0 };
+    memcpy(header.magic, RECORDER_MAGIC, sizeof(header.magic));
+    header.version = RECORDER_VERSION;
+    header.headerSize = sizeof(RecorderFileHeader);
+    header.slabBytes = recorder->slabBytes;
+    header.stepTime = stepTime;
+    header.boundsX = flock->boundsX;
+    header.boundsY = flock->boundsY;
+    header.boundsZ = flock->boundsZ;
+    header.quantBits = (uint32_t)recorder->codec.quantBits;
+    header.keyframeInterval = (uint32_t)recorder->codec.keyframeInterval;
+    memset(recorder->header, 0, RECORDER_BLOCK);
+    memcpy(recorder->header, &header, sizeof(header));
+    if (!WriteBlocks(recorder, recorder->header, RECORDER_BLOCK)) recorder->stats.writeErrors++;
+
+#if defined(THREAD_POOL_PTHREADS)
+    pthread_mutex_init(&recorder->mutex, NULL);
+    pthread_cond_init(&recorder->wake, NULL);
+    recorder->threaded = (pthread_create(&recorder->thread, NULL, RunRecorderThread, recorder) == 0);
+#endif
+    recorder->recording = true;
+    RecordFlockFrame(recorder, flock);
+    return true;
+}
+
+// Copies the flock's positions by id into the slab being filled, on the thread stepping the
+// flock. Never waits: with every slab queued for the writer the frame is dropped.
+void RecordFlockFrame(Recorder *recorder, const Flock *flock) {
+    if (!recorder->recording) return;
+
+    size_t frameBytes = GetFrameBytes(flock->count);
+    if ((recorder->slabUsed > 0) && (recorder->slabUsed + frameBytes > recorder->slabBytes)) QueueSlab(recorder);
+
+    if (recorder->slabUsed == 0) {
+        bool full = (recorder->queued - LoadUnsigned(&recorder->written) >= (unsigned int)recorder->slabCount);
+        if (full || (sizeof(RecorderSlabHeader) + frameBytes > recorder->slabBytes)) {
+            AddLong(&recorder->stats.framesDropped, 1);
+            return;
+        }
+        recorder->slabUsed = sizeof(RecorderSlabHeader);
+        recorder->slabFrames = 0;
+    }
+
+    unsigned char *frame = GetSlab(recorder, recorder->queued) + recorder->slabUsed;
+    RecorderFrameHeader header = { flock->stepCounter, flock->count };
+    memcpy(frame, &header, sizeof(header));
+
+    float *x = (float *)(frame + sizeof(header));
+    float *y = x + flock->count;
+    float *z = y + flock->count;
+    for (int id = 0; id < flock->count; id++) {
+        int i = flock->slots[id];
+        x[id] = flock->positionX[i];
+        y[id] = flock->positionY[i];
+        z[id] = flock->positionZ[i];
+    }
+
+    recorder->slabUsed += frameBytes;
+    recorder->slabFrames++;
+    AddLong(&recorder->stats.framesRecorded, 1);
+    AddLong(&recorder->stats.bytesRecorded, 3*(long long)flock->count*(long long)sizeof(float));
+}
+
+// Queues the slab being filled, waits for the writer to write everything, writes the last of
+// the coded bytes and closes the file
+void StopRecorder(Recorder *recorder) {
+    if (!recorder->recording) return;
+
+    recorder->recording = false;
+    if (recorder->slabUsed > 0) QueueSlab(recorder);
+
+#if defined(THREAD_POOL_PTHREADS)
+    if (recorder->threaded) {
+        pthread_mutex_lock(&recorder->mutex);
+        recorder->stopping = true;
+        pthread_cond_signal(&recorder->wake);
+        pthread_mutex_unlock(&recorder->mutex);
+        pthread_join(recorder->thread, NULL);
+    }
+    pthread_cond_destroy(&recorder->wake);
+    pthread_mutex_destroy(&recorder->mutex);
+#endif
+
+    if (recorder->codec.quantBits > 0) WriteEncodedBlocks(recorder, true);
+    UnloadTrajectoryCodec(&recorder->codec);
+
+#if defined(_WIN32)
+    if (fclose(recorder->file) != 0) recorder->stats.writeErrors++;
+    recorder->file = NULL;
+#else
+    if (close(recorder->descriptor) != 0) recorder->stats.writeErrors++;
+    recorder->descriptor = -1;
+#endif
+    free(recorder->allocation);
+    recorder->allocation = NULL;
+    recorder->header = NULL;
+    recorder->slabs = NULL;
+    recorder->encoded = NULL;
+}
+
+RecorderStats GetRecorderStats(const Recorder *recorder) {
+    RecorderStats stats = { 0 };
+
+    stats.framesRecorded = LoadLong(&recorder->stats.framesRecorded);
+    stats.framesDropped = LoadLong(&recorder->stats.framesDropped);
+    stats.bytesRecorded = LoadLong(&recorder->stats.bytesRecorded);
+    stats.slabsWritten = LoadLong(&recorder->stats.slabsWritten);
+    stats.bytesWritten = LoadLong(&recorder->stats.bytesWritten);
+    stats.writeErrors = LoadLong(&recorder->stats.writeErrors);
+    stats.queueHighWater = LoadLong(&recorder->stats.queueHighWater);
+    stats.writeTime = LoadDouble(&recorder->stats.writeTime);
+    stats.encodeTime = LoadDouble(&recorder->stats.encodeTime);
+
+    return stats;
+}
+
+// Opens a recording and checks its header, false when it is not one this build can read
+bool OpenRecording(RecordingReader *reader, const char *path) {
+    *reader = (RecordingReader){ 0 };
+
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL) return false;
+
+    const RecorderFileHeader *header = &reader->header;
+    bool valid = (fread(&reader->header, sizeof(reader->header), 1, reader->file) == 1) &&
+                 (memcmp(header->magic, RECORDER_MAGIC, sizeof(header->magic)) == 0) &&
+                 (header->version == RECORDER_VERSION) && (header->headerSize == sizeof(RecorderFileHeader)) &&
+                 (header->slabBytes >= RECORDER_BLOCK) && (header->slabBytes%RECORDER_BLOCK == 0) &&
+                 (header->slabBytes <= UINT32_MAX) && (fseek(reader->file, RECORDER_BLOCK, SEEK_SET) == 0) &&
+                 ((header->quantBits == 0) || ((header->quantBits >= TRAJECTORY_MIN_BITS) && (header->quantBits <= TRAJECTORY_MAX_BITS)));
+    if (valid) {
+        reader->capacity = (size_t)header->slabBytes;
+        reader->slab = (unsigned char *)malloc(reader->capacity);
+    }
+    if (valid && (header->quantBits > 0)) {
+        InitTrajectoryCodec(&reader->codec, header->boundsX, header->boundsY, header->boundsZ, (int)header->quantBits,
+                            (int)header->keyframeInterval);
+    }
+
+    if (reader->slab == NULL) {
+        CloseRecording(reader);
+        return false;
+    }
+    return true;
+}
+
+// Makes sure the next size coded bytes have been read ahead, false past the end of the file
+static bool ReadAhead(RecordingReader *reader, size_t size) {
+    if (reader->end - reader->offset >= size) return true;
+
+    memmove(reader->slab, reader->slab + reader->offset, reader->end - reader->offset);
+    reader->end -= reader->offset;
+    reader->offset = 0;
+    if (size > reader->capacity) {
+        unsigned char *grown = (unsigned char *)realloc(reader->slab, RoundUpToBlock(size));
+        if (grown == NULL) return false;
+        reader->slab = grown;
+        reader->capacity = RoundUpToBlock(size);
+    }
+    reader->end += fread(reader->slab + reader->end, 1, reader->capacity - reader->end, reader->file);
+
+    return (reader->end >= size);
+}
+
+static const float *ReadCodedFrame(RecordingReader *reader, int *step, int *count) {
+    TrajectoryFrameHeader header = { 0 };
+    if (!ReadAhead(reader, sizeof(header))) return NULL;
+    memcpy(&header, reader->slab + reader->offset, sizeof(header));
+
+    // The zeros after the last frame read as a frame of no bytes
+    if ((header.bytes < sizeof(header)) || (header.count < 0) || (header.bytes > GetTrajectoryFrameBound(header.count))) return NULL;
+    if (!ReadAhead(reader, header.bytes)) return NULL;
+
+    const float *positions = DecodeTrajectoryFrame(&reader->codec, reader->slab + reader->offset, header.bytes, step, count);
+    if (positions != NULL) reader->offset += header.bytes;
+    return positions;
+}
+
+// The next frame's positions, count x then count y then count z, valid until the next read.
+// NULL at the end of the recording, or where it is cut short or damaged.
+const float *ReadRecordedFrame(RecordingReader *reader, int *step, int *count) {
+    if (reader->header.quantBits > 0) return ReadCodedFrame(reader, step, count);
+
+    RecorderSlabHeader slab = { 0 };
+    if (reader->slab != NULL) memcpy(&slab, reader->slab, sizeof(slab));
+
+    // On to the next slab once this one is read
+    while ((reader->offset == 0) || (reader->frame >= slab.frames)) {
+        if ((reader->slab == NULL) || (fread(reader->slab, (size_t)reader->header.slabBytes, 1, reader->file) != 1)) return NULL;
+
+        memcpy(&slab, reader->slab, sizeof(slab));
+        if ((slab.usedBytes < sizeof(slab)) || (slab.usedBytes > reader->header.slabBytes)) return NULL;
+        reader->offset = sizeof(slab);
+        reader->frame = 0;
+    }
+
+    RecorderFrameHeader frame = { 0 };
+    if (reader->offset + sizeof(frame) > slab.usedBytes) return NULL;
+    memcpy(&frame, reader->slab + reader->offset, sizeof(frame));
+    if ((frame.count < 0) || (reader->offset + GetFrameBytes(frame.count) > slab.usedBytes)) return NULL;
+
+    const float *positions = (const float *)(reader->slab + reader->offset + sizeof(frame));
+    reader->offset += GetFrameBytes(frame.count);
+    reader->frame++;
+
+    *step = frame.step;
+    *count = frame.count;
+    return positions;
+}
+
+void CloseRecording(RecordingReader *reader) {
+    if (reader->file != NULL) fclose(reader->file);
+    free(reader->slab);
+    UnloadTrajectoryCodec(&reader->codec);
+    *reader = (RecordingReader){ 0 };
+}
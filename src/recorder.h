@@ -0,0 +1,135 @@
+/*******************************************************************************************
+*
+*   recorder - Every step's boid positions streamed to a file by a background writer
+*
+*   Recording a step copies the positions, by id, into the slab being filled and nothing
+*   more. Slabs are large, allocated up front and block aligned; a full one is queued for a
+*   writer thread, which writes it out whole while the next one fills. The stepping thread
+*   never waits on the disk: when every slab is still queued the step is dropped and counted
+*   instead, and the deepest the queue got shows how close the writer came to that.
+*
+*   With quantBits set, the writer also runs the slabs through the trajectory codec, and
+*   the file is one header block then the coded frames back to back, padded with zeros to a
+*   whole block at the end. Without, it is one header block and then whole slabs: a small
+*   header and the frames packed after it, a frame being its step and boid count, then every
+*   x, every y and every z. Either way every write is whole RECORDER_BLOCKs, so on Linux the
+*   file is written with O_DIRECT, around the page cache, and normally where the file
+*   system refuses that.
+*
+*   A slab holds at least one frame of the flock recording starts with. A flock grown past
+*   that later has its frames dropped.
+*
+*   Builds without pthreads (MSVC, web) write each slab as it fills, on the stepping thread.
+*
+********************************************************************************************/
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "flock.h"
+#include "thread_pool.h"
+#include "trajectory_codec.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define RECORDER_MAGIC "BOIDTRJ"        // Eight bytes with the terminator
+#define RECORDER_VERSION 2
+#define RECORDER_BLOCK 4096             // Alignment of every write, enough for O_DIRECT
+#define RECORDER_DEFAULT_SLAB_BYTES (4 << 20)
+#define RECORDER_DEFAULT_SLABS 8
+
+// The first block of a file, the rest of the block is zero
+typedef struct RecorderFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;        // sizeof(RecorderFileHeader) of the writer
+    uint64_t slabBytes;         // Every slab, a multiple of RECORDER_BLOCK
+    float stepTime;             // Seconds per step
+    float boundsX;
+    float boundsY;
+    float boundsZ;
+    uint32_t quantBits;         // Bits of the coded positions, 0 for float slabs
+    uint32_t keyframeInterval;
+} RecorderFileHeader;
+
+typedef struct RecorderSlabHeader {
+    uint64_t sequence;          // Slabs written before it
+    uint32_t usedBytes;         // Header and frames, the rest of the slab is zero
+    uint32_t frames;
+} RecorderSlabHeader;
+
+typedef struct RecorderFrameHeader {
+    int32_t step;
+    int32_t count;              // Followed by count x, count y and count z
+} RecorderFrameHeader;
+
+// Counters are updated as the recording runs and can be read from any thread
+typedef struct RecorderStats {
+    long long framesRecorded;   // Copied into a slab
+    long long framesDropped;    // Found every slab queued, or too big for one
+    long long bytesRecorded;    // Positions copied, as floats
+    long long slabsWritten;
+    long long bytesWritten;
+    long long writeErrors;      // Writes the file took only part of, or frames that could not be coded
+    long long queueHighWater;   // Most slabs queued at once, slabCount means the next frame would have been dropped
+    double writeTime;           // Seconds the writer spent writing
+    double encodeTime;          // Seconds the writer spent coding
+} RecorderStats;
+
+typedef struct Recorder {
+    bool recording;
+    bool direct;                // Written around the page cache
+#if defined(_WIN32)
+    FILE *file;
+#else
+    int descriptor;
+#endif
+    size_t slabBytes;
+    int slabCount;
+    void *allocation;           // Header block and slabs, slabs points into it aligned
+    unsigned char *header;
+    unsigned char *slabs;
+    unsigned char *encoded;     // Coded frames not written yet, only the writer touches it
+    size_t encodedCapacity;
+    size_t encodedUsed;
+    TrajectoryCodec codec;      // quantBits 0 when not coding
+    unsigned int queued;        // Slabs handed to the writer, only the stepping thread moves it
+    unsigned int written;       // Slabs written, only the writer moves it
+    size_t slabUsed;            // Bytes of the slab being filled, 0 when there is none
+    uint32_t slabFrames;
+    RecorderStats stats;
+    bool stopping;
+    bool threaded;
+#if defined(THREAD_POOL_PTHREADS)
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+#endif
+} Recorder;
+
+// Reads a recording back a frame at a time
+typedef struct RecordingReader {
+    FILE *file;
+    RecorderFileHeader header;
+    unsigned char *slab;        // The slab being read, or the coded bytes read ahead
+    size_t capacity;            // Of slab
+    size_t offset;              // Of the next frame in it
+    size_t end;                 // Coded bytes read ahead end here
+    uint32_t frame;             // Frames of the slab read so far
+    TrajectoryCodec codec;
+} RecordingReader;
+
+bool StartRecorder(Recorder *recorder, const char *path, const Flock *flock, float stepTime, size_t slabBytes, int slabCount,
+                   int quantBits, int keyframeInterval);
+void RecordFlockFrame(Recorder *recorder, const Flock *flock);
+void StopRecorder(Recorder *recorder);
+RecorderStats GetRecorderStats(const Recorder *recorder);
+
+bool OpenRecording(RecordingReader *reader, const char *path);
+const float *ReadRecordedFrame(RecordingReader *reader, int *step, int *count);
+void CloseRecording(RecordingReader *reader);
+
+#endif // RECORDER_H
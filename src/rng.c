@@ -0,0 +1,26 @@
+/*******************************************************************************************
+*
+*   rng - Seeded random numbers, the same sequence on every platform and build
+*
+********************************************************************************************/
+
+#include "rng.h"
+
+void SeedRng(Rng *rng, uint64_t seed) {
+    rng->state = seed;
+}
+
+uint64_t NextRng(Rng *rng) {
+    uint64_t z = (rng->state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform over [min, max], both included like GetRandomValue()
+int NextRngInt(Rng *rng, int min, int max) {
+    if (max <= min) return min;
+
+    uint64_t range = (uint64_t)((int64_t)max - min) + 1;
+    return (int)((int64_t)min + (int64_t)(NextRng(rng)%range));
+}
@@ -0,0 +1,25 @@
+/*******************************************************************************************
+*
+*   rng - Seeded random numbers, the same sequence on every platform and build
+*
+*   SplitMix64: the state is one 64 bit counter stepped by a constant, every output is the
+*   counter scrambled. Seeding is just setting the counter, and the state can be saved and
+*   restored as a plain integer. raylib's GetRandomValue() depends on the C library and
+*   the raylib version, so starting states drawn from it never repeat between builds.
+*
+********************************************************************************************/
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+typedef struct Rng {
+    uint64_t state;
+} Rng;
+
+void SeedRng(Rng *rng, uint64_t seed);
+uint64_t NextRng(Rng *rng);
+int NextRngInt(Rng *rng, int min, int max);
+
+#endif // RNG_H
@@ -0,0 +1,224 @@
+/*******************************************************************************************
+*
+*   simulation - Fixed rate flock stepping, on its own thread, published as snapshots
+*
+********************************************************************************************/
+
+#include "simulation.h"
+#include "trace.h"
+
+#include <math.h>
+#include <string.h>
+#if defined(THREAD_POOL_PTHREADS)
+    #include <time.h>
+#endif
+
+// Without threads there is no other side to order against, plain accesses do
+static int ExchangeInt(int *value, int newValue) {
+#if defined(THREAD_POOL_PTHREADS)
+    return __atomic_exchange_n(value, newValue, __ATOMIC_ACQ_REL);
+#else
+    int old = *value;
+    *value = newValue;
+    return old;
+#endif
+}
+
+static int LoadInt(const int *value) {
+#if defined(THREAD_POOL_PTHREADS)
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#else
+    return *value;
+#endif
+}
+
+void InitTripleBuffer(TripleBuffer *buffer) {
+    buffer->writeSlot = 0;
+    buffer->sharedSlot = 1;
+    buffer->readSlot = 2;
+}
+
+// Hands the filled write slot over and takes whichever slot was waiting as the next one to fill
+void PublishTripleBuffer(TripleBuffer *buffer) {
+    buffer->writeSlot = ExchangeInt(&buffer->sharedSlot, buffer->writeSlot | TRIPLE_BUFFER_FRESH) & ~TRIPLE_BUFFER_FRESH;
+}
+
+// Takes the waiting slot as the read slot if it is newer than the one held, true when it was
+bool AcquireTripleBuffer(TripleBuffer *buffer) {
+    if (!(LoadInt(&buffer->sharedSlot) & TRIPLE_BUFFER_FRESH)) return false;
+
+    buffer->readSlot = ExchangeInt(&buffer->sharedSlot, buffer->readSlot) & ~TRIPLE_BUFFER_FRESH;
+    return true;
+}
+
+// Makes room for count boids, rounded to whole cache lines so every array stays aligned. Comes
+// from the flock's arena, only ever touched by the thread stepping the flock.
+static void ReserveSnapshot(Arena *arena, FlockSnapshot *snapshot, int count) {
+    if (count <= snapshot->capacity) return;
+
+    int stride = (count + ARENA_ALIGNMENT/(int)sizeof(float) - 1) & ~(ARENA_ALIGNMENT/(int)sizeof(float) - 1);
+    ArenaFree(arena, snapshot->positionX, 9*(size_t)snapshot->capacity*sizeof(float), ARENA_TAG_SNAPSHOTS);
+    snapshot->positionX = (float *)ArenaAlloc(arena, 9*(size_t)stride*sizeof(float), ARENA_TAG_SNAPSHOTS);
+    snapshot->positionY = snapshot->positionX + stride;
+    snapshot->positionZ = snapshot->positionY + stride;
+    snapshot->previousPositionX = snapshot->positionZ + stride;
+    snapshot->previousPositionY = snapshot->previousPositionX + stride;
+    snapshot->previousPositionZ = snapshot->previousPositionY + stride;
+    snapshot->velocityX = snapshot->previousPositionZ + stride;
+    snapshot->velocityY = snapshot->velocityX + stride;
+    snapshot->velocityZ = snapshot->velocityY + stride;
+    snapshot->capacity = stride;
+}
+
+// Copies the flock by id into the write slot and publishes it
+static void PublishSnapshot(Simulation *simulation) {
+    Flock *flock = simulation->flock;
+    FlockSnapshot *snapshot = &simulation->snapshots[simulation->buffer.writeSlot];
+
+    ReserveSnapshot(&flock->arena, snapshot, flock->count);
+    snapshot->count = flock->count;
+    snapshot->step = flock->stepCounter;
+    snapshot->time = simulation->nextStepTime - simulation->stepTime;
+    memcpy(snapshot->phaseTimes, flock->phaseTimes, sizeof(snapshot->phaseTimes));
+    for (int id = 0; id < flock->count; id++) {
+        int i = flock->slots[id];
+        snapshot->positionX[id] = flock->positionX[i];
+        snapshot->positionY[id] = flock->positionY[i];
+        snapshot->positionZ[id] = flock->positionZ[i];
+        InterpolateBoidPosition(flock, i, 0.0f, &snapshot->previousPositionX[id], &snapshot->previousPositionY[id], &snapshot->previousPositionZ[id]);
+        snapshot->velocityX[id] = flock->velocityX[i];
+        snapshot->velocityY[id] = flock->velocityY[i];
+        snapshot->velocityZ[id] = flock->velocityZ[i];
+    }
+
+    PublishTripleBuffer(&simulation->buffer);
+}
+
+// Applies a pending resize and runs the steps due by now, at most maxCatchUpSteps, then
+// publishes the result
+static void RunDueSteps(Simulation *simulation, double now) {
+    int steps = 0;
+    int requestedCount = ExchangeInt(&simulation->requestedCount, 0);
+
+    if (requestedCount > 0) ResizeFlock(simulation->flock, requestedCount);
+
+    while ((now >= simulation->nextStepTime) && (steps < simulation->maxCatchUpSteps)) {
+        UpdateFlock(simulation->flock, simulation->stepTime);
+        simulation->nextStepTime += simulation->stepTime;
+        steps++;
+    }
+
+    // Too far behind to catch up, drop the backlog and run slow instead
+    if (now >= simulation->nextStepTime) {
+        simulation->nextStepTime += simulation->stepTime*(floor((now - simulation->nextStepTime)/simulation->stepTime) + 1.0);
+    }
+
+    if ((steps > 0) || (requestedCount > 0)) {
+        TraceBegin("publish");
+        PublishSnapshot(simulation);
+        TraceEnd("publish");
+    }
+}
+
+#if defined(THREAD_POOL_PTHREADS)
+
+static void SleepSeconds(double seconds) {
+    struct timespec duration = { (time_t)seconds, (long)(1e9*(seconds - floor(seconds))) };
+    nanosleep(&duration, NULL);
+}
+
+static void *RunSimulationThread(void *argument) {
+    Simulation *simulation = (Simulation *)argument;
+
+    NameTraceThread("simulation");
+    while (__atomic_load_n(&simulation->running, __ATOMIC_ACQUIRE)) {
+        RunDueSteps(simulation, GetWallTime());
+
+        // Short sleeps, so stopping never waits long at low rates
+        double wait = simulation->nextStepTime - GetWallTime();
+        if (wait > 0.0) SleepSeconds((wait < 0.01)? wait : 0.01);
+    }
+
+    return NULL;
+}
+
+#endif // THREAD_POOL_PTHREADS
+
+// Publishes the flock as it is and starts stepping it at hz. While threaded, nothing but the
+// simulation thread may touch the flock until StopSimulation(). All three snapshots are sized
+// up front, so the footprint shows them from the start.
+void StartSimulation(Simulation *simulation, Flock *flock, float hz, int maxCatchUpSteps, bool threaded) {
+    *simulation = (Simulation){ 0 };
+    simulation->flock = flock;
+    simulation->stepTime = 1.0f/hz;
+    simulation->maxCatchUpSteps = (maxCatchUpSteps > 1)? maxCatchUpSteps : 1;
+    simulation->snapshots = (FlockSnapshot *)ArenaAlloc(&flock->arena, 3*sizeof(FlockSnapshot), ARENA_TAG_SNAPSHOTS);
+    for (int s = 0; s < 3; s++) ReserveSnapshot(&flock->arena, &simulation->snapshots[s], flock->count);
+    InitTripleBuffer(&simulation->buffer);
+
+    simulation->nextStepTime = GetWallTime() + simulation->stepTime;
+    PublishSnapshot(simulation);
+
+#if defined(THREAD_POOL_PTHREADS)
+    if (threaded) {
+        simulation->running = true;
+        if (pthread_create(&simulation->thread, NULL, RunSimulationThread, simulation) != 0) simulation->running = false;
+    }
+#endif
+    simulation->threaded = simulation->running;
+}
+
+// Joins the simulation thread, the flock is the caller's again. Steps still due from here on
+// run from UpdateSimulation().
+void StopSimulation(Simulation *simulation) {
+#if defined(THREAD_POOL_PTHREADS)
+    if (simulation->threaded) {
+        __atomic_store_n(&simulation->running, false, __ATOMIC_RELEASE);
+        pthread_join(simulation->thread, NULL);
+    }
+#endif
+    simulation->threaded = false;
+}
+
+// Stops the simulation and gives the snapshots back to the flock's arena, before the flock
+// itself is unloaded
+void UnloadSimulation(Simulation *simulation) {
+    StopSimulation(simulation);
+
+    Arena *arena = &simulation->flock->arena;
+    for (int s = 2; s >= 0; s--) {
+        ArenaFree(arena, simulation->snapshots[s].positionX, 9*(size_t)simulation->snapshots[s].capacity*sizeof(float), ARENA_TAG_SNAPSHOTS);
+    }
+    ArenaFree(arena, simulation->snapshots, 3*sizeof(FlockSnapshot), ARENA_TAG_SNAPSHOTS);
+    *simulation = (Simulation){ 0 };
+}
+
+// Runs the steps due from the render loop, when there is no simulation thread
+void UpdateSimulation(Simulation *simulation) {
+    if (!simulation->threaded) RunDueSteps(simulation, GetWallTime());
+}
+
+// Changes the population before the next step, on whichever thread runs it. Boids are added
+// and removed by ResizeFlock().
+void ResizeSimulation(Simulation *simulation, int count) {
+    ExchangeInt(&simulation->requestedCount, (count > 1)? count : 1);
+}
+
+// The newest snapshot published, it stays untouched until the next call
+const FlockSnapshot *GetLatestSnapshot(Simulation *simulation) {
+    AcquireTripleBuffer(&simulation->buffer);
+    return &simulation->snapshots[simulation->buffer.readSlot];
+}
+
+// How far to blend from the snapshot's previous positions to its current ones right now.
+// Drawing runs one step behind the simulation, so there are always two states to blend.
+float GetSnapshotAlpha(const Simulation *simulation, const FlockSnapshot *snapshot) {
+    float alpha = (float)((GetWallTime() - snapshot->time)/simulation->stepTime);
+    return (alpha < 0.0f)? 0.0f : (alpha > 1.0f)? 1.0f : alpha;
+}
+
+void InterpolateSnapshotPosition(const FlockSnapshot *snapshot, int id, float alpha, float *x, float *y, float *z) {
+    *x = snapshot->previousPositionX[id] + (snapshot->positionX[id] - snapshot->previousPositionX[id])*alpha;
+    *y = snapshot->previousPositionY[id] + (snapshot->positionY[id] - snapshot->previousPositionY[id])*alpha;
+    *z = snapshot->previousPositionZ[id] + (snapshot->positionZ[id] - snapshot->previousPositionZ[id])*alpha;
+}
@@ -0,0 +1,83 @@
+/*******************************************************************************************
+*
+*   simulation - Fixed rate flock stepping, on its own thread, published as snapshots
+*
+*   Steps fall due every stepTime seconds of wall time. Threaded, a simulation thread runs
+*   them as they fall due and sleeps in between, so drawing frame N overlaps computing the
+*   steps after it. Otherwise UpdateSimulation() runs the due steps from the render loop.
+*
+*   Either way the renderer never reads the flock. After every batch of steps the state is
+*   copied into an immutable snapshot and handed over through a lock-free triple buffer:
+*   the simulation fills a back slot and swaps it with the shared middle slot, the renderer
+*   swaps the middle slot for its front slot whenever a fresh one is waiting. Neither side
+*   ever waits for the other, the renderer just keeps the newest snapshot it has.
+*
+*   Builds without pthreads (MSVC, web) always step from the render loop.
+*
+********************************************************************************************/
+
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include "flock.h"
+#include "thread_pool.h"
+
+#include <stdbool.h>
+
+// The flock after a step, by id so it does not depend on how the slots are sorted
+typedef struct FlockSnapshot {
+    int count;
+    int capacity;               // Grown by the writer while it owns the slot
+    int step;                   // Steps run before the snapshot was taken
+    double time;                // Wall time the step was due
+    double phaseTimes[FLOCK_PHASE_COUNT];   // Seconds each phase of the step took
+    float *positionX;           // All nine arrays share one allocation
+    float *positionY;
+    float *positionZ;
+    float *previousPositionX;   // One step earlier, to interpolate from
+    float *previousPositionY;
+    float *previousPositionZ;
+    float *velocityX;
+    float *velocityY;
+    float *velocityZ;
+} FlockSnapshot;
+
+// Slot indexes of a triple buffer, the slots themselves live with the user
+typedef struct TripleBuffer {
+    int writeSlot;              // Owned by the writer
+    int readSlot;               // Owned by the reader
+    int sharedSlot;             // Waiting in the middle, TRIPLE_BUFFER_FRESH set until the reader takes it
+} TripleBuffer;
+
+#define TRIPLE_BUFFER_FRESH 4
+
+typedef struct Simulation {
+    Flock *flock;
+    float stepTime;             // Seconds per step
+    int maxCatchUpSteps;        // Most steps run at once, past it the backlog is dropped
+    double nextStepTime;        // Wall time the next step falls due
+    bool threaded;
+    bool running;
+    int requestedCount;         // Population to resize to before the next step, 0 for none
+    TripleBuffer buffer;
+    FlockSnapshot *snapshots;   // Three slots
+#if defined(THREAD_POOL_PTHREADS)
+    pthread_t thread;
+#endif
+} Simulation;
+
+void InitTripleBuffer(TripleBuffer *buffer);
+void PublishTripleBuffer(TripleBuffer *buffer);
+bool AcquireTripleBuffer(TripleBuffer *buffer);
+
+void StartSimulation(Simulation *simulation, Flock *flock, float hz, int maxCatchUpSteps, bool threaded);
+void StopSimulation(Simulation *simulation);
+void UnloadSimulation(Simulation *simulation);
+void UpdateSimulation(Simulation *simulation);
+void ResizeSimulation(Simulation *simulation, int count);
+
+const FlockSnapshot *GetLatestSnapshot(Simulation *simulation);
+float GetSnapshotAlpha(const Simulation *simulation, const FlockSnapshot *snapshot);
+void InterpolateSnapshotPosition(const FlockSnapshot *snapshot, int id, float alpha, float *x, float *y, float *z);
+
+#endif // SIMULATION_H
@@ -0,0 +1,346 @@
+/*******************************************************************************************
+*
+*   spatial_grid - Uniform grid for fixed-radius neighbour queries
+*
+********************************************************************************************/
+
+#include "spatial_grid.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+// Cells covering [-bounds, bounds] plus one border cell on every side
+static SpatialGrid GridLayout(float boundsX, float boundsY, float boundsZ, float cellSize) {
+    SpatialGrid grid = { 0 };
+
+    grid.cellSize = cellSize;
+    grid.dimX = (int)ceilf(2.0f*boundsX/cellSize) + 2;
+    grid.dimY = (int)ceilf(2.0f*boundsY/cellSize) + 2;
+    grid.dimZ = (int)ceilf(2.0f*boundsZ/cellSize) + 2;
+    grid.minX = -boundsX - cellSize;
+    grid.minY = -boundsY - cellSize;
+    grid.minZ = -boundsZ - cellSize;
+    grid.cellCount = grid.dimX*grid.dimY*grid.dimZ;
+
+    return grid;
+}
+
+SpatialGrid LoadSpatialGrid(float boundsX, float boundsY, float boundsZ, float cellSize, int capacity, Arena *arena) {
+    SpatialGrid grid = GridLayout(boundsX, boundsY, boundsZ, cellSize);
+
+    grid.capacity = capacity;
+    grid.arena = arena;
+
+    grid.cellStart = (int *)ArenaAlloc(arena, (grid.cellCount + 1)*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    grid.cellIndexes = (int *)ArenaAlloc(arena, capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    grid.pointCells = (int *)ArenaAlloc(arena, capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+
+    return grid;
+}
+
+// Last allocated first, so an arena gets the bytes back when nothing came after them
+void UnloadSpatialGrid(SpatialGrid *grid) {
+    ArenaFree(grid->arena, grid->pointCells, grid->capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    ArenaFree(grid->arena, grid->cellIndexes, grid->capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    ArenaFree(grid->arena, grid->cellStart, (grid->cellCount + 1)*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    *grid = (SpatialGrid){ 0 };
+}
+
+static int ClampCell(int value, int dim) {
+    if (value < 0) return 0;
+    if (value >= dim) return dim - 1;
+    return value;
+}
+
+int SpatialGridCellIndex(const SpatialGrid *grid, float x, float y, float z) {
+    int cx = ClampCell((int)floorf((x - grid->minX)/grid->cellSize), grid->dimX);
+    int cy = ClampCell((int)floorf((y - grid->minY)/grid->cellSize), grid->dimY);
+    int cz = ClampCell((int)floorf((z - grid->minZ)/grid->cellSize), grid->dimZ);
+
+    return (cz*grid->dimY + cy)*grid->dimX + cx;
+}
+
+void SpatialGridInsert(SpatialGrid *grid, int index, float x, float y, float z) {
+    grid->pointCells[index] = SpatialGridCellIndex(grid, x, y, z);
+}
+
+// Counting sort of the inserted points by cell. Points are scattered in the
+// order given (index order when NULL), which is the order they keep in a cell.
+void SpatialGridBuild(SpatialGrid *grid, int count, const int *order) {
+    int *cellStart = grid->cellStart;
+
+    for (int c = 0; c <= grid->cellCount; c++) cellStart[c] = 0;
+    for (int i = 0; i < count; i++) cellStart[grid->pointCells[i] + 1]++;
+    for (int c = 0; c < grid->cellCount; c++) cellStart[c + 1] += cellStart[c];
+
+    // Scatter using cellStart as a running cursor, then shift it back into place
+    for (int k = 0; k < count; k++) {
+        int i = (order != NULL)? order[k] : k;
+        int cell = grid->pointCells[i];
+        grid->cellIndexes[cellStart[cell]] = i;
+        cellStart[cell]++;
+    }
+    for (int c = grid->cellCount; c > 0; c--) cellStart[c] = cellStart[c - 1];
+    cellStart[0] = 0;
+}
+
+// Writes the cell itself and every existing cell around it, returns how many
+int SpatialGridNeighbourCells(const SpatialGrid *grid, int cell, int *cells) {
+    int cx = cell%grid->dimX;
+    int cy = (cell/grid->dimX)%grid->dimY;
+    int cz = cell/(grid->dimX*grid->dimY);
+    int count = 0;
+
+    for (int z = cz - 1; z <= cz + 1; z++) {
+        if ((z < 0) || (z >= grid->dimZ)) continue;
+        for (int y = cy - 1; y <= cy + 1; y++) {
+            if ((y < 0) || (y >= grid->dimY)) continue;
+            for (int x = cx - 1; x <= cx + 1; x++) {
+                if ((x < 0) || (x >= grid->dimX)) continue;
+                cells[count] = (z*grid->dimY + y)*grid->dimX + x;
+                count++;
+            }
+        }
+    }
+
+    return count;
+}
+
+DynamicSpatialGrid LoadDynamicSpatialGrid(float boundsX, float boundsY, float boundsZ, float cellSize, int capacity, Arena *arena) {
+    DynamicSpatialGrid grid = { 0 };
+
+    grid.layout = GridLayout(boundsX, boundsY, boundsZ, cellSize);
+    grid.capacity = capacity;
+    grid.arena = arena;
+    grid.indexCapacity = 2*capacity + 16;
+    int cellCount = grid.layout.cellCount;
+    grid.cellStart = (int *)ArenaAlloc(arena, cellCount*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    grid.cellCounts = (int *)ArenaAlloc(arena, cellCount*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    grid.cellCapacities = (int *)ArenaAlloc(arena, cellCount*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    grid.cellIndexes = (int *)ArenaAlloc(arena, grid.indexCapacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    grid.pointCells = (int *)ArenaAlloc(arena, capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    grid.pointSlots = (int *)ArenaAlloc(arena, capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    grid.unsortedCells = (int *)ArenaAlloc(arena, cellCount*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    grid.cellUnsorted = (unsigned char *)ArenaAlloc(arena, cellCount, ARENA_TAG_NEIGHBOUR_SEARCH);
+    DynamicSpatialGridClear(&grid);
+
+    return grid;
+}
+
+void UnloadDynamicSpatialGrid(DynamicSpatialGrid *grid) {
+    Arena *arena = grid->arena;
+    int cellCount = grid->layout.cellCount;
+
+    ArenaFree(arena, grid->cellUnsorted, cellCount, ARENA_TAG_NEIGHBOUR_SEARCH);
+    ArenaFree(arena, grid->unsortedCells, cellCount*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    ArenaFree(arena, grid->pointSlots, grid->capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    ArenaFree(arena, grid->pointCells, grid->capacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    ArenaFree(arena, grid->cellIndexes, grid->indexCapacity*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    ArenaFree(arena, grid->cellCapacities, cellCount*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    ArenaFree(arena, grid->cellCounts, cellCount*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    ArenaFree(arena, grid->cellStart, cellCount*sizeof(int), ARENA_TAG_NEIGHBOUR_SEARCH);
+    *grid = (DynamicSpatialGrid){ 0 };
+}
+
+static void MarkCellUnsorted(DynamicSpatialGrid *grid, int cell) {
+    if (grid->cellUnsorted[cell]) return;
+    grid->cellUnsorted[cell] = 1;
+    grid->unsortedCells[grid->unsortedCount++] = cell;
+}
+
+// Copies the cell's points to a run of capacity entries from start, which does not overlap
+// the old run, and gives the old run up
+static void MoveCellRun(DynamicSpatialGrid *grid, int cell, int start, int capacity) {
+    int *from = grid->cellIndexes + grid->cellStart[cell];
+    int *to = grid->cellIndexes + start;
+
+    for (int n = 0; n < grid->cellCounts[cell]; n++) {
+        to[n] = from[n];
+        from[n] = -1;
+        grid->pointSlots[to[n]] = start + n;
+    }
+    grid->cellStart[cell] = start;
+    grid->cellCapacities[cell] = capacity;
+}
+
+// Lays every run out again in cell order, with a quarter of its points to spare and room
+// for one more point in growCell: at most 1.25 times the points and one entry, so it always
+// fits with a third of indexCapacity left for runs to move to. The points go back in index
+// order, which sorts every cell on the way.
+static void LayOutCells(DynamicSpatialGrid *grid, int growCell) {
+    int cellCount = grid->layout.cellCount;
+    int total = 0;
+
+    for (int c = 0; c < cellCount; c++) {
+        int count = grid->cellCounts[c] + (c == growCell);
+        grid->cellStart[c] = total;
+        grid->cellCapacities[c] = count + count/4;
+        grid->cellCounts[c] = 0;
+        total += grid->cellCapacities[c];
+    }
+    for (int k = 0; k < grid->indexCount; k++) grid->cellIndexes[k] = -1;
+    for (int i = 0; i < grid->capacity; i++) {
+        int cell = grid->pointCells[i];
+        if (cell < 0) continue;
+        int slot = grid->cellStart[cell] + grid->cellCounts[cell]++;
+        grid->cellIndexes[slot] = i;
+        grid->pointSlots[i] = slot;
+    }
+    for (int u = 0; u < grid->unsortedCount; u++) grid->cellUnsorted[grid->unsortedCells[u]] = 0;
+    grid->unsortedCount = 0;
+    grid->indexCount = total;
+    grid->layouts++;
+}
+
+// Appends the point, the cell stays in index order only when it is the largest index there.
+// A full run moves to the end with twice the room, or when there is none left every run is
+// laid out again.
+static void AppendToCell(DynamicSpatialGrid *grid, int cell, int index) {
+    if (grid->cellCounts[cell] == grid->cellCapacities[cell]) {
+        int capacity = (grid->cellCounts[cell] > 2)? 2*grid->cellCounts[cell] : 4;
+        if (grid->indexCount + capacity <= grid->indexCapacity) {
+            MoveCellRun(grid, cell, grid->indexCount, capacity);
+            grid->indexCount += capacity;
+        }
+        else LayOutCells(grid, cell);
+    }
+
+    int count = grid->cellCounts[cell]++;
+    int slot = grid->cellStart[cell] + count;
+    if ((count > 0) && (grid->cellIndexes[slot - 1] > index)) MarkCellUnsorted(grid, cell);
+    grid->cellIndexes[slot] = index;
+    grid->pointCells[index] = cell;
+    grid->pointSlots[index] = slot;
+}
+
+void DynamicSpatialGridInsert(DynamicSpatialGrid *grid, int index, float x, float y, float z) {
+    AppendToCell(grid, SpatialGridCellIndex(&grid->layout, x, y, z), index);
+}
+
+// The cell's last point takes the removed one's entry
+void DynamicSpatialGridRemove(DynamicSpatialGrid *grid, int index) {
+    int cell = grid->pointCells[index];
+    int slot = grid->pointSlots[index];
+    int last = grid->cellStart[cell] + --grid->cellCounts[cell];
+
+    if (slot < last) {
+        grid->cellIndexes[slot] = grid->cellIndexes[last];
+        grid->pointSlots[grid->cellIndexes[slot]] = slot;
+        MarkCellUnsorted(grid, cell);
+    }
+    grid->cellIndexes[last] = -1;
+    grid->pointCells[index] = -1;
+}
+
+// Only touches the cells when the point has crossed into another one
+void DynamicSpatialGridMove(DynamicSpatialGrid *grid, int index, float x, float y, float z) {
+    int cell = SpatialGridCellIndex(&grid->layout, x, y, z);
+    if (cell == grid->pointCells[index]) return;
+
+    DynamicSpatialGridRemove(grid, index);
+    AppendToCell(grid, cell, index);
+    grid->crossings++;
+}
+
+// Empties every cell and gives up their runs
+void DynamicSpatialGridClear(DynamicSpatialGrid *grid) {
+    for (int c = 0; c < grid->layout.cellCount; c++) {
+        grid->cellStart[c] = 0;
+        grid->cellCounts[c] = 0;
+        grid->cellCapacities[c] = 0;
+        grid->cellUnsorted[c] = 0;
+    }
+    for (int k = 0; k < grid->indexCapacity; k++) grid->cellIndexes[k] = -1;
+    for (int i = 0; i < grid->capacity; i++) grid->pointCells[i] = -1;
+    grid->indexCount = 0;
+    grid->unsortedCount = 0;
+    grid->crossings = 0;
+}
+
+// Insertion sorts the cells moves left out of index order, and no others. A cell is only a
+// few swaps and appends away from sorted, so the cost is about its occupancy.
+void DynamicSpatialGridSortCells(DynamicSpatialGrid *grid) {
+    for (int u = 0; u < grid->unsortedCount; u++) {
+        int cell = grid->unsortedCells[u];
+        int *points = grid->cellIndexes + grid->cellStart[cell];
+
+        for (int n = 1; n < grid->cellCounts[cell]; n++) {
+            int index = points[n];
+            int slot = n;
+            while ((slot > 0) && (points[slot - 1] > index)) {
+                points[slot] = points[slot - 1];
+                grid->pointSlots[points[slot]] = grid->cellStart[cell] + slot;
+                slot--;
+            }
+            points[slot] = index;
+            grid->pointSlots[index] = grid->cellStart[cell] + slot;
+        }
+        grid->cellUnsorted[cell] = 0;
+    }
+    grid->unsortedCount = 0;
+}
+
+// Reads the occupancy counters of every cell, O(cells)
+DynamicSpatialGridStats GetDynamicSpatialGridStats(const DynamicSpatialGrid *grid) {
+    DynamicSpatialGridStats stats = { 0 };
+
+    for (int c = 0; c < grid->layout.cellCount; c++) {
+        int count = grid->cellCounts[c];
+        stats.points += count;
+        stats.occupiedCells += (count > 0);
+        if (count > stats.maxOccupancy) stats.maxOccupancy = count;
+    }
+    stats.meanOccupancy = (stats.occupiedCells > 0)? (float)stats.points/stats.occupiedCells : 0.0f;
+
+    return stats;
+}
+
+// Spreads the low 10 bits of value so there are two zero bits between each of them
+static unsigned int SpreadBits(unsigned int value) {
+    value &= 0x3ff;
+    value = (value | (value << 16)) & 0x030000ff;
+    value = (value | (value << 8)) & 0x0300f00f;
+    value = (value | (value << 4)) & 0x030c30c3;
+    value = (value | (value << 2)) & 0x09249249;
+    return value;
+}
+
+static unsigned int QuantiseAxis(float value, float min, float extent) {
+    float t = (value - min)/extent;
+    if (t < 0.0f) t = 0.0f;
+    if (t > 1.0f) t = 1.0f;
+    return (unsigned int)(t*1023.0f);
+}
+
+// 30-bit Z-order curve key of a position, 10 bits per axis over the grid extent
+unsigned int SpatialGridMortonCode(const SpatialGrid *grid, float x, float y, float z) {
+    unsigned int qx = QuantiseAxis(x, grid->minX, grid->dimX*grid->cellSize);
+    unsigned int qy = QuantiseAxis(y, grid->minY, grid->dimY*grid->cellSize);
+    unsigned int qz = QuantiseAxis(z, grid->minZ, grid->dimZ*grid->cellSize);
+
+    return SpreadBits(qx) | (SpreadBits(qy) << 1) | (SpreadBits(qz) << 2);
+}
+
+// Stable LSD radix sort of indexes by key, 8 bits per pass. Equal keys keep
+// their incoming order, so the result is deterministic.
+void SortIndexesByKey(unsigned int *keys, int *indexes, int count, unsigned int *keyScratch, int *indexScratch) {
+    if (count == 0) return;
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        int offsets[257] = { 0 };
+
+        for (int i = 0; i < count; i++) offsets[((keys[i] >> shift) & 0xff) + 1]++;
+        if (offsets[((keys[0] >> shift) & 0xff) + 1] == count) continue;    // Every key shares this digit
+        for (int d = 0; d < 256; d++) offsets[d + 1] += offsets[d];
+
+        for (int i = 0; i < count; i++) {
+            int slot = offsets[(keys[i] >> shift) & 0xff]++;
+            keyScratch[slot] = keys[i];
+            indexScratch[slot] = indexes[i];
+        }
+        for (int i = 0; i < count; i++) {
+            keys[i] = keyScratch[i];
+            indexes[i] = indexScratch[i];
+        }
+    }
+}
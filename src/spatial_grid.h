@@ -0,0 +1,94 @@
+/*******************************************************************************************
+*
+*   spatial_grid - Uniform grid for fixed-radius neighbour queries
+*
+*   Cells are as wide as the query radius, so every neighbour of a point lives in the
+*   3x3x3 block of cells around it. Points outside the grid are clamped to the border
+*   cells, which keeps queries correct for boids that stray past the world bounds.
+*
+*   SpatialGrid is rebuilt from scratch with a counting sort. DynamicSpatialGrid is kept up
+*   to date point by point instead. Every cell is a run of cellIndexes with room to spare,
+*   so like a SpatialGrid its points are one contiguous run, only with gaps between the
+*   runs. Moving a point to another cell swaps the old cell's last point into its place and
+*   appends it to the new cell, O(1) whatever the occupancy. A full run moves to the end of
+*   cellIndexes with twice the room, and once the end is reached every run is laid out
+*   afresh with a quarter to spare, which happens rarely enough to cost O(1) a move overall.
+*
+*   Swapping and appending leave the cells touched out of index order; they are listed,
+*   and DynamicSpatialGridSortCells() puts only those back in order for the searches that
+*   need it.
+*
+********************************************************************************************/
+
+#ifndef SPATIAL_GRID_H
+#define SPATIAL_GRID_H
+
+#include "arena.h"
+
+#define SPATIAL_GRID_MAX_NEIGHBOUR_CELLS 27
+
+typedef struct SpatialGrid {
+    float cellSize;
+    float minX;
+    float minY;
+    float minZ;
+    int dimX;
+    int dimY;
+    int dimZ;
+    int cellCount;
+    int capacity;
+    Arena *arena;           // Where the arrays live, NULL for the heap
+    int *cellStart;         // cellCount + 1 offsets into cellIndexes
+    int *cellIndexes;       // Point indexes ordered by cell, in build order within a cell
+    int *pointCells;        // Cell of every point, filled by SpatialGridInsert()
+} SpatialGrid;
+
+typedef struct DynamicSpatialGrid {
+    SpatialGrid layout;     // Cell geometry only, its point arrays are not allocated
+    int capacity;           // Points
+    Arena *arena;
+    int *cellStart;         // Entry of cellIndexes every cell's run starts at
+    int *cellCounts;        // Occupancy of every cell
+    int *cellCapacities;    // Entries in every cell's run
+    int *cellIndexes;       // Runs of point indexes, -1 where no point is
+    int indexCapacity;      // Entries of cellIndexes, twice the points and a little more
+    int indexCount;         // Entries up to the end of the last run
+    int *pointCells;        // Cell of every point, -1 when not inserted
+    int *pointSlots;        // Entry of every point in cellIndexes
+    int crossings;          // Points moved to another cell since the counter was last cleared
+    int layouts;            // Times every run was laid out afresh
+    int unsortedCount;
+    int *unsortedCells;     // Cells out of index order, each listed once
+    unsigned char *cellUnsorted;
+} DynamicSpatialGrid;
+
+// How full the cells of a DynamicSpatialGrid are, for diagnostics
+typedef struct DynamicSpatialGridStats {
+    int points;
+    int occupiedCells;
+    int maxOccupancy;       // Points in the fullest cell
+    float meanOccupancy;    // Points per occupied cell
+} DynamicSpatialGridStats;
+
+SpatialGrid LoadSpatialGrid(float boundsX, float boundsY, float boundsZ, float cellSize, int capacity, Arena *arena);
+void UnloadSpatialGrid(SpatialGrid *grid);
+
+int SpatialGridCellIndex(const SpatialGrid *grid, float x, float y, float z);
+void SpatialGridInsert(SpatialGrid *grid, int index, float x, float y, float z);
+void SpatialGridBuild(SpatialGrid *grid, int count, const int *order);
+int SpatialGridNeighbourCells(const SpatialGrid *grid, int cell, int *cells);
+
+DynamicSpatialGrid LoadDynamicSpatialGrid(float boundsX, float boundsY, float boundsZ, float cellSize, int capacity, Arena *arena);
+void UnloadDynamicSpatialGrid(DynamicSpatialGrid *grid);
+
+void DynamicSpatialGridInsert(DynamicSpatialGrid *grid, int index, float x, float y, float z);
+void DynamicSpatialGridRemove(DynamicSpatialGrid *grid, int index);
+void DynamicSpatialGridMove(DynamicSpatialGrid *grid, int index, float x, float y, float z);
+void DynamicSpatialGridClear(DynamicSpatialGrid *grid);
+void DynamicSpatialGridSortCells(DynamicSpatialGrid *grid);
+DynamicSpatialGridStats GetDynamicSpatialGridStats(const DynamicSpatialGrid *grid);
+
+unsigned int SpatialGridMortonCode(const SpatialGrid *grid, float x, float y, float z);
+void SortIndexesByKey(unsigned int *keys, int *indexes, int count, unsigned int *keyScratch, int *indexScratch);
+
+#endif // SPATIAL_GRID_H
@@ -0,0 +1,341 @@
+/*******************************************************************************************
+*
+*   thread_pool - Persistent worker threads that split a range of items into chunks
+*
+********************************************************************************************/
+
+#include "thread_pool.h"
+#include "trace.h"
+
+#include <stdio.h>
+
+#if defined(_WIN32)
+    #include <windows.h>
+#else
+    #include <unistd.h>
+    #include <time.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define SPIN_PAUSE() _mm_pause()
+#else
+    #define SPIN_PAUSE()
+#endif
+
+#define THREAD_POOL_SPIN_COUNT 500      // Polls before a waiting thread sleeps, some tens of microseconds
+
+int GetCpuCount(void) {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0)? (int)count : 1;
+#endif
+}
+
+// Monotonic clock in seconds, for timing work on the pool without a window open
+double GetWallTime(void) {
+#if defined(_WIN32)
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart/(double)frequency.QuadPart;
+#else
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + 1e-9*(double)time.tv_nsec;
+#endif
+}
+
+const char *GetThreadPoolScheduleName(ThreadPoolSchedule schedule) {
+    switch (schedule) {
+        case THREAD_POOL_WORK_STEALING: return "work stealing";
+        case THREAD_POOL_STATIC: return "static";
+        default: return "unknown";
+    }
+}
+
+// Chunk boundaries spread the remainder, so chunks differ by at most one item
+static void RunChunk(ThreadPool *pool, int thread) {
+    long long itemCount = pool->itemCount;
+    int start = (int)(itemCount*thread/pool->threadCount);
+    int end = (int)(itemCount*(thread + 1)/pool->threadCount);
+
+    // More threads than items leave some chunks empty, they are not tasks
+    if (start < end) {
+        TraceBegin("task");
+        pool->task(pool->context, start, end, thread);
+        TraceEnd("task");
+        pool->workers[thread].stats.tasks++;
+    }
+}
+
+static int GetTaskCount(const ThreadPool *pool) {
+    return (pool->itemCount + pool->grain - 1)/pool->grain;
+}
+
+// Traced by the caller, a span per grain would flood the trace on a large flock
+static void RunTask(ThreadPool *pool, int task, int thread) {
+    int start = task*pool->grain;
+    int end = (pool->itemCount - start > pool->grain)? start + pool->grain : pool->itemCount;
+
+    pool->task(pool->context, start, end, thread);
+    pool->workers[thread].stats.tasks++;
+}
+
+#if defined(THREAD_POOL_PTHREADS)
+
+static unsigned long long PackTaskRange(unsigned int begin, unsigned int end) {
+    return ((unsigned long long)end << 32) | begin;
+}
+
+// Takes the first task of the thread's own deque
+static bool PopTask(ThreadPoolWorker *worker, int *task) {
+    unsigned long long range = __atomic_load_n(&worker->deque, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        unsigned int begin = (unsigned int)range;
+        unsigned int end = (unsigned int)(range >> 32);
+        if (begin >= end) return false;
+
+        if (__atomic_compare_exchange_n(&worker->deque, &range, PackTaskRange(begin + 1, end), true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *task = (int)begin;
+            return true;
+        }
+    }
+}
+
+// Takes the back half of another thread's deque, rounded up so a last task can go too.
+// A range only ever describes the tasks it holds, so a compare and swap that succeeds on a
+// value seen earlier is still right.
+static bool StealTasks(ThreadPoolWorker *victim, unsigned int *stolenBegin, unsigned int *stolenEnd) {
+    unsigned long long range = __atomic_load_n(&victim->deque, __ATOMIC_ACQUIRE);
+
+    for (;;) {
+        unsigned int begin = (unsigned int)range;
+        unsigned int end = (unsigned int)(range >> 32);
+        if (begin >= end) return false;
+
+        unsigned int split = end - (end - begin + 1)/2;
+        if (__atomic_compare_exchange_n(&victim->deque, &range, PackTaskRange(begin, split), true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *stolenBegin = split;
+            *stolenEnd = end;
+            return true;
+        }
+    }
+}
+
+// Works through the thread's own deque, then refills it by stealing until every deque is
+// empty. Tasks are only ever moved between deques, so a thread that finds nothing to steal
+// can stop: whatever is still queued has a thread working through it. The tasks dealt and
+// every range stolen are traced as one span each.
+static void RunTasks(ThreadPool *pool, int thread) {
+    ThreadPoolWorker *worker = &pool->workers[thread];
+    const char *spanName = "task";
+    int task = 0;
+
+    for (;;) {
+        if (PopTask(worker, &task)) {
+            TraceBegin(spanName);
+            do {
+                RunTask(pool, task, thread);
+            } while (PopTask(worker, &task));
+            TraceEnd(spanName);
+        }
+        spanName = "stolen";
+
+        bool stolen = false;
+        for (int v = 1; (v < pool->threadCount) && !stolen; v++) {
+            unsigned int begin = 0;
+            unsigned int end = 0;
+            if (StealTasks(&pool->workers[(thread + v)%pool->threadCount], &begin, &end)) {
+                // Thieves leave an empty deque alone, so a plain store is enough
+                __atomic_store_n(&worker->deque, PackTaskRange(begin, end), __ATOMIC_RELEASE);
+                worker->stats.steals++;
+                stolen = true;
+            }
+        }
+        if (!stolen) return;
+    }
+}
+
+// Deals every thread a contiguous run of tasks, before the job is published
+static void DealTasks(ThreadPool *pool) {
+    long long taskCount = GetTaskCount(pool);
+
+    for (int t = 0; t < pool->threadCount; t++) {
+        unsigned int begin = (unsigned int)(taskCount*t/pool->threadCount);
+        unsigned int end = (unsigned int)(taskCount*(t + 1)/pool->threadCount);
+        __atomic_store_n(&pool->workers[t].deque, PackTaskRange(begin, end), __ATOMIC_RELAXED);
+    }
+}
+
+#else
+
+static void RunTasks(ThreadPool *pool, int thread) {
+    TraceBegin("task");
+    for (int task = 0; task < GetTaskCount(pool); task++) RunTask(pool, task, thread);
+    TraceEnd("task");
+}
+
+#endif // THREAD_POOL_PTHREADS
+
+// The thread's part of the current job, timed
+static void RunShare(ThreadPool *pool, int thread) {
+    double start = GetWallTime();
+
+    if (pool->schedule == THREAD_POOL_WORK_STEALING) RunTasks(pool, thread);
+    else RunChunk(pool, thread);
+    pool->workers[thread].jobBusyTime = GetWallTime() - start;
+}
+
+// Once every thread is done: the job's time on each thread is busy or idle
+static void AddJobStats(ThreadPool *pool) {
+    double jobTime = GetWallTime() - pool->jobStartTime;
+
+    for (int t = 0; t < pool->threadCount; t++) {
+        ThreadPoolWorker *worker = &pool->workers[t];
+        worker->stats.busyTime += worker->jobBusyTime;
+        worker->stats.idleTime += (jobTime > worker->jobBusyTime)? jobTime - worker->jobBusyTime : 0.0;
+    }
+}
+
+void ResetThreadPoolStats(ThreadPool *pool) {
+    for (int t = 0; t < pool->threadCount; t++) pool->workers[t].stats = (ThreadPoolStats){ 0 };
+}
+
+#if defined(THREAD_POOL_PTHREADS)
+
+static void *RunWorker(void *argument) {
+    ThreadPool *pool = ((ThreadPoolWorker *)argument)->pool;
+    int thread = ((ThreadPoolWorker *)argument)->thread;
+    unsigned int seen = 0;
+    char name[32] = { 0 };
+
+    snprintf(name, sizeof(name), "worker %d", thread);
+    NameTraceThread(name);
+
+    for (;;) {
+        // Spin for a new job, then sleep on wake until one arrives
+        unsigned int generation = __atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE);
+        for (int spin = 0; (spin < THREAD_POOL_SPIN_COUNT) && (generation == seen); spin++) {
+            SPIN_PAUSE();
+            generation = __atomic_load_n(&pool->generation, __ATOMIC_ACQUIRE);
+        }
+        if (generation == seen) {
+            pthread_mutex_lock(&pool->mutex);
+            pool->sleepers++;
+            while ((pool->generation == seen) && !pool->stopping) pthread_cond_wait(&pool->wake, &pool->mutex);
+            pool->sleepers--;
+            generation = pool->generation;
+            pthread_mutex_unlock(&pool->mutex);
+        }
+        if (__atomic_load_n(&pool->stopping, __ATOMIC_ACQUIRE)) break;
+        seen = generation;
+
+        RunShare(pool, thread);
+
+        // The last worker out wakes the caller if it stopped spinning
+        if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&pool->mutex);
+            if (pool->callerSleeping) pthread_cond_signal(&pool->done);
+            pthread_mutex_unlock(&pool->mutex);
+        }
+    }
+
+    return NULL;
+}
+
+#endif // THREAD_POOL_PTHREADS
+
+// threadCount counts the calling thread, 0 or less uses one thread per CPU
+void InitThreadPool(ThreadPool *pool, int threadCount) {
+    if (threadCount <= 0) threadCount = GetCpuCount();
+    if (threadCount > THREAD_POOL_MAX_THREADS) threadCount = THREAD_POOL_MAX_THREADS;
+#if !defined(THREAD_POOL_PTHREADS)
+    threadCount = 1;
+#endif
+
+    *pool = (ThreadPool){ 0 };
+    pool->threadCount = threadCount;
+    pool->schedule = THREAD_POOL_WORK_STEALING;
+    pool->grain = THREAD_POOL_DEFAULT_GRAIN;
+
+#if defined(THREAD_POOL_PTHREADS)
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (int t = 1; t < threadCount; t++) {
+        ThreadPoolWorker *worker = &pool->workers[t];
+        worker->pool = pool;
+        worker->thread = t;
+        if (pthread_create(&worker->handle, NULL, RunWorker, worker) != 0) {
+            // Carry on with the workers that did start
+            pool->threadCount = t;
+            break;
+        }
+    }
+#endif
+}
+
+void UnloadThreadPool(ThreadPool *pool) {
+#if defined(THREAD_POOL_PTHREADS)
+    pthread_mutex_lock(&pool->mutex);
+    __atomic_store_n(&pool->stopping, true, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&pool->generation, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int t = 1; t < pool->threadCount; t++) pthread_join(pool->workers[t].handle, NULL);
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+#endif
+    *pool = (ThreadPool){ 0 };
+}
+
+// Calls task on itemCount items split up by the pool's schedule, returns when all are done
+void RunThreadPool(ThreadPool *pool, ThreadPoolTask task, void *context, int itemCount) {
+    pool->task = task;
+    pool->context = context;
+    pool->itemCount = itemCount;
+    if (pool->grain < 1) pool->grain = 1;
+    pool->jobStartTime = GetWallTime();
+#if defined(THREAD_POOL_PTHREADS)
+    if (pool->schedule == THREAD_POOL_WORK_STEALING) DealTasks(pool);
+#endif
+
+    if (pool->threadCount <= 1) {
+        RunShare(pool, 0);
+        AddJobStats(pool);
+        return;
+    }
+
+#if defined(THREAD_POOL_PTHREADS)
+    __atomic_store_n(&pool->pending, pool->threadCount - 1, __ATOMIC_RELAXED);
+
+    // The job is published by the generation bump, workers that went to sleep need waking
+    pthread_mutex_lock(&pool->mutex);
+    __atomic_add_fetch(&pool->generation, 1, __ATOMIC_RELEASE);
+    if (pool->sleepers > 0) pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+
+    RunShare(pool, 0);
+
+    // Spin for the workers, then sleep until the last one signals
+    for (int spin = 0; (spin < THREAD_POOL_SPIN_COUNT) && (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0); spin++) SPIN_PAUSE();
+    if (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->callerSleeping = true;
+        while (__atomic_load_n(&pool->pending, __ATOMIC_ACQUIRE) > 0) pthread_cond_wait(&pool->done, &pool->mutex);
+        pool->callerSleeping = false;
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    AddJobStats(pool);
+#endif
+}
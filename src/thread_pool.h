@@ -0,0 +1,99 @@
+/*******************************************************************************************
+*
+*   thread_pool - Persistent worker threads that split a range of items into chunks
+*
+*   Workers are started once and wait between jobs, spinning briefly before they sleep so
+*   back to back jobs in one simulation step do not pay for a wake-up each. RunThreadPool()
+*   runs a job on every thread, the calling thread included, and returns once all of it is
+*   done, so consecutive calls are separated by a barrier.
+*
+*   A static schedule hands every thread one contiguous chunk. Work stealing cuts the job
+*   into tasks of grain items and deals each thread a contiguous run of them as its deque.
+*   Threads take tasks from the front of their own deque, and once it is empty steal the
+*   back half of another thread's, so a thread whose items cost more than the rest (a dense
+*   clump of boids) does not hold everyone up. Each deque is a [begin, end) range of task
+*   indexes packed into one 64 bit word, changed with compare and swap.
+*
+*   Builds without pthreads (MSVC) run every job on the calling thread.
+*
+********************************************************************************************/
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdbool.h>
+
+#if !defined(_MSC_VER)
+    #define THREAD_POOL_PTHREADS
+    #include <pthread.h>
+#endif
+
+#define THREAD_POOL_MAX_THREADS 64
+
+#define THREAD_POOL_DEFAULT_GRAIN 64
+
+// Work on items [start, end), thread is the running thread's index, 0 for the calling thread
+typedef void (*ThreadPoolTask)(void *context, int start, int end, int thread);
+
+typedef enum {
+    THREAD_POOL_WORK_STEALING = 0,
+    THREAD_POOL_STATIC,
+    THREAD_POOL_SCHEDULE_COUNT
+} ThreadPoolSchedule;
+
+// Accumulated over jobs until ResetThreadPoolStats()
+typedef struct ThreadPoolStats {
+    double busyTime;            // Seconds spent working on jobs
+    double idleTime;            // Seconds of jobs spent waiting for other threads to finish
+    int tasks;
+    int steals;
+} ThreadPoolStats;
+
+struct ThreadPool;
+
+typedef struct ThreadPoolWorker {
+    struct ThreadPool *pool;
+    int thread;
+#if defined(THREAD_POOL_PTHREADS)
+    pthread_t handle;
+#endif
+    unsigned long long deque;   // Task range, begin in the low 32 bits and end in the high
+    double jobBusyTime;         // Busy time in the current job
+    ThreadPoolStats stats;
+    char padding[64];           // Keeps the deques of neighbouring workers off one cache line
+} ThreadPoolWorker;
+
+// Workers point back at the pool, so it stays where InitThreadPool() set it up
+typedef struct ThreadPool {
+    int threadCount;            // Workers plus the calling thread
+    ThreadPoolSchedule schedule;
+    int grain;                  // Items per task when work stealing
+    ThreadPoolTask task;        // Current job
+    void *context;
+    int itemCount;
+    double jobStartTime;
+    unsigned int generation;    // Bumped for every job, workers wait for it to change
+    int pending;                // Worker chunks of the current job not finished yet
+    int sleepers;               // Workers blocked on wake
+    bool callerSleeping;        // The calling thread is blocked on done
+    bool stopping;
+    ThreadPoolWorker workers[THREAD_POOL_MAX_THREADS];
+#if defined(THREAD_POOL_PTHREADS)
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+#endif
+} ThreadPool;
+
+int GetCpuCount(void);
+double GetWallTime(void);
+
+void InitThreadPool(ThreadPool *pool, int threadCount);
+void UnloadThreadPool(ThreadPool *pool);
+
+const char *GetThreadPoolScheduleName(ThreadPoolSchedule schedule);
+
+void RunThreadPool(ThreadPool *pool, ThreadPoolTask task, void *context, int itemCount);
+void ResetThreadPoolStats(ThreadPool *pool);
+
+#endif // THREAD_POOL_H
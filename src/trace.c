@@ -0,0 +1,241 @@
+/*******************************************************************************************
+*
+*   trace - Timeline of the simulation and render phases, written as Chrome trace events
+*
+********************************************************************************************/
+
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+    #define TRACE_THREAD_LOCAL __declspec(thread)
+#else
+    #define TRACE_THREAD_LOCAL __thread
+#endif
+
+bool traceEnabled = false;
+
+static struct {
+    FILE *file;
+    double startTime;
+    unsigned int generation;                // Bumped by every StartTrace(), buffers of older traces are stale
+    unsigned int capacity;                  // Events per buffer
+    int bufferCount;                        // Registered so far, may run past TRACE_MAX_THREADS
+    TraceBuffer *buffers[TRACE_MAX_THREADS];
+    bool named[TRACE_MAX_THREADS];          // Thread name written to the file
+    int eventCount;                         // Written to the file
+    int dropped;
+} trace = { 0 };
+
+// The calling thread's buffer in the current trace, NULL until it registers
+static TRACE_THREAD_LOCAL TraceBuffer *threadBuffer = NULL;
+static TRACE_THREAD_LOCAL unsigned int threadGeneration = 0;
+
+// Without threads there is no other side to order against, plain accesses do
+static int AddInt(int *value, int amount) {
+#if defined(THREAD_POOL_PTHREADS)
+    return __atomic_add_fetch(value, amount, __ATOMIC_ACQ_REL);
+#else
+    return *value += amount;
+#endif
+}
+
+static int LoadInt(const int *value) {
+#if defined(THREAD_POOL_PTHREADS)
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#else
+    return *value;
+#endif
+}
+
+static unsigned int LoadUnsigned(const unsigned int *value) {
+#if defined(THREAD_POOL_PTHREADS)
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+#else
+    return *value;
+#endif
+}
+
+static void StoreUnsigned(unsigned int *value, unsigned int newValue) {
+#if defined(THREAD_POOL_PTHREADS)
+    __atomic_store_n(value, newValue, __ATOMIC_RELEASE);
+#else
+    *value = newValue;
+#endif
+}
+
+static TraceBuffer *LoadBuffer(TraceBuffer **buffer) {
+#if defined(THREAD_POOL_PTHREADS)
+    return __atomic_load_n(buffer, __ATOMIC_ACQUIRE);
+#else
+    return *buffer;
+#endif
+}
+
+static void StoreBuffer(TraceBuffer **buffer, TraceBuffer *newBuffer) {
+#if defined(THREAD_POOL_PTHREADS)
+    __atomic_store_n(buffer, newBuffer, __ATOMIC_RELEASE);
+#else
+    *buffer = newBuffer;
+#endif
+}
+
+// Gives the calling thread a buffer in the current trace, named name or after its index. The
+// buffer is filled in before it is published, so FlushTrace() never sees half of one.
+static void RegisterThread(const char *name) {
+    threadGeneration = trace.generation;
+    threadBuffer = NULL;
+
+    int index = AddInt(&trace.bufferCount, 1) - 1;
+    if (index >= TRACE_MAX_THREADS) return;
+
+    TraceBuffer *buffer = (TraceBuffer *)calloc(1, sizeof(TraceBuffer));
+    TraceEvent *events = (TraceEvent *)malloc(trace.capacity*sizeof(TraceEvent));
+    if ((buffer == NULL) || (events == NULL)) {
+        free(buffer);
+        free(events);
+        return;
+    }
+
+    buffer->events = events;
+    buffer->capacity = trace.capacity;
+    buffer->thread = index + 1;
+    if (name != NULL) snprintf(buffer->name, sizeof(buffer->name), "%s", name);
+    else snprintf(buffer->name, sizeof(buffer->name), "thread %d", buffer->thread);
+
+    threadBuffer = buffer;
+    StoreBuffer(&trace.buffers[index], buffer);
+}
+
+// Starts recording to a new trace file, eventsPerThread rounded up to a power of two. False
+// when the file could not be opened.
+bool StartTrace(const char *path, int eventsPerThread) {
+    if (trace.file != NULL) StopTrace();
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) return false;
+
+    unsigned int capacity = 1024;
+    while ((capacity < (unsigned int)eventsPerThread) && (capacity < (1u << 30))) capacity *= 2;
+
+    unsigned int generation = trace.generation + 1;
+    memset(&trace, 0, sizeof(trace));
+    trace.file = file;
+    trace.startTime = GetWallTime();
+    trace.generation = generation;
+    trace.capacity = capacity;
+    fprintf(file, "[\n");
+
+    traceEnabled = true;
+    return true;
+}
+
+// The first name given to a thread in a trace sticks, call it before the thread records
+void NameTraceThread(const char *name) {
+    if (traceEnabled && (threadGeneration != trace.generation)) RegisterThread(name);
+}
+
+// Appends an event to the calling thread's buffer, or counts it dropped when the buffer is
+// full. Room is kept for the end of every open span, so ends are never dropped on their own.
+void RecordTraceEvent(const char *name, TraceEventType type, double time, double duration) {
+    if (threadGeneration != trace.generation) RegisterThread(NULL);
+
+    TraceBuffer *buffer = threadBuffer;
+    if (buffer == NULL) return;
+
+    // Only this thread moves head, only the flush moves tail
+    unsigned int head = buffer->head;
+    unsigned int room = buffer->capacity - (head - LoadUnsigned(&buffer->tail));
+    int opened = (type == TRACE_EVENT_BEGIN)? 1 : (type == TRACE_EVENT_END)? -1 : 0;
+
+    // Inside a dropped span everything is dropped, its end included. An end with no begin
+    // recorded in this trace is dropped too.
+    bool dropped = (buffer->droppedSpans > 0) || ((type == TRACE_EVENT_END) && (buffer->openSpans == 0));
+    if (!dropped && (type != TRACE_EVENT_END)) dropped = (room < (unsigned int)(buffer->openSpans + 1 + opened));
+    if (dropped) {
+        if ((buffer->droppedSpans > 0) || (type == TRACE_EVENT_BEGIN)) buffer->droppedSpans += opened;
+        AddInt(&buffer->dropped, 1);
+        return;
+    }
+
+    buffer->openSpans += opened;
+    buffer->events[head & (buffer->capacity - 1)] = (TraceEvent){ time, duration, name, (int)type };
+    StoreUnsigned(&buffer->head, head + 1);
+}
+
+static void WriteTraceLine(const char *line) {
+    fprintf(trace.file, "%s%s", (trace.eventCount > 0)? ",\n" : "", line);
+    trace.eventCount++;
+}
+
+// Writes every event recorded since the last flush, thread by thread. Only one thread may
+// flush at a time, the others carry on recording meanwhile.
+void FlushTrace(void) {
+    if (trace.file == NULL) return;
+
+    int bufferCount = LoadInt(&trace.bufferCount);
+    char line[256] = { 0 };
+
+    trace.dropped = 0;
+    for (int b = 0; (b < bufferCount) && (b < TRACE_MAX_THREADS); b++) {
+        TraceBuffer *buffer = LoadBuffer(&trace.buffers[b]);
+        if (buffer == NULL) continue;
+
+        if (!trace.named[b]) {
+            snprintf(line, sizeof(line), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                     buffer->thread, buffer->name);
+            WriteTraceLine(line);
+            trace.named[b] = true;
+        }
+
+        unsigned int head = LoadUnsigned(&buffer->head);
+        for (unsigned int e = buffer->tail; e != head; e++) {
+            const TraceEvent *event = &buffer->events[e & (buffer->capacity - 1)];
+            double time = 1e6*(event->time - trace.startTime);
+            if (event->type == TRACE_EVENT_COMPLETE) {
+                snprintf(line, sizeof(line), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", event->name,
+                         buffer->thread, time, 1e6*event->duration);
+            }
+            else {
+                snprintf(line, sizeof(line), "{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}", event->name,
+                         (char)event->type, buffer->thread, time);
+            }
+            WriteTraceLine(line);
+        }
+        StoreUnsigned(&buffer->tail, head);
+        trace.dropped += LoadInt(&buffer->dropped);
+    }
+
+    fflush(trace.file);
+}
+
+// Stops recording, flushes and closes the file. Threads that may still record must be done
+// with the trace first, their buffers are freed.
+void StopTrace(void) {
+    if (trace.file == NULL) return;
+
+    traceEnabled = false;
+    FlushTrace();
+    fprintf(trace.file, "\n]\n");
+    fclose(trace.file);
+    trace.file = NULL;
+
+    for (int b = 0; b < TRACE_MAX_THREADS; b++) {
+        if (trace.buffers[b] == NULL) continue;
+        free(trace.buffers[b]->events);
+        free(trace.buffers[b]);
+        trace.buffers[b] = NULL;
+    }
+}
+
+// Lines written to the file so far, thread names included, and the events dropped
+int GetTraceEventCount(void) {
+    return trace.eventCount;
+}
+
+int GetTraceDropped(void) {
+    return trace.dropped;
+}
@@ -0,0 +1,85 @@
+/*******************************************************************************************
+*
+*   trace - Timeline of the simulation and render phases, written as Chrome trace events
+*
+*   While a trace runs, every thread records begin and end events into a buffer of its own,
+*   registered the first time it records. Each buffer is a single producer, single consumer
+*   ring: the owning thread appends and FlushTrace() drains, neither ever waits or takes a
+*   lock. A full buffer drops new events and counts them, flushing more often keeps up.
+*
+*   Drops never leave a span half recorded. A begin only goes in with room left for its end
+*   and the ends of every span still open, and once one is dropped everything up to its end
+*   is dropped with it. Spans timed already are written whole, as one complete event.
+*
+*   FlushTrace() appends the events drained to the trace file in the JSON array format that
+*   chrome://tracing and Perfetto read. StopTrace() flushes once more and closes the array,
+*   a file cut short by a crash still loads, as the closing bracket is optional.
+*
+*   Not tracing, TraceBegin() and the others cost one test of traceEnabled. It is only set
+*   by StartTrace(), before the threads that record are started.
+*
+*   Event names are not copied, they have to outlive the trace (string literals).
+*
+********************************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "thread_pool.h"
+
+#include <stdbool.h>
+
+#define TRACE_MAX_THREADS (THREAD_POOL_MAX_THREADS + 8)     // Pool workers plus the simulation and render threads
+#define TRACE_DEFAULT_EVENTS (1 << 20)                      // Per thread, allocated when the thread first records
+
+typedef enum {
+    TRACE_EVENT_BEGIN = 'B',
+    TRACE_EVENT_END = 'E',
+    TRACE_EVENT_COMPLETE = 'X'
+} TraceEventType;
+
+typedef struct TraceEvent {
+    double time;                // Wall time, seconds
+    double duration;            // Seconds, complete events only
+    const char *name;
+    int type;
+} TraceEvent;
+
+// Written by its thread, drained by FlushTrace()
+typedef struct TraceBuffer {
+    TraceEvent *events;
+    unsigned int capacity;      // A power of two
+    unsigned int head;          // Events appended, published to the flush
+    unsigned int tail;          // Events drained, published to the thread
+    int dropped;                // Events that found the buffer full
+    int openSpans;              // Begins recorded whose end has not come yet, only the thread touches it
+    int droppedSpans;           // Begins dropped whose end has not come yet, only the thread touches it
+    int thread;                 // Thread id in the trace
+    char name[32];
+} TraceBuffer;
+
+extern bool traceEnabled;
+
+bool StartTrace(const char *path, int eventsPerThread);
+void FlushTrace(void);
+void StopTrace(void);
+int GetTraceEventCount(void);
+int GetTraceDropped(void);
+
+void NameTraceThread(const char *name);
+void RecordTraceEvent(const char *name, TraceEventType type, double time, double duration);
+
+static inline void TraceBegin(const char *name) {
+    if (traceEnabled) RecordTraceEvent(name, TRACE_EVENT_BEGIN, GetWallTime(), 0.0);
+}
+
+static inline void TraceEnd(const char *name) {
+    if (traceEnabled) RecordTraceEvent(name, TRACE_EVENT_END, GetWallTime(), 0.0);
+}
+
+// A span timed already, from begin to end in wall time
+static inline void TraceSpan(const char *name, double begin, double end) {
+    if (traceEnabled) RecordTraceEvent(name, TRACE_EVENT_COMPLETE, begin, end - begin);
+}
+
+#endif // TRACE_H
@@ -0,0 +1,333 @@
+/*******************************************************************************************
+*
+*   trajectory_codec - Boid positions of consecutive steps packed into a few bits each
+*
+********************************************************************************************/
+
+#include "trajectory_codec.h"
+#include "flock.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define RICE_ESCAPE 24              // Quotients from here on are stored as 32 raw bits instead
+#define RICE_MAX_PARAMETER 30
+#define RICE_HALVING 64             // Values seen before the running mean starts forgetting
+
+// Running mean of the values coded so far, the Rice parameter follows it
+typedef struct RiceContext {
+    uint64_t sum;
+    uint32_t count;
+} RiceContext;
+
+// Bits are written and read most significant first
+typedef struct BitWriter {
+    unsigned char *data;
+    size_t capacity;
+    size_t bytes;
+    uint64_t bits;
+    int count;                      // Bits in bits not written out yet, under 8 between calls
+    bool overflow;
+} BitWriter;
+
+typedef struct BitReader {
+    const unsigned char *data;
+    size_t size;
+    size_t next;
+    uint64_t bits;                  // Bits not consumed yet, left aligned
+    int count;
+    bool overrun;                   // Met a code no encoder writes
+} BitReader;
+
+static void PutBits(BitWriter *writer, uint64_t value, int n) {
+    writer->bits = (writer->bits << n) | value;
+    writer->count += n;
+    while (writer->count >= 8) {
+        writer->count -= 8;
+        if (writer->bytes < writer->capacity) writer->data[writer->bytes++] = (unsigned char)(writer->bits >> writer->count);
+        else writer->overflow = true;
+    }
+}
+
+// Pads the last byte with zeros
+static void FlushBits(BitWriter *writer) {
+    if (writer->count > 0) PutBits(writer, 0, 8 - writer->count);
+}
+
+static void RefillBits(BitReader *reader) {
+    while (reader->count <= 56) {
+        // Past the end reads as zeros, whether any were used is checked at the end
+        uint64_t byte = (reader->next < reader->size)? reader->data[reader->next] : 0;
+        reader->next++;
+        reader->bits |= byte << (56 - reader->count);
+        reader->count += 8;
+    }
+}
+
+// n bits, at most 32, the reader refilled since 57 or more were consumed
+static uint32_t GetBits(BitReader *reader, int n) {
+    if (n == 0) return 0;
+
+    uint32_t value = (uint32_t)(reader->bits >> (64 - n));
+    reader->bits <<= n;
+    reader->count -= n;
+    return value;
+}
+
+static int CountLeadingZeros(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clzll(value);
+#else
+    int zeros = 0;
+    while (!(value & 0x8000000000000000ull)) {
+        value <<= 1;
+        zeros++;
+    }
+    return zeros;
+#endif
+}
+
+static void ResetRiceContext(RiceContext *context) {
+    context->sum = 4;
+    context->count = 1;
+}
+
+// The smallest parameter with 2^k times the count at least the sum, about log2 of the mean
+static int GetRiceParameter(const RiceContext *context) {
+    int k = 0;
+    while ((k < RICE_MAX_PARAMETER) && (((uint64_t)context->count << k) < context->sum)) k++;
+    return k;
+}
+
+static void UpdateRiceContext(RiceContext *context, uint32_t value) {
+    context->sum += value;
+    context->count++;
+    if (context->count >= RICE_HALVING) {
+        context->sum >>= 1;
+        context->count >>= 1;
+    }
+}
+
+// Quotient in unary as that many zeros and a one, then the k low bits
+static void PutRice(BitWriter *writer, RiceContext *context, uint32_t value) {
+    int k = GetRiceParameter(context);
+    uint32_t quotient = value >> k;
+
+    if (quotient < RICE_ESCAPE) {
+        PutBits(writer, 1, (int)quotient + 1);
+        PutBits(writer, value & ((1u << k) - 1u), k);
+    }
+    else {
+        PutBits(writer, 1, RICE_ESCAPE + 1);
+        PutBits(writer, value, 32);
+    }
+    UpdateRiceContext(context, value);
+}
+
+static uint32_t GetRice(BitReader *reader, RiceContext *context) {
+    RefillBits(reader);
+
+    int k = GetRiceParameter(context);
+    int quotient = (reader->bits != 0)? CountLeadingZeros(reader->bits) : RICE_ESCAPE + 1;
+    uint32_t value = 0;
+    if (quotient < RICE_ESCAPE) {
+        GetBits(reader, quotient + 1);
+        value = ((uint32_t)quotient << k) | GetBits(reader, k);
+    }
+    else if (quotient == RICE_ESCAPE) {
+        GetBits(reader, RICE_ESCAPE + 1);
+        RefillBits(reader);
+        value = GetBits(reader, 32);
+    }
+    else reader->overrun = true;
+
+    UpdateRiceContext(context, value);
+    return value;
+}
+
+// Residuals as unsigned, small magnitudes of either sign give small values
+static uint32_t ZigZag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int32_t UnZigZag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1u);
+}
+
+// quantBits is clamped to TRAJECTORY_MIN_BITS to TRAJECTORY_MAX_BITS, a keyframeInterval
+// under 1 makes every frame a keyframe
+void InitTrajectoryCodec(TrajectoryCodec *codec, float boundsX, float boundsY, float boundsZ, int quantBits, int keyframeInterval) {
+    const float bounds[3] = { boundsX, boundsY, boundsZ };
+
+    *codec = (TrajectoryCodec){ 0 };
+    codec->quantBits = (quantBits < TRAJECTORY_MIN_BITS)? TRAJECTORY_MIN_BITS : (quantBits > TRAJECTORY_MAX_BITS)? TRAJECTORY_MAX_BITS : quantBits;
+    codec->keyframeInterval = (keyframeInterval > 1)? keyframeInterval : 1;
+    for (int a = 0; a < 3; a++) {
+        codec->origin[a] = -COMPACT_POSITION_RANGE*bounds[a];
+        codec->scale[a] = 2.0f*COMPACT_POSITION_RANGE*bounds[a]/(float)((1 << codec->quantBits) - 1);
+        codec->inverseScale[a] = (double)((1 << codec->quantBits) - 1)/(2.0*COMPACT_POSITION_RANGE*bounds[a]);
+    }
+}
+
+void UnloadTrajectoryCodec(TrajectoryCodec *codec) {
+    free(codec->previous);
+    free(codec->older);
+    free(codec->positions);
+    *codec = (TrajectoryCodec){ 0 };
+}
+
+// Room for count boids. Whatever was held is dropped, the next frame is a keyframe.
+static bool ReserveTrajectoryCodec(TrajectoryCodec *codec, int count) {
+    if (count <= codec->capacity) return true;
+
+    int capacity = (count > 2*codec->capacity)? count : 2*codec->capacity;
+    free(codec->previous);
+    free(codec->older);
+    free(codec->positions);
+    codec->previous = (int32_t *)malloc(3*(size_t)capacity*sizeof(int32_t));
+    codec->older = (int32_t *)malloc(3*(size_t)capacity*sizeof(int32_t));
+    codec->positions = (float *)malloc(3*(size_t)capacity*sizeof(float));
+    codec->capacity = (codec->previous != NULL) && (codec->older != NULL) && (codec->positions != NULL)? capacity : 0;
+    codec->history = 0;
+    return (codec->capacity > 0);
+}
+
+// The most bytes a frame of count boids can take, every value escaped
+size_t GetTrajectoryFrameBound(int count) {
+    return sizeof(TrajectoryFrameHeader) + (3*(size_t)count*(RICE_ESCAPE + 1 + 32) + 7)/8 + 8;
+}
+
+// Predicted frames follow on from the last frame when the last three are evenly spaced
+static bool PredictsVelocity(const TrajectoryCodec *codec, int step) {
+    return (codec->history >= 2) && (step - codec->previousStep == codec->previousStep - codec->olderStep);
+}
+
+// The quantised frame just coded, now in older, becomes the previous one
+static void AdvanceTrajectoryCodec(TrajectoryCodec *codec, int step, int count, bool key) {
+    int32_t *swap = codec->previous;
+    codec->previous = codec->older;
+    codec->older = swap;
+
+    codec->count = count;
+    codec->olderStep = codec->previousStep;
+    codec->previousStep = step;
+    codec->history = (codec->history < 2)? codec->history + 1 : 2;
+    codec->sinceKeyframe = (key)? 1 : codec->sinceKeyframe + 1;
+}
+
+static int32_t QuantisePosition(const TrajectoryCodec *codec, int axis, float value) {
+    double q = ((double)value - codec->origin[axis])*codec->inverseScale[axis] + 0.5;
+    double top = (double)((1 << codec->quantBits) - 1);
+
+    // NaN ends up at 0 as well
+    q = (q > 0.0)? q : 0.0;
+    return (int32_t)((q < top)? q : top);
+}
+
+// Codes a frame of count positions, count x then count y then count z, into output. Returns
+// the bytes written, a multiple of four, or 0 when output is too small (GetTrajectoryFrameBound()
+// is always enough) or memory ran out.
+size_t EncodeTrajectoryFrame(TrajectoryCodec *codec, int step, int count, const float *positions, unsigned char *output, size_t capacity) {
+    if ((count < 0) || (capacity < sizeof(TrajectoryFrameHeader))) return 0;
+    if ((count != codec->count) && !ReserveTrajectoryCodec(codec, count)) return 0;
+
+    bool key = (codec->history == 0) || (count != codec->count) || (codec->sinceKeyframe >= codec->keyframeInterval);
+    bool velocity = !key && PredictsVelocity(codec, step);
+    BitWriter writer = { output + sizeof(TrajectoryFrameHeader), capacity - sizeof(TrajectoryFrameHeader), 0, 0, 0, false };
+
+    for (int a = 0; a < 3; a++) {
+        const float *values = positions + (size_t)a*count;
+        const int32_t *previous = codec->previous + (size_t)a*count;
+        int32_t *older = codec->older + (size_t)a*count;
+        RiceContext context = { 0 };
+        ResetRiceContext(&context);
+
+        // Every older value is read for the prediction before it is overwritten
+        for (int i = 0; i < count; i++) {
+            int32_t q = QuantisePosition(codec, a, values[i]);
+            if (key) PutBits(&writer, (uint32_t)q, codec->quantBits);
+            else {
+                int32_t predicted = (velocity)? 2*previous[i] - older[i] : previous[i];
+                PutRice(&writer, &context, ZigZag(q - predicted));
+            }
+            older[i] = q;
+        }
+    }
+    FlushBits(&writer);
+    while ((writer.bytes%4 != 0) && !writer.overflow) PutBits(&writer, 0, 8);
+
+    // Out of room, nothing held has changed but older, so start over from a keyframe
+    if (writer.overflow) {
+        codec->history = 0;
+        return 0;
+    }
+
+    TrajectoryFrameHeader header = { (uint32_t)(sizeof(header) + writer.bytes), step, count,
+                                     (uint32_t)((key)? TRAJECTORY_FRAME_KEY : TRAJECTORY_FRAME_PREDICTED) };
+    memcpy(output, &header, sizeof(header));
+    AdvanceTrajectoryCodec(codec, step, count, key);
+    return header.bytes;
+}
+
+// Decodes the frame at the start of input into positions owned by the codec, count x then
+// count y then count z, valid until the next call. NULL at the end of the frames, and for a
+// frame that is cut short, damaged or predicted from frames this codec has not decoded.
+const float *DecodeTrajectoryFrame(TrajectoryCodec *codec, const unsigned char *input, size_t size, int *step, int *count) {
+    TrajectoryFrameHeader header = { 0 };
+    if (size < sizeof(header)) return NULL;
+    memcpy(&header, input, sizeof(header));
+
+    bool key = (header.type == TRAJECTORY_FRAME_KEY);
+    if ((header.bytes < sizeof(header)) || (header.bytes > size) || (header.count < 0)) return NULL;
+    if (!key && ((header.type != TRAJECTORY_FRAME_PREDICTED) || (codec->history == 0) || (header.count != codec->count))) return NULL;
+
+    // Every value takes a bit at least, a count past that is damage rather than a huge frame
+    if ((uint64_t)header.count*3 > 8*(uint64_t)(header.bytes - sizeof(header))) return NULL;
+    if (key && (header.count != codec->count) && !ReserveTrajectoryCodec(codec, header.count)) return NULL;
+
+    bool velocity = !key && PredictsVelocity(codec, header.step);
+    BitReader reader = { input + sizeof(header), header.bytes - sizeof(header), 0, 0, 0, false };
+
+    for (int a = 0; a < 3; a++) {
+        const int32_t *previous = codec->previous + (size_t)a*header.count;
+        int32_t *older = codec->older + (size_t)a*header.count;
+        float *positions = codec->positions + (size_t)a*header.count;
+        RiceContext context = { 0 };
+        ResetRiceContext(&context);
+
+        for (int i = 0; i < header.count; i++) {
+            int32_t q = 0;
+            if (key) {
+                RefillBits(&reader);
+                q = (int32_t)GetBits(&reader, codec->quantBits);
+            }
+            else {
+                // Unsigned, so a damaged residual wraps instead of overflowing. For values an
+                // encoder wrote the result is the same.
+                uint32_t predicted = (velocity)? 2u*(uint32_t)previous[i] - (uint32_t)older[i] : (uint32_t)previous[i];
+                q = (int32_t)(predicted + (uint32_t)UnZigZag(GetRice(&reader, &context)));
+            }
+            older[i] = q;
+            positions[i] = codec->origin[a] + (float)q*codec->scale[a];
+        }
+    }
+
+    if (reader.overrun || (8*reader.next - (size_t)reader.count > 8*reader.size)) {
+        codec->history = 0;
+        return NULL;
+    }
+
+    AdvanceTrajectoryCodec(codec, header.step, header.count, key);
+    *step = header.step;
+    *count = header.count;
+    return codec->positions;
+}
+
+// Furthest a decoded position can be from the one encoded, inside the quantised range
+float GetTrajectoryCodecError(const TrajectoryCodec *codec) {
+    float largest = 0.0f;
+
+    for (int a = 0; a < 3; a++) largest = (codec->scale[a] > largest)? codec->scale[a] : largest;
+
+    return 0.5f*largest;
+}
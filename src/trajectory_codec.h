@@ -0,0 +1,76 @@
+/*******************************************************************************************
+*
+*   trajectory_codec - Boid positions of consecutive steps packed into a few bits each
+*
+*   Positions are quantised to quantBits bit fixed point over COMPACT_POSITION_RANGE times
+*   the bounds, the same range the compact state covers; the error is at most half a step
+*   of it, and a boid that strays past the range is recorded at its edge. Each frame is then
+*   coded against a prediction of where every boid would be: its last position plus its
+*   last displacement, which is velocity*dt of the step before. Only the difference from the
+*   prediction is stored, Rice coded with a parameter that adapts as the values go by, so
+*   boids flying straight cost a couple of bits an axis.
+*
+*   The displacement comes from the two frames coded before, not from the velocities, so the
+*   decoder predicts exactly what the encoder did from what it has already decoded. Where
+*   the steps of those frames are not evenly spaced, frames were dropped, and the
+*   prediction is just the last position.
+*
+*   Keyframes store every quantised position as it is. They come every keyframeInterval
+*   frames, whenever the boid count changes and first of all, so decoding can start at any
+*   of them.
+*
+*   Frames are native endian, like the flock and recording files.
+*
+********************************************************************************************/
+
+#ifndef TRAJECTORY_CODEC_H
+#define TRAJECTORY_CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRAJECTORY_DEFAULT_BITS 16
+#define TRAJECTORY_MIN_BITS 8
+#define TRAJECTORY_MAX_BITS 22         // Past this a step at the edge of the range is too few float ulps
+#define TRAJECTORY_DEFAULT_KEYFRAME_INTERVAL 60
+
+typedef enum {
+    TRAJECTORY_FRAME_END = 0,       // Zero padding after the last frame
+    TRAJECTORY_FRAME_KEY,
+    TRAJECTORY_FRAME_PREDICTED
+} TrajectoryFrameType;
+
+typedef struct TrajectoryFrameHeader {
+    uint32_t bytes;                 // The whole frame, header included
+    int32_t step;
+    int32_t count;
+    uint32_t type;
+} TrajectoryFrameHeader;
+
+// One side of the codec, an encoder and a decoder each keep their own
+typedef struct TrajectoryCodec {
+    int quantBits;
+    int keyframeInterval;
+    float origin[3];
+    float scale[3];                 // World units per quantisation step
+    double inverseScale[3];         // Double, so positions round to the nearest step at the most bits
+    int count;                      // Boids of the frames held
+    int capacity;
+    int history;                    // Frames held, up to two
+    int sinceKeyframe;              // Frames coded since the last keyframe
+    int previousStep;
+    int olderStep;
+    int32_t *previous;              // Quantised x, y and z of the last frame, count apart
+    int32_t *older;                 // And of the frame before it
+    float *positions;               // Decoded positions, x, y and z count apart
+} TrajectoryCodec;
+
+void InitTrajectoryCodec(TrajectoryCodec *codec, float boundsX, float boundsY, float boundsZ, int quantBits, int keyframeInterval);
+void UnloadTrajectoryCodec(TrajectoryCodec *codec);
+size_t GetTrajectoryFrameBound(int count);
+size_t EncodeTrajectoryFrame(TrajectoryCodec *codec, int step, int count, const float *positions, unsigned char *output, size_t capacity);
+const float *DecodeTrajectoryFrame(TrajectoryCodec *codec, const unsigned char *input, size_t size, int *step, int *count);
+float GetTrajectoryCodecError(const TrajectoryCodec *codec);
+
+#endif // TRAJECTORY_CODEC_H
@@ -1,15 +1,1401 @@
 #include "munit.h"
 
+#include "arena.h"
+#include "spatial_grid.h"
+#include "flock.h"
+#include "neighbour_kernel.h"
+#include "thread_pool.h"
+#include "simulation.h"
+#include "frame_timer.h"
+#include "trace.h"
+#include "rng.h"
+#include "flock_file.h"
+#include "recorder.h"
+#include "trajectory_codec.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
 static MunitResult
 test_boids(const MunitParameter params[], void *user_data)
 {
     return MUNIT_OK;
 }
 
+static MunitResult
+test_spatial_grid(const MunitParameter params[], void *user_data)
+{
+    enum { count = 2000 };
+    static float x[count], y[count], z[count];
+    const float radius = 5.0f;
+    SpatialGrid grid = LoadSpatialGrid(50.0f, 10.0f, 10.0f, radius, count, NULL);
+
+    /* Include points outside the bounds, they get clamped to the border cells */
+    for (int i = 0; i < count; i++) {
+        x[i] = (float)munit_rand_double()*140.0f - 70.0f;
+        y[i] = (float)munit_rand_double()*40.0f - 20.0f;
+        z[i] = (float)munit_rand_double()*40.0f - 20.0f;
+        SpatialGridInsert(&grid, i, x[i], y[i], z[i]);
+    }
+    SpatialGridBuild(&grid, count, NULL);
+
+    munit_assert_int(grid.cellStart[grid.cellCount], ==, count);
+    for (int c = 0; c < grid.cellCount; c++) {
+        for (int k = grid.cellStart[c] + 1; k < grid.cellStart[c + 1]; k++) {
+            munit_assert_int(grid.cellIndexes[k - 1], <, grid.cellIndexes[k]);
+        }
+    }
+
+    /* Every point within the radius must be found in the surrounding cells */
+    int cells[SPATIAL_GRID_MAX_NEIGHBOUR_CELLS];
+    for (int i = 0; i < count; i += 7) {
+        int bruteCount = 0;
+        for (int j = 0; j < count; j++) {
+            float dx = x[j] - x[i], dy = y[j] - y[i], dz = z[j] - z[i];
+            if (sqrtf(dx*dx + dy*dy + dz*dz) < radius) bruteCount++;
+        }
+
+        int gridCount = 0;
+        int cellCount = SpatialGridNeighbourCells(&grid, grid.pointCells[i], cells);
+        for (int c = 0; c < cellCount; c++) {
+            for (int k = grid.cellStart[cells[c]]; k < grid.cellStart[cells[c] + 1]; k++) {
+                int j = grid.cellIndexes[k];
+                float dx = x[j] - x[i], dy = y[j] - y[i], dz = z[j] - z[i];
+                if (sqrtf(dx*dx + dy*dy + dz*dz) < radius) gridCount++;
+            }
+        }
+        munit_assert_int(gridCount, ==, bruteCount);
+    }
+
+    UnloadSpatialGrid(&grid);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_dynamic_spatial_grid(const MunitParameter params[], void *user_data)
+{
+    enum { count = 2000 };
+    static float x[count], y[count], z[count];
+    DynamicSpatialGrid grid = LoadDynamicSpatialGrid(50.0f, 10.0f, 10.0f, 5.0f, count, NULL);
+
+    for (int i = 0; i < count; i++) {
+        x[i] = (float)munit_rand_double()*140.0f - 70.0f;
+        y[i] = (float)munit_rand_double()*40.0f - 20.0f;
+        z[i] = (float)munit_rand_double()*40.0f - 20.0f;
+        DynamicSpatialGridInsert(&grid, i, x[i], y[i], z[i]);
+    }
+
+    for (int round = 0; round < 20; round++) {
+        /* Small steps, only some points cross into another cell */
+        int expectedCrossings = 0;
+        grid.crossings = 0;
+        for (int i = 0; i < count; i++) {
+            int cell = SpatialGridCellIndex(&grid.layout, x[i], y[i], z[i]);
+            x[i] += (float)munit_rand_double()*2.0f - 1.0f;
+            y[i] += (float)munit_rand_double()*2.0f - 1.0f;
+            z[i] += (float)munit_rand_double()*2.0f - 1.0f;
+            if (SpatialGridCellIndex(&grid.layout, x[i], y[i], z[i]) != cell) expectedCrossings++;
+            DynamicSpatialGridMove(&grid, i, x[i], y[i], z[i]);
+        }
+        munit_assert_int(grid.crossings, ==, expectedCrossings);
+
+        /* Every point sits once in the cell of its current position, in its cell's run, and
+           a cell is only out of index order when it is listed */
+        int total = 0;
+        for (int c = 0; c < grid.layout.cellCount; c++) {
+            munit_assert_int(grid.cellCounts[c], <=, grid.cellCapacities[c]);
+            munit_assert_int(grid.cellStart[c] + grid.cellCapacities[c], <=, grid.indexCount);
+            for (int n = 0; n < grid.cellCounts[c]; n++) {
+                int k = grid.cellStart[c] + n;
+                int i = grid.cellIndexes[k];
+                munit_assert_int(grid.pointCells[i], ==, c);
+                munit_assert_int(grid.pointSlots[i], ==, k);
+                if ((n > 0) && !grid.cellUnsorted[c]) munit_assert_int(grid.cellIndexes[k - 1], <, i);
+                munit_assert_int(SpatialGridCellIndex(&grid.layout, x[i], y[i], z[i]), ==, c);
+            }
+            total += grid.cellCounts[c];
+        }
+        munit_assert_int(total, ==, count);
+        munit_assert_int(grid.indexCount, <=, grid.indexCapacity);
+
+        DynamicSpatialGridStats stats = GetDynamicSpatialGridStats(&grid);
+        munit_assert_int(stats.points, ==, count);
+        munit_assert_float(stats.meanOccupancy, ==, (float)count/stats.occupiedCells);
+        munit_assert_float((float)stats.maxOccupancy, >=, stats.meanOccupancy);
+
+        /* Entries outside the cells are empty */
+        int used = 0;
+        for (int k = 0; k < grid.indexCapacity; k++) used += (grid.cellIndexes[k] >= 0);
+        munit_assert_int(used, ==, count);
+
+        /* Sorting the listed cells puts every cell in index order */
+        DynamicSpatialGridSortCells(&grid);
+        munit_assert_int(grid.unsortedCount, ==, 0);
+        for (int c = 0; c < grid.layout.cellCount; c++) {
+            for (int k = grid.cellStart[c]; k < grid.cellStart[c] + grid.cellCounts[c]; k++) {
+                munit_assert_int(grid.pointSlots[grid.cellIndexes[k]], ==, k);
+                if (k > grid.cellStart[c]) munit_assert_int(grid.cellIndexes[k - 1], <, grid.cellIndexes[k]);
+            }
+        }
+    }
+
+    /* Runs that fill up move or get laid out again, the points stay where they were */
+    munit_assert_int(grid.layouts, >, 0);
+
+    UnloadDynamicSpatialGrid(&grid);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_morton_sort(const MunitParameter params[], void *user_data)
+{
+    enum { count = 1000 };
+    static unsigned int keys[count], keyScratch[count];
+    static int indexes[count], indexScratch[count];
+    SpatialGrid grid = LoadSpatialGrid(50.0f, 10.0f, 10.0f, 5.0f, count, NULL);
+
+    /* Morton keys grow along every axis */
+    munit_assert_uint(SpatialGridMortonCode(&grid, -50.0f, 0.0f, 0.0f), <, SpatialGridMortonCode(&grid, 50.0f, 0.0f, 0.0f));
+    munit_assert_uint(SpatialGridMortonCode(&grid, 0.0f, -10.0f, 0.0f), <, SpatialGridMortonCode(&grid, 0.0f, 10.0f, 0.0f));
+    munit_assert_uint(SpatialGridMortonCode(&grid, 0.0f, 0.0f, -10.0f), <, SpatialGridMortonCode(&grid, 0.0f, 0.0f, 10.0f));
+
+    for (int i = 0; i < count; i++) {
+        keys[i] = (unsigned int)munit_rand_int_range(0, 64) << (munit_rand_int_range(0, 3)*8);
+        indexes[i] = i;
+    }
+    SortIndexesByKey(keys, indexes, count, keyScratch, indexScratch);
+
+    /* Ascending keys, equal keys keep their original order */
+    for (int i = 1; i < count; i++) {
+        munit_assert_uint(keys[i - 1], <=, keys[i]);
+        if (keys[i - 1] == keys[i]) munit_assert_int(indexes[i - 1], <, indexes[i]);
+    }
+
+    UnloadSpatialGrid(&grid);
+    return MUNIT_OK;
+}
+
+static Flock flock;
+static Flock reordered;
+
+static void
+scatter_flock(Flock *target, int count)
+{
+    InitFlock(target, count, 50.0f, 10.0f, 10.0f);
+    for (int i = 0; i < count; i++) {
+        target->positionX[i] = (float)munit_rand_int_range(-50, 50);
+        target->positionY[i] = (float)munit_rand_int_range(-10, 10);
+        target->positionZ[i] = (float)munit_rand_int_range(-10, 10);
+        target->velocityX[i] = (float)munit_rand_int_range(-1, 1);
+        target->velocityY[i] = (float)munit_rand_int_range(-1, 1);
+        target->velocityZ[i] = (float)munit_rand_int_range(-1, 1);
+    }
+}
+
+/* A Flock points into itself, so copies start from InitFlock() and take the state over */
+static void
+copy_flock(Flock *target, const Flock *source)
+{
+    InitFlock(target, source->count, source->boundsX, source->boundsY, source->boundsZ);
+    for (int i = 0; i < source->count; i++) {
+        target->positionX[i] = source->positionX[i];
+        target->positionY[i] = source->positionY[i];
+        target->positionZ[i] = source->positionZ[i];
+        target->velocityX[i] = source->velocityX[i];
+        target->velocityY[i] = source->velocityY[i];
+        target->velocityZ[i] = source->velocityZ[i];
+    }
+}
+
+static void
+check_flock_neighbours(NeighbourSearch search, NeighbourSelection selection, bool clumped)
+{
+    scatter_flock(&flock, DEFAULT_BOID_COUNT);
+    flock.reorderInterval = 0;
+    flock.neighbourSearch = search;
+    flock.neighbourSelection = selection;
+    flock.neighbourLimit = (selection == NEIGHBOUR_SELECTION_NEAREST)? 7 : 10;
+    for (int step = 0; step < 30; step++) UpdateFlock(&flock, 1.0f/60.0f);
+
+    /* Boids move about 0.15 a step, well inside the skin for most steps */
+    if (search == NEIGHBOUR_SEARCH_VERLET) munit_assert_int(flock.verletRebuilds, <, 15);
+
+    /* Squeeze the flock into a ball so the octree has to split deep */
+    if (clumped) {
+        for (int i = 0; i < flock.count; i++) {
+            flock.positionX[i] *= 0.05f;
+            flock.positionY[i] *= 0.2f;
+            flock.positionZ[i] *= 0.2f;
+        }
+        InvalidateNeighbourSearch(&flock);
+    }
+    UpdateBoidNeighbours(&flock);
+
+    /* Every search must pick the same matches as a scan over every boid in id order:
+     * the first ones, or the nearest ones with ties going to the smaller id */
+    for (int i = 0; i < flock.count; i++) {
+        int expected[DEFAULT_BOID_COUNT];
+        float expectedDistanceSq[DEFAULT_BOID_COUNT];
+        int expectedCount = 0;
+        for (int y = 0; y < flock.count; y++) {
+            float dx = flock.positionX[y] - flock.positionX[i];
+            float dy = flock.positionY[y] - flock.positionY[i];
+            float dz = flock.positionZ[y] - flock.positionZ[i];
+            float dot = flock.velocityX[i]*flock.velocityX[y] + flock.velocityY[i]*flock.velocityY[y] + flock.velocityZ[i]*flock.velocityZ[y];
+            if ((y != i) && (dx*dx + dy*dy + dz*dz < flock.perceptionRadius*flock.perceptionRadius) && (dot > 0)) {
+                expectedDistanceSq[expectedCount] = dx*dx + dy*dy + dz*dz;
+                expected[expectedCount++] = y;
+            }
+        }
+        if (selection == NEIGHBOUR_SELECTION_NEAREST) {
+            /* Stable insertion sort on distance keeps ties in id order */
+            for (int n = 1; n < expectedCount; n++) {
+                for (int m = n; (m > 0) && (expectedDistanceSq[m - 1] > expectedDistanceSq[m]); m--) {
+                    float distanceSq = expectedDistanceSq[m];
+                    int y = expected[m];
+                    expectedDistanceSq[m] = expectedDistanceSq[m - 1];
+                    expected[m] = expected[m - 1];
+                    expectedDistanceSq[m - 1] = distanceSq;
+                    expected[m - 1] = y;
+                }
+            }
+            if (expectedCount > flock.neighbourLimit) expectedCount = flock.neighbourLimit;
+            for (int n = 1; n < expectedCount; n++) {
+                for (int m = n; (m > 0) && (expected[m - 1] > expected[m]); m--) {
+                    int y = expected[m];
+                    expected[m] = expected[m - 1];
+                    expected[m - 1] = y;
+                }
+            }
+        }
+        if (expectedCount > flock.neighbourLimit) expectedCount = flock.neighbourLimit;
+
+        munit_assert_int(flock.neighbourCounts[i], ==, expectedCount);
+        for (int n = 0; n < expectedCount; n++) munit_assert_int(flock.neighbourIndexes[i][n], ==, expected[n]);
+    }
+
+    UnloadFlock(&flock);
+}
+
+static MunitResult
+test_flock_neighbours(const MunitParameter params[], void *user_data)
+{
+    for (int search = 0; search < NEIGHBOUR_SEARCH_COUNT; search++) {
+        for (int selection = 0; selection < NEIGHBOUR_SELECTION_COUNT; selection++) {
+            check_flock_neighbours((NeighbourSearch)search, (NeighbourSelection)selection, false);
+            check_flock_neighbours((NeighbourSearch)search, (NeighbourSelection)selection, true);
+        }
+    }
+
+    return MUNIT_OK;
+}
+
+static MunitResult
+check_flock_reorder(bool fusedSteering, bool reorderedFusedSteering, NeighbourSelection selection)
+{
+    scatter_flock(&flock, DEFAULT_BOID_COUNT);
+    copy_flock(&reordered, &flock);
+    flock.reorderInterval = 0;
+    reordered.reorderInterval = 3;
+    flock.fusedSteering = fusedSteering;
+    reordered.fusedSteering = reorderedFusedSteering;
+    flock.neighbourSelection = selection;
+    reordered.neighbourSelection = selection;
+
+    /* Sorting the arrays must not change the simulation, boid by boid and bit for bit */
+    for (int step = 0; step < 60; step++) {
+        UpdateFlock(&flock, 1.0f/60.0f);
+        UpdateFlock(&reordered, 1.0f/60.0f);
+    }
+    for (int id = 0; id < flock.count; id++) {
+        int a = flock.slots[id];
+        int b = reordered.slots[id];
+        munit_assert_int(reordered.ids[b], ==, id);
+        munit_assert_memory_equal(sizeof(float), &flock.positionX[a], &reordered.positionX[b]);
+        munit_assert_memory_equal(sizeof(float), &flock.positionY[a], &reordered.positionY[b]);
+        munit_assert_memory_equal(sizeof(float), &flock.positionZ[a], &reordered.positionZ[b]);
+        munit_assert_memory_equal(sizeof(float), &flock.velocityX[a], &reordered.velocityX[b]);
+        munit_assert_memory_equal(sizeof(float), &flock.velocityY[a], &reordered.velocityY[b]);
+        munit_assert_memory_equal(sizeof(float), &flock.velocityZ[a], &reordered.velocityZ[b]);
+    }
+
+    /* Fused steering never stores neighbour lists */
+    if (reorderedFusedSteering) munit_assert_null(reordered.neighbourIndexes);
+
+    UnloadFlock(&flock);
+    UnloadFlock(&reordered);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_flock_reorder(const MunitParameter params[], void *user_data)
+{
+    return check_flock_reorder(false, false, NEIGHBOUR_SELECTION_FIRST_BY_ID);
+}
+
+static MunitResult
+test_flock_fused(const MunitParameter params[], void *user_data)
+{
+    return check_flock_reorder(true, true, NEIGHBOUR_SELECTION_FIRST_BY_ID);
+}
+
+static MunitResult
+test_flock_nearest(const MunitParameter params[], void *user_data)
+{
+    return check_flock_reorder(false, false, NEIGHBOUR_SELECTION_NEAREST);
+}
+
+static MunitResult
+test_flock_double_buffer(const MunitParameter params[], void *user_data)
+{
+    /* Both read only the current state, so the separate passes and the fused one agree bit
+     * for bit whatever order the boids are in */
+    check_flock_reorder(false, true, NEIGHBOUR_SELECTION_FIRST_BY_ID);
+    return check_flock_reorder(false, true, NEIGHBOUR_SELECTION_NEAREST);
+}
+
+static MunitResult
+test_flock_interpolate(const MunitParameter params[], void *user_data)
+{
+    static float previousX[DEFAULT_BOID_COUNT], previousY[DEFAULT_BOID_COUNT], previousZ[DEFAULT_BOID_COUNT];
+    float x, y, z;
+
+    scatter_flock(&flock, DEFAULT_BOID_COUNT);
+    flock.reorderInterval = 2;
+
+    /* Nothing to blend from before the first step */
+    InterpolateBoidPosition(&flock, 5, 0.0f, &x, &y, &z);
+    munit_assert_float(x, ==, flock.positionX[5]);
+
+    /* The previous step is kept by id across reorders, alpha 0 gives it back exactly and
+     * alpha 1 gives the current position */
+    for (int step = 0; step < 6; step++) {
+        for (int id = 0; id < flock.count; id++) {
+            int i = flock.slots[id];
+            previousX[id] = flock.positionX[i];
+            previousY[id] = flock.positionY[i];
+            previousZ[id] = flock.positionZ[i];
+        }
+        UpdateFlock(&flock, 1.0f/60.0f);
+
+        for (int id = 0; id < flock.count; id++) {
+            int i = flock.slots[id];
+            InterpolateBoidPosition(&flock, i, 0.0f, &x, &y, &z);
+            munit_assert_float(x, ==, previousX[id]);
+            munit_assert_float(y, ==, previousY[id]);
+            munit_assert_float(z, ==, previousZ[id]);
+            InterpolateBoidPosition(&flock, i, 1.0f, &x, &y, &z);
+            munit_assert_float(x, ==, flock.positionX[i]);
+            munit_assert_float(y, ==, flock.positionY[i]);
+            munit_assert_float(z, ==, flock.positionZ[i]);
+            InterpolateBoidPosition(&flock, i, 0.5f, &x, &y, &z);
+            munit_assert_float(x, ==, previousX[id] + (flock.positionX[i] - previousX[id])*0.5f);
+        }
+    }
+
+    UnloadFlock(&flock);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_flock_threads(const MunitParameter params[], void *user_data)
+{
+    ThreadPool pool;
+    InitThreadPool(&pool, 3);
+    pool.grain = 16;
+
+    /* Chunks only ever write their own boids, so splitting the step changes nothing */
+    for (int schedule = 0; schedule < THREAD_POOL_SCHEDULE_COUNT; schedule++) {
+        pool.schedule = (ThreadPoolSchedule)schedule;
+        for (int search = 0; search < NEIGHBOUR_SEARCH_COUNT; search++) {
+            for (int fused = 0; fused < 2; fused++) {
+                scatter_flock(&flock, DEFAULT_BOID_COUNT);
+                copy_flock(&reordered, &flock);
+                flock.neighbourSearch = (NeighbourSearch)search;
+                reordered.neighbourSearch = (NeighbourSearch)search;
+                flock.fusedSteering = fused;
+                reordered.fusedSteering = fused;
+                reordered.threadPool = &pool;    /* reordered doubles as the threaded copy */
+
+                for (int step = 0; step < 30; step++) {
+                    UpdateFlock(&flock, 1.0f/60.0f);
+                    UpdateFlock(&reordered, 1.0f/60.0f);
+                }
+                munit_assert_memory_equal(flock.count*sizeof(float), flock.positionX, reordered.positionX);
+                munit_assert_memory_equal(flock.count*sizeof(float), flock.positionY, reordered.positionY);
+                munit_assert_memory_equal(flock.count*sizeof(float), flock.positionZ, reordered.positionZ);
+                munit_assert_memory_equal(flock.count*sizeof(float), flock.velocityX, reordered.velocityX);
+                munit_assert_memory_equal(flock.count*sizeof(float), flock.velocityY, reordered.velocityY);
+                munit_assert_memory_equal(flock.count*sizeof(float), flock.velocityZ, reordered.velocityZ);
+
+                UnloadFlock(&flock);
+                UnloadFlock(&reordered);
+            }
+        }
+    }
+
+    UnloadThreadPool(&pool);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_flock_resize(const MunitParameter params[], void *user_data)
+{
+    /* Growing past the capacity keeps every boid, and the grown flock steps exactly like one
+     * created at that size with the same boids */
+    scatter_flock(&flock, 100);
+    for (int step = 0; step < 130; step++) UpdateFlock(&flock, 1.0f/60.0f);    /* Past a reorder */
+    ResizeFlock(&flock, 5000);
+    munit_assert_int(flock.count, ==, 5000);
+    munit_assert_int(flock.capacity, >=, 5000);
+    munit_assert_size((size_t)flock.positionX % ARENA_ALIGNMENT, ==, 0);
+    munit_assert_size((size_t)flock.nextVelocityZ % ARENA_ALIGNMENT, ==, 0);
+    for (int id = 0; id < flock.count; id++) munit_assert_int(flock.ids[flock.slots[id]], ==, id);
+
+    copy_flock(&reordered, &flock);
+    for (int i = 0; i < flock.count; i++) reordered.ids[i] = flock.ids[i];
+    for (int id = 0; id < flock.count; id++) reordered.slots[id] = flock.slots[id];
+    reordered.stepCounter = flock.stepCounter;
+    for (int step = 0; step < 10; step++) {
+        UpdateFlock(&flock, 1.0f/60.0f);
+        UpdateFlock(&reordered, 1.0f/60.0f);
+    }
+    munit_assert_memory_equal(flock.count*sizeof(float), flock.positionX, reordered.positionX);
+    munit_assert_memory_equal(flock.count*sizeof(float), flock.velocityZ, reordered.velocityZ);
+
+    /* Shrinking drops the highest ids and leaves the others where they were */
+    float x = flock.positionX[flock.slots[42]];
+    ResizeFlock(&flock, 50);
+    munit_assert_int(flock.count, ==, 50);
+    munit_assert_float(flock.positionX[flock.slots[42]], ==, x);
+    for (int i = 0; i < flock.count; i++) munit_assert_int(flock.slots[flock.ids[i]], ==, i);
+    UpdateFlock(&flock, 1.0f/60.0f);
+
+    UnloadFlock(&flock);
+    UnloadFlock(&reordered);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_flock_compact(const MunitParameter params[], void *user_data)
+{
+    ThreadPool pool;
+    InitThreadPool(&pool, 3);
+    pool.grain = 16;
+
+    /* The packed copies are the state rounded to a position step or 11 significant bits */
+    scatter_flock(&flock, DEFAULT_BOID_COUNT);
+    flock.compactState = true;
+    flock.fusedSteering = true;
+    UpdateFlock(&flock, 1.0f/60.0f);
+    SteerFused(&flock);
+    CompactCandidates compact = GetCompactCandidates(&flock);
+    for (int k = 0; k < flock.count; k++) {
+        int i = flock.packedIndexes[k];
+        munit_assert_float(fabsf(DecodeFixed(flock.compactPositionX[k], compact.originX, compact.scaleX) - flock.positionX[i]), <=, 0.5f*compact.scaleX + 1e-5f);
+        munit_assert_float(fabsf(DecodeFixed(flock.compactPositionZ[k], compact.originZ, compact.scaleZ) - flock.positionZ[i]), <=, 0.5f*compact.scaleZ + 1e-5f);
+        munit_assert_float(fabsf(DecodeHalf(flock.compactVelocityY[k]) - flock.velocityY[i]), <=, fabsf(flock.velocityY[i])/2048.0f + 1e-7f);
+    }
+
+    /* Compact from the start, the float copies are never allocated, and a resize keeps it so */
+    munit_assert_null(flock.packedPositionX);
+    ResizeFlock(&flock, 2*DEFAULT_BOID_COUNT);
+    UpdateFlock(&flock, 1.0f/60.0f);
+    munit_assert_null(flock.packedVelocityZ);
+    UnloadFlock(&flock);
+
+    /* One step off the float path stays within the rounding, for almost every boid. The odd
+     * neighbour right on the perception radius can come and go. */
+    scatter_flock(&flock, DEFAULT_BOID_COUNT);
+    for (int i = 0; i < flock.count; i++) {
+        flock.positionX[i] += (float)munit_rand_double();
+        flock.positionY[i] += (float)munit_rand_double();
+        flock.positionZ[i] += (float)munit_rand_double();
+        flock.velocityX[i] += (float)munit_rand_double();
+    }
+    copy_flock(&reordered, &flock);
+    flock.fusedSteering = true;
+    reordered.fusedSteering = true;
+    reordered.compactState = true;
+    UpdateFlock(&flock, 1.0f/60.0f);
+    UpdateFlock(&reordered, 1.0f/60.0f);
+    int outside = 0;
+    for (int i = 0; i < flock.count; i++) {
+        float dx = flock.velocityX[i] - reordered.velocityX[i];
+        float dy = flock.velocityY[i] - reordered.velocityY[i];
+        float dz = flock.velocityZ[i] - reordered.velocityZ[i];
+        outside += (sqrtf(dx*dx + dy*dy + dz*dz) > 1e-3f);
+    }
+    munit_assert_int(outside, <=, flock.count/100);
+    UnloadFlock(&flock);
+    UnloadFlock(&reordered);
+
+    /* Chunks still only write their own boids, every search steps alike threaded or not */
+    for (int search = 0; search < NEIGHBOUR_SEARCH_COUNT; search++) {
+        for (int selection = 0; selection < NEIGHBOUR_SELECTION_COUNT; selection++) {
+            scatter_flock(&flock, DEFAULT_BOID_COUNT);
+            copy_flock(&reordered, &flock);
+            flock.compactState = true;
+            reordered.compactState = true;
+            flock.fusedSteering = true;
+            reordered.fusedSteering = true;
+            flock.neighbourSearch = (NeighbourSearch)search;
+            reordered.neighbourSearch = (NeighbourSearch)search;
+            flock.neighbourSelection = (NeighbourSelection)selection;
+            reordered.neighbourSelection = (NeighbourSelection)selection;
+            reordered.threadPool = &pool;
+
+            for (int step = 0; step < 20; step++) {
+                UpdateFlock(&flock, 1.0f/60.0f);
+                UpdateFlock(&reordered, 1.0f/60.0f);
+            }
+            munit_assert_memory_equal(flock.count*sizeof(float), flock.positionX, reordered.positionX);
+            munit_assert_memory_equal(flock.count*sizeof(float), flock.velocityZ, reordered.velocityZ);
+
+            UnloadFlock(&flock);
+            UnloadFlock(&reordered);
+        }
+    }
+
+    UnloadThreadPool(&pool);
+    return MUNIT_OK;
+}
+
+static size_t
+count_tag_bytes(const Arena *arena)
+{
+    size_t total = 0;
+    for (int t = 0; t < ARENA_TAG_COUNT; t++) total += arena->tagBytes[t];
+    return total;
+}
+
+static MunitResult
+test_arena(const MunitParameter params[], void *user_data)
+{
+    Arena arena = LoadArena(ARENA_DEFAULT_RESERVE);
+    munit_assert_not_null(arena.base);
+
+    /* Aligned, zeroed, and every byte used is either live under a tag or abandoned */
+    unsigned char *a = ArenaAlloc(&arena, 3, ARENA_TAG_STATE);
+    int *b = ArenaAlloc(&arena, 100*sizeof(int), ARENA_TAG_SCRATCH);
+    munit_assert_size((size_t)a % ARENA_ALIGNMENT, ==, 0);
+    munit_assert_size((size_t)b % ARENA_ALIGNMENT, ==, 0);
+    for (int i = 0; i < 100; i++) munit_assert_int(b[i], ==, 0);
+    for (int i = 0; i < 100; i++) b[i] = i;
+    munit_assert_size(count_tag_bytes(&arena) + arena.abandoned, ==, arena.used);
+
+    /* The newest allocation grows in place, anything else moves and keeps its bytes */
+    int *grown = ArenaGrow(&arena, b, 100*sizeof(int), 200*sizeof(int), ARENA_TAG_SCRATCH);
+    munit_assert_ptr_equal(grown, b);
+    a[0] = 7;
+    unsigned char *moved = ArenaGrow(&arena, a, 3, 5000000, ARENA_TAG_STATE);
+    munit_assert_ptr_not_equal(moved, a);
+    munit_assert_int(moved[0], ==, 7);
+    munit_assert_int(moved[4999999], ==, 0);
+    for (int i = 0; i < 100; i++) munit_assert_int(grown[i], ==, i);
+    munit_assert_size(arena.tagBytes[ARENA_TAG_STATE], ==, 5000000);
+    munit_assert_size(arena.tagBytes[ARENA_TAG_SCRATCH], ==, 200*sizeof(int));
+    munit_assert_size(count_tag_bytes(&arena) + arena.abandoned, ==, arena.used);
+
+    /* Freeing the newest allocation gives its bytes back */
+    size_t used = arena.used;
+    ArenaFree(&arena, moved, 5000000, ARENA_TAG_STATE);
+    munit_assert_size(arena.used, ==, used - 5000000);
+    munit_assert_size(arena.tagBytes[ARENA_TAG_STATE], ==, 0);
+
+    /* Memory handed out again after a reset is zeroed again */
+    ResetArena(&arena);
+    munit_assert_size(arena.used, ==, 0);
+    munit_assert_size(arena.peak, >=, used);
+    unsigned char *again = ArenaAlloc(&arena, 5000000, ARENA_TAG_SCRATCH);
+    for (int i = 0; i < 5000000; i += 4093) munit_assert_int(again[i], ==, 0);
+
+    UnloadArena(&arena);
+
+    /* And without an arena it is the heap */
+    int *heap = ArenaGrow(NULL, ArenaAlloc(NULL, 10*sizeof(int), ARENA_TAG_STATE), 10*sizeof(int), 20*sizeof(int), ARENA_TAG_STATE);
+    munit_assert_not_null(heap);
+    ArenaFree(NULL, heap, 20*sizeof(int), ARENA_TAG_STATE);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_flock_footprint(const MunitParameter params[], void *user_data)
+{
+    /* A step allocates nothing once the flock has settled. Verlet lists are the exception,
+     * they keep doubling while the boids clump. */
+    for (int search = 0; search < NEIGHBOUR_SEARCH_COUNT; search++) {
+        scatter_flock(&flock, DEFAULT_BOID_COUNT);
+        flock.neighbourSearch = (NeighbourSearch)search;
+        for (int step = 0; step < 130; step++) UpdateFlock(&flock, 1.0f/60.0f);
+
+        size_t used = flock.arena.used;
+        for (int step = 0; step < 130; step++) UpdateFlock(&flock, 1.0f/60.0f);
+        if (search != NEIGHBOUR_SEARCH_VERLET) {
+            munit_assert_size(flock.arena.used, ==, used);
+        }
+        munit_assert_size(count_tag_bytes(&flock.arena) + flock.arena.abandoned, ==, flock.arena.used);
+        munit_assert_size(flock.arena.tagBytes[ARENA_TAG_STATE], >=, 2*6*DEFAULT_BOID_COUNT*sizeof(float));
+
+        UnloadFlock(&flock);
+    }
+    return MUNIT_OK;
+}
+
+static int poolVisits[1000];
+static int poolThreads[1000];
+
+static void
+count_pool_visits(void *context, int start, int end, int thread)
+{
+    for (int i = start; i < end; i++) {
+        poolVisits[i]++;
+        poolThreads[i] = thread;
+    }
+}
+
+static void
+check_thread_pool(int threadCount)
+{
+    ThreadPool pool;
+    InitThreadPool(&pool, threadCount);
+    munit_assert_int(pool.threadCount, >=, 1);
+    pool.grain = 7;
+
+    /* Every item exactly once, also with fewer items than threads. The static schedule
+     * hands out contiguous chunks in thread order, work stealing runs every task once. */
+    const int itemCounts[] = { 1000, 3, 0 };
+    for (int schedule = 0; schedule < THREAD_POOL_SCHEDULE_COUNT; schedule++) {
+        pool.schedule = (ThreadPoolSchedule)schedule;
+        for (int c = 0; c < 3; c++) {
+            for (int run = 0; run < 50; run++) {
+                ResetThreadPoolStats(&pool);
+                for (int i = 0; i < 1000; i++) poolVisits[i] = 0;
+                RunThreadPool(&pool, count_pool_visits, NULL, itemCounts[c]);
+                for (int i = 0; i < 1000; i++) munit_assert_int(poolVisits[i], ==, (i < itemCounts[c])? 1 : 0);
+
+                int tasks = 0;
+                for (int t = 0; t < pool.threadCount; t++) {
+                    munit_assert_double(pool.workers[t].stats.busyTime, >=, 0.0);
+                    munit_assert_double(pool.workers[t].stats.idleTime, >=, 0.0);
+                    tasks += pool.workers[t].stats.tasks;
+                }
+                if (pool.schedule == THREAD_POOL_WORK_STEALING) munit_assert_int(tasks, ==, (itemCounts[c] + pool.grain - 1)/pool.grain);
+                else {
+                    /* Threads left without items ran no task */
+                    munit_assert_int(tasks, ==, (itemCounts[c] < pool.threadCount)? itemCounts[c] : pool.threadCount);
+                    for (int i = 1; i < itemCounts[c]; i++) munit_assert_int(poolThreads[i], >=, poolThreads[i - 1]);
+                }
+            }
+        }
+    }
+
+    UnloadThreadPool(&pool);
+}
+
+static MunitResult
+test_thread_pool(const MunitParameter params[], void *user_data)
+{
+    check_thread_pool(1);
+    check_thread_pool(4);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_neighbour_kernels(const MunitParameter params[], void *user_data)
+{
+    enum { count = 203 };
+    static float x[count], y[count], z[count], vx[count], vy[count], vz[count];
+    static int expected[count + NEIGHBOUR_KERNEL_SLACK], accepted[count + NEIGHBOUR_KERNEL_SLACK];
+    NeighbourCandidates candidates = { x, y, z, vx, vy, vz };
+
+    /* Coarse values so plenty of candidates sit exactly on the radius and on a zero dot product */
+    for (int i = 0; i < count; i++) {
+        x[i] = (float)munit_rand_int_range(-6, 6);
+        y[i] = (float)munit_rand_int_range(-6, 6);
+        z[i] = (float)munit_rand_int_range(-6, 6);
+        vx[i] = (float)munit_rand_int_range(-1, 1)*0.5f;
+        vy[i] = (float)munit_rand_int_range(-1, 1)*0.5f;
+        vz[i] = (float)munit_rand_int_range(-1, 1)*0.5f;
+    }
+    NeighbourQuery query = { 0.0f, 1.0f, -1.0f, 0.5f, 0.0f, -0.5f, 25.0f };
+
+    for (int kernel = 0; kernel < NEIGHBOUR_KERNEL_COUNT; kernel++) {
+        if (!IsNeighbourKernelSupported((NeighbourKernel)kernel)) continue;
+
+        for (int start = 0; start < 9; start++) {
+            for (int end = start; end <= count; end += 13) {
+                SetNeighbourKernel(NEIGHBOUR_KERNEL_SCALAR);
+                int expectedCount = FilterNeighbours(&candidates, start, end, &query, expected);
+                SetNeighbourKernel((NeighbourKernel)kernel);
+                int acceptedCount = FilterNeighbours(&candidates, start, end, &query, accepted);
+
+                munit_assert_int(acceptedCount, ==, expectedCount);
+                munit_assert_memory_equal(expectedCount*sizeof(int), accepted, expected);
+            }
+        }
+    }
+
+    SetNeighbourKernel(NEIGHBOUR_KERNEL_SCALAR);
+    InitNeighbourKernel();
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_compact_kernels(const MunitParameter params[], void *user_data)
+{
+    enum { count = 203 };
+    enum { padded = count + NEIGHBOUR_KERNEL_SLACK };
+    static uint16_t x[padded], y[padded], z[padded], vx[padded], vy[padded], vz[padded];
+    static int expected[count + NEIGHBOUR_KERNEL_SLACK], accepted[count + NEIGHBOUR_KERNEL_SLACK];
+    CompactCandidates candidates = { x, y, z, vx, vy, vz, -12.0f, -12.0f, -12.0f, 24.0f/65535.0f, 24.0f/65535.0f, 24.0f/65535.0f };
+
+    /* Fixed point rounds to the nearest step and clamps outside the range */
+    for (int i = 0; i < 1000; i++) {
+        float value = (float)munit_rand_double()*24.0f - 12.0f;
+        float decoded = DecodeFixed(EncodeFixed(value, -12.0f, 65535.0f/24.0f), -12.0f, 24.0f/65535.0f);
+        munit_assert_float(fabsf(decoded - value), <=, 0.5f*24.0f/65535.0f + 1e-6f);
+    }
+    munit_assert_int(EncodeFixed(-100.0f, -12.0f, 65535.0f/24.0f), ==, 0);
+    munit_assert_int(EncodeFixed(100.0f, -12.0f, 65535.0f/24.0f), ==, 65535);
+
+    /* Half floats keep 11 significant bits, below 2^-14 the step is 2^-24 */
+    for (int i = 0; i < 1000; i++) {
+        float value = (float)(munit_rand_double() - 0.5)*powf(2.0f, (float)munit_rand_int_range(-14, 15));
+        munit_assert_float(fabsf(DecodeHalf(EncodeHalf(value)) - value), <=, fmaxf(fabsf(value)/2048.0f, 1.0f/33554432.0f));
+    }
+    munit_assert_float(DecodeHalf(EncodeHalf(1.0f/1048576.0f)), ==, 1.0f/1048576.0f);
+    munit_assert_float(DecodeHalf(EncodeHalf(-3.0f)), ==, -3.0f);
+    munit_assert_float(DecodeHalf(EncodeHalf(1e9f)), ==, 65504.0f);
+
+    /* Coarse values again, so there are plenty of ties for the kernels to disagree on */
+    for (int i = 0; i < count; i++) {
+        x[i] = EncodeFixed((float)munit_rand_int_range(-6, 6), -12.0f, 65535.0f/24.0f);
+        y[i] = EncodeFixed((float)munit_rand_int_range(-6, 6), -12.0f, 65535.0f/24.0f);
+        z[i] = EncodeFixed((float)munit_rand_int_range(-6, 6), -12.0f, 65535.0f/24.0f);
+        vx[i] = EncodeHalf((float)munit_rand_int_range(-1, 1)*0.5f);
+        vy[i] = EncodeHalf((float)munit_rand_int_range(-1, 1)*0.5f);
+        vz[i] = EncodeHalf((float)munit_rand_int_range(-1, 1)*0.5f);
+    }
+    NeighbourQuery query = { 0.0f, 1.0f, -1.0f, 0.5f, 0.0f, -0.5f, 25.0f };
+
+    for (int kernel = 0; kernel < NEIGHBOUR_KERNEL_COUNT; kernel++) {
+        if (!IsNeighbourKernelSupported((NeighbourKernel)kernel)) continue;
+
+        for (int start = 0; start < 9; start++) {
+            for (int end = start; end <= count; end += 13) {
+                SetNeighbourKernel(NEIGHBOUR_KERNEL_SCALAR);
+                int expectedCount = FilterCompactNeighbours(&candidates, start, end, &query, expected);
+                SetNeighbourKernel((NeighbourKernel)kernel);
+                int acceptedCount = FilterCompactNeighbours(&candidates, start, end, &query, accepted);
+
+                munit_assert_int(acceptedCount, ==, expectedCount);
+                munit_assert_memory_equal(expectedCount*sizeof(int), accepted, expected);
+            }
+        }
+    }
+
+    SetNeighbourKernel(NEIGHBOUR_KERNEL_SCALAR);
+    InitNeighbourKernel();
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_triple_buffer(const MunitParameter params[], void *user_data)
+{
+    TripleBuffer buffer;
+    InitTripleBuffer(&buffer);
+
+    /* The three slots stay distinct, and nothing is taken before it is published */
+    munit_assert_false(AcquireTripleBuffer(&buffer));
+    int first = buffer.writeSlot;
+    PublishTripleBuffer(&buffer);
+    munit_assert_int(buffer.writeSlot, !=, first);
+    munit_assert_true(AcquireTripleBuffer(&buffer));
+    munit_assert_int(buffer.readSlot, ==, first);
+    munit_assert_false(AcquireTripleBuffer(&buffer));
+
+    /* Publishing twice before reading leaves only the newer slot to take */
+    int second = buffer.writeSlot;
+    PublishTripleBuffer(&buffer);
+    int third = buffer.writeSlot;
+    PublishTripleBuffer(&buffer);
+    munit_assert_int(buffer.writeSlot, ==, second);
+    munit_assert_true(AcquireTripleBuffer(&buffer));
+    munit_assert_int(buffer.readSlot, ==, third);
+    munit_assert_int(buffer.writeSlot, !=, buffer.readSlot);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_simulation_thread(const MunitParameter params[], void *user_data)
+{
+    for (int threaded = 0; threaded < 2; threaded++) {
+        scatter_flock(&flock, 300);
+        copy_flock(&reordered, &flock);
+
+        /* Snapshots only ever move forward while the simulation thread steps the flock */
+        Simulation simulation;
+        StartSimulation(&simulation, &flock, 2000.0f, 4, threaded);
+        const FlockSnapshot *snapshot = GetLatestSnapshot(&simulation);
+        munit_assert_int(snapshot->step, ==, 0);
+        int step = 0;
+        double timeout = GetWallTime() + 10.0;
+        while ((step < 40) && (GetWallTime() < timeout)) {
+            UpdateSimulation(&simulation);
+            snapshot = GetLatestSnapshot(&simulation);    /* The previous one may be refilled already */
+            munit_assert_int(snapshot->step, >=, step);
+            munit_assert_int(snapshot->count, ==, 300);
+            step = snapshot->step;
+        }
+        munit_assert_int(step, >=, 40);
+
+        /* And each one is exactly the flock after that many steps, looked up by id. The
+         * snapshot held is left alone while the simulation carries on. */
+        for (int s = 0; s < step; s++) UpdateFlock(&reordered, 1.0f/2000.0f);
+        for (int id = 0; id < reordered.count; id++) {
+            int i = reordered.slots[id];
+            munit_assert_float(snapshot->positionX[id], ==, reordered.positionX[i]);
+            munit_assert_float(snapshot->positionY[id], ==, reordered.positionY[i]);
+            munit_assert_float(snapshot->positionZ[id], ==, reordered.positionZ[i]);
+            munit_assert_float(snapshot->velocityX[id], ==, reordered.velocityX[i]);
+        }
+        UnloadSimulation(&simulation);
+
+        UnloadFlock(&flock);
+        UnloadFlock(&reordered);
+    }
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_frame_timer(const MunitParameter params[], void *user_data)
+{
+    static const char *names[2] = { "first", "second" };
+    FrameTimer timer;
+    InitFrameTimer(&timer, 2, names);
+    munit_assert_null(GetFrameTimerHistory(&timer, 0));
+
+    /* The first frame starts the averages, later ones pull them a little way towards theirs */
+    SetFramePhaseTime(&timer, 0, 0.002);
+    SetFramePhaseTime(&timer, 1, 0.004);
+    EndFrameTimer(&timer);
+    munit_assert_double_equal(timer.averages[0], 0.002, 9);
+    munit_assert_double_equal(GetFrameTimerAverageTotal(&timer), 0.006, 9);
+    SetFramePhaseTime(&timer, 0, 0.012);
+    EndFrameTimer(&timer);
+    munit_assert_double_equal(timer.averages[0], 0.002 + 0.010*FRAME_TIMER_SMOOTHING, 9);
+    munit_assert_double_equal(timer.averages[1], 0.004*(1.0 - FRAME_TIMER_SMOOTHING), 9);
+
+    /* History runs newest first and stops at the frames recorded */
+    munit_assert_float(GetFrameTimerHistory(&timer, 0)[0], ==, 0.012f);
+    munit_assert_float(GetFrameTimerHistory(&timer, 1)[1], ==, 0.004f);
+    munit_assert_null(GetFrameTimerHistory(&timer, 2));
+
+    /* Measured phases add up every time they are begun, and the ring wraps */
+    for (int f = 0; f < FRAME_TIMER_HISTORY + 5; f++) {
+        BeginFramePhase(&timer, 1);
+        BeginFramePhase(&timer, 0);
+        BeginFramePhase(&timer, 1);
+        EndFrameTimer(&timer);
+        munit_assert_float(GetFrameTimerHistory(&timer, 0)[1], >=, 0.0f);
+    }
+    munit_assert_not_null(GetFrameTimerHistory(&timer, FRAME_TIMER_HISTORY - 1));
+    munit_assert_null(GetFrameTimerHistory(&timer, FRAME_TIMER_HISTORY));
+    munit_assert_int(timer.phase, ==, -1);
+
+    /* Every step times its phases, each within the whole step */
+    scatter_flock(&flock, 300);
+    double start = GetWallTime();
+    UpdateFlock(&flock, 1.0f/60.0f);
+    double stepTime = GetWallTime() - start;
+    double total = 0.0;
+    for (int p = 0; p < FLOCK_PHASE_COUNT; p++) {
+        munit_assert_double(flock.phaseTimes[p], >=, 0.0);
+        total += flock.phaseTimes[p];
+    }
+    munit_assert_double(total, >, 0.0);
+    munit_assert_double(total, <=, stepTime);
+    UnloadFlock(&flock);
+    return MUNIT_OK;
+}
+
+/* Records the steps the callback saw */
+static void
+count_step(const Flock *stepped, void *context)
+{
+    int *steps = (int *)context;
+    munit_assert_int(stepped->stepCounter, ==, *steps + 1);
+    *steps = stepped->stepCounter;
+}
+
+static MunitResult
+test_flock_checksum(const MunitParameter params[], void *user_data)
+{
+    /* The same seed gives the same numbers, and the generator is pinned to SplitMix64 */
+    Rng first, second;
+    SeedRng(&first, 0);
+    munit_assert_uint64(NextRng(&first), ==, 0xe220a8397b1dcdafULL);
+    SeedRng(&first, 1234);
+    SeedRng(&second, 1234);
+    int seen = 0;
+    for (int i = 0; i < 1000; i++) {
+        int value = NextRngInt(&first, -2, 2);
+        munit_assert_int(value, ==, NextRngInt(&second, -2, 2));
+        munit_assert_int(value, >=, -2);
+        munit_assert_int(value, <=, 2);
+        seen |= 1 << (value + 2);
+    }
+    munit_assert_int(seen, ==, 31);
+
+    /* Two runs from one start hash the same after every step, however the slots are sorted */
+    scatter_flock(&flock, 500);
+    copy_flock(&reordered, &flock);
+    flock.reorderInterval = 0;
+    reordered.reorderInterval = 7;
+    int steps = 0;
+    flock.stepCallback = count_step;
+    flock.stepContext = &steps;
+    munit_assert_uint64(HashFlockState(&flock), ==, HashFlockState(&reordered));
+    for (int step = 0; step < 30; step++) {
+        UpdateFlock(&flock, 1.0f/60.0f);
+        UpdateFlock(&reordered, 1.0f/60.0f);
+        munit_assert_uint64(HashFlockState(&flock), ==, HashFlockState(&reordered));
+    }
+    munit_assert_int(steps, ==, 30);
+
+    /* A single bit of difference shows */
+    uint64_t hash = HashFlockState(&flock);
+    uint32_t bits;
+    memcpy(&bits, &flock.velocityZ[123], sizeof(bits));
+    bits ^= 1;
+    memcpy(&flock.velocityZ[123], &bits, sizeof(bits));
+    munit_assert_uint64(HashFlockState(&flock), !=, hash);
+
+    UnloadFlock(&flock);
+    UnloadFlock(&reordered);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_flock_file(const MunitParameter params[], void *user_data)
+{
+    const char *path = "test_flock.bin";
+    Rng rng, loadedRng;
+    SeedRng(&rng, 99);
+    NextRng(&rng);
+
+    /* A saved flock goes on exactly as the original does, slots, previous state and all */
+    scatter_flock(&flock, 700);
+    flock.reorderInterval = 16;
+    for (int step = 0; step < 40; step++) UpdateFlock(&flock, 1.0f/60.0f);
+    munit_assert_int(SaveFlockFile(&flock, &rng, path), ==, FLOCK_FILE_OK);
+
+    InitFlock(&reordered, 10, 5.0f, 5.0f, 5.0f);
+    reordered.reorderInterval = 16;
+    munit_assert_int(LoadFlockFile(&reordered, &loadedRng, path), ==, FLOCK_FILE_OK);
+    munit_assert_uint64(loadedRng.state, ==, rng.state);
+    munit_assert_int(reordered.count, ==, 700);
+    munit_assert_int(reordered.stepCounter, ==, 40);
+    munit_assert_float(reordered.boundsX, ==, 50.0f);
+    munit_assert_true(reordered.previousStateValid);
+    for (int i = 0; i < 700; i++) {
+        munit_assert_int(reordered.ids[i], ==, flock.ids[i]);
+        munit_assert_float(reordered.nextPositionY[i], ==, flock.nextPositionY[i]);
+    }
+    for (int step = 0; step < 40; step++) {
+        UpdateFlock(&flock, 1.0f/60.0f);
+        UpdateFlock(&reordered, 1.0f/60.0f);
+    }
+    munit_assert_uint64(HashFlockState(&reordered), ==, HashFlockState(&flock));
+
+    /* Files that are cut short, of another version or not flocks at all leave the flock alone */
+    FILE *file = fopen(path, "r+b");
+    FlockFileHeader header;
+    munit_assert_size(fread(&header, sizeof(header), 1, file), ==, 1);
+    header.version++;
+    fseek(file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    fclose(file);
+    munit_assert_int(LoadFlockFile(&reordered, NULL, path), ==, FLOCK_FILE_WRONG_VERSION);
+    munit_assert_int(reordered.count, ==, 700);
+
+    /* As do radii and bounds no grid can be built for */
+    header.version--;
+    const float badModels[][2] = { { 0.0f, 50.0f }, { -1.0f, 50.0f }, { NAN, 50.0f }, { 5.0f, INFINITY }, { 5.0f, -50.0f }, { 5.0f, 1e9f } };
+    for (int m = 0; m < (int)(sizeof(badModels)/sizeof(badModels[0])); m++) {
+        FlockFileHeader bad = header;
+        bad.perceptionRadius = badModels[m][0];
+        bad.boundsX = badModels[m][1];
+        file = fopen(path, "r+b");
+        fwrite(&bad, sizeof(bad), 1, file);
+        fclose(file);
+        munit_assert_int(LoadFlockFile(&reordered, NULL, path), ==, FLOCK_FILE_CORRUPT);
+        munit_assert_int(reordered.count, ==, 700);
+        munit_assert_float(reordered.perceptionRadius, ==, flock.perceptionRadius);
+    }
+
+    /* An offset so large that adding the arrays to it wraps around */
+    FlockFileHeader farOffset = header;
+    farOffset.dataOffset = UINT64_MAX/ARENA_ALIGNMENT*ARENA_ALIGNMENT;
+    file = fopen(path, "r+b");
+    fwrite(&farOffset, sizeof(farOffset), 1, file);
+    fclose(file);
+    munit_assert_int(LoadFlockFile(&reordered, NULL, path), ==, FLOCK_FILE_TRUNCATED);
+    munit_assert_int(reordered.count, ==, 700);
+    header.version++;
+
+    file = fopen(path, "wb");
+    header.version--;
+    fwrite(&header, sizeof(header), 1, file);
+    fclose(file);
+    munit_assert_int(LoadFlockFile(&reordered, NULL, path), ==, FLOCK_FILE_TRUNCATED);
+
+    file = fopen(path, "wb");
+    fputs("# 700 boids after 80 steps\n", file);
+    fclose(file);
+    munit_assert_int(LoadFlockFile(&reordered, NULL, path), ==, FLOCK_FILE_NOT_A_FLOCK);
+    munit_assert_int(LoadFlockFile(&reordered, NULL, "missing_flock.bin"), ==, FLOCK_FILE_OPEN_FAILED);
+    munit_assert_int(reordered.count, ==, 700);
+
+    remove(path);
+    UnloadFlock(&flock);
+    UnloadFlock(&reordered);
+    return MUNIT_OK;
+}
+
+/* Counts the lines of a trace file that contain text */
+static int
+count_trace_lines(const char *path, const char *text)
+{
+    FILE *file = fopen(path, "r");
+    char line[512];
+    int count = 0;
+    munit_assert_not_null(file);
+    while (fgets(line, sizeof(line), file) != NULL) count += (strstr(line, text) != NULL);
+    fclose(file);
+    return count;
+}
+
+static MunitResult
+test_recorder(const MunitParameter params[], void *user_data)
+{
+    const char *path = "test_recording.bin";
+    const int steps = 30;
+    Recorder recorder;
+    RecordingReader reader;
+
+    /* Slabs of one block hold three frames of 100 boids, far more slabs than get filled */
+    scatter_flock(&flock, 100);
+    float *expected = (float *)malloc((size_t)(steps + 1)*3*100*sizeof(float));
+    munit_assert_true(StartRecorder(&recorder, path, &flock, 1.0f/60.0f, 1, 64, 0, 0));
+    munit_assert_size(recorder.slabBytes, ==, RECORDER_BLOCK);
+    for (int step = 0; step <= steps; step++) {
+        if (step > 0) {
+            UpdateFlock(&flock, 1.0f/60.0f);
+            RecordFlockFrame(&recorder, &flock);
+        }
+        for (int id = 0; id < 100; id++) {
+            float *frame = expected + (size_t)step*3*100;
+            frame[id] = flock.positionX[flock.slots[id]];
+            frame[100 + id] = flock.positionY[flock.slots[id]];
+            frame[200 + id] = flock.positionZ[flock.slots[id]];
+        }
+    }
+
+    /* A flock grown past a slab has its frames dropped rather than split */
+    ResizeFlock(&flock, 400);
+    RecordFlockFrame(&recorder, &flock);
+    StopRecorder(&recorder);
+
+    RecorderStats stats = GetRecorderStats(&recorder);
+    munit_assert_llong(stats.framesRecorded, ==, steps + 1);
+    munit_assert_llong(stats.framesDropped, ==, 1);
+    munit_assert_llong(stats.slabsWritten, ==, (steps + 3)/3);
+    munit_assert_llong(stats.bytesWritten, ==, stats.slabsWritten*RECORDER_BLOCK);
+    munit_assert_llong(stats.writeErrors, ==, 0);
+
+    /* Every frame reads back exactly, by id, in step order */
+    munit_assert_true(OpenRecording(&reader, path));
+    munit_assert_float(reader.header.stepTime, ==, 1.0f/60.0f);
+    munit_assert_float(reader.header.boundsY, ==, flock.boundsY);
+    int step = 0, count = 0, frames = 0;
+    const float *positions = NULL;
+    while ((positions = ReadRecordedFrame(&reader, &step, &count)) != NULL) {
+        munit_assert_int(step, ==, frames);
+        munit_assert_int(count, ==, 100);
+        munit_assert_memory_equal(3*100*sizeof(float), positions, expected + (size_t)frames*3*100);
+        frames++;
+    }
+    munit_assert_int(frames, ==, steps + 1);
+    CloseRecording(&reader);
+
+    /* Coded, the same frames come back to within the quantisation */
+    ResizeFlock(&flock, 100);
+    munit_assert_true(StartRecorder(&recorder, path, &flock, 1.0f/60.0f, 1, 64, 16, 8));
+    for (int s = 1; s <= steps; s++) {
+        UpdateFlock(&flock, 1.0f/60.0f);
+        RecordFlockFrame(&recorder, &flock);
+    }
+    StopRecorder(&recorder);
+    stats = GetRecorderStats(&recorder);
+    munit_assert_llong(stats.framesRecorded, ==, steps + 1);
+    munit_assert_llong(stats.writeErrors, ==, 0);
+    munit_assert_llong(stats.bytesWritten%RECORDER_BLOCK, ==, 0);
+
+    munit_assert_true(OpenRecording(&reader, path));
+    munit_assert_uint(reader.header.quantBits, ==, 16);
+    float error = GetTrajectoryCodecError(&reader.codec);
+    frames = 0;
+    while ((positions = ReadRecordedFrame(&reader, &step, &count)) != NULL) {
+        munit_assert_int(step, ==, steps + frames);
+        munit_assert_int(count, ==, 100);
+        frames++;
+    }
+    munit_assert_int(frames, ==, steps + 1);
+    for (int id = 0; id < 100; id++) {
+        munit_assert_float(fabsf(reader.codec.positions[id] - flock.positionX[flock.slots[id]]), <=, error + 1e-5f);
+        munit_assert_float(fabsf(reader.codec.positions[200 + id] - flock.positionZ[flock.slots[id]]), <=, error + 1e-5f);
+    }
+    CloseRecording(&reader);
+
+    FILE *file = fopen(path, "wb");
+    fputs("# 100 boids for 30 steps\n", file);
+    fclose(file);
+    munit_assert_false(OpenRecording(&reader, path));
+    munit_assert_false(OpenRecording(&reader, "missing_recording.bin"));
+
+    remove(path);
+    free(expected);
+    UnloadFlock(&flock);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_trajectory_codec(const MunitParameter params[], void *user_data)
+{
+    const int count = 500;
+    TrajectoryCodec encoder, decoder;
+    float *positions = (float *)malloc(3*(size_t)count*sizeof(float));
+    size_t capacity = GetTrajectoryFrameBound(count);
+    unsigned char *frame = (unsigned char *)malloc(capacity);
+    size_t codedBytes = 0;
+    int step = 0, decodedCount = 0;
+
+    /* Every frame decodes to within half a quantisation step, keyframes where they are due */
+    scatter_flock(&flock, count);
+    InitTrajectoryCodec(&encoder, flock.boundsX, flock.boundsY, flock.boundsZ, 16, 50);
+    InitTrajectoryCodec(&decoder, flock.boundsX, flock.boundsY, flock.boundsZ, 16, 50);
+    float error = GetTrajectoryCodecError(&encoder);
+    const float bounds[3] = { flock.boundsX, flock.boundsY, flock.boundsZ };
+    munit_assert_float(error, <, 0.002f);
+    for (int s = 0; s < 120; s++) {
+        UpdateFlock(&flock, 1.0f/60.0f);
+
+        /* Two steps go by unrecorded, as when the recorder drops them */
+        if (s == 70) UpdateFlock(&flock, 1.0f/60.0f);
+        for (int id = 0; id < count; id++) {
+            positions[id] = flock.positionX[flock.slots[id]];
+            positions[count + id] = flock.positionY[flock.slots[id]];
+            positions[2*count + id] = flock.positionZ[flock.slots[id]];
+        }
+
+        size_t bytes = EncodeTrajectoryFrame(&encoder, flock.stepCounter, count, positions, frame, capacity);
+        munit_assert_size(bytes, >, 0);
+        munit_assert_size(bytes%4, ==, 0);
+        codedBytes += bytes;
+        TrajectoryFrameHeader header;
+        memcpy(&header, frame, sizeof(header));
+        munit_assert_uint(header.type, ==, (s%50 == 0)? TRAJECTORY_FRAME_KEY : TRAJECTORY_FRAME_PREDICTED);
+
+        const float *decoded = DecodeTrajectoryFrame(&decoder, frame, bytes, &step, &decodedCount);
+        munit_assert_not_null(decoded);
+        munit_assert_int(step, ==, flock.stepCounter);
+        munit_assert_int(decodedCount, ==, count);
+        /* A boid that strayed past the range decodes at its edge */
+        for (int v = 0; v < 3*count; v++) {
+            float range = COMPACT_POSITION_RANGE*bounds[v/count];
+            float expected = fminf(fmaxf(positions[v], -range), range);
+            munit_assert_float(fabsf(decoded[v] - expected), <=, error + 1e-5f);
+        }
+    }
+
+    /* Predicted from the last steps the flock is several times smaller than floats */
+    munit_assert_size(4*codedBytes, <, 120*3*(size_t)count*sizeof(float));
+
+    /* A new boid count starts over from a keyframe */
+    size_t bytes = EncodeTrajectoryFrame(&encoder, flock.stepCounter + 1, count - 1, positions, frame, capacity);
+    TrajectoryFrameHeader header;
+    memcpy(&header, frame, sizeof(header));
+    munit_assert_uint(header.type, ==, TRAJECTORY_FRAME_KEY);
+    munit_assert_not_null(DecodeTrajectoryFrame(&decoder, frame, bytes, &step, &decodedCount));
+    munit_assert_int(decodedCount, ==, count - 1);
+
+    /* Predicted frames need the frames before them, and the whole of themselves */
+    bytes = EncodeTrajectoryFrame(&encoder, flock.stepCounter + 2, count - 1, positions, frame, capacity);
+    munit_assert_null(DecodeTrajectoryFrame(&decoder, frame, bytes - 4, &step, &decodedCount));
+    UnloadTrajectoryCodec(&decoder);
+    InitTrajectoryCodec(&decoder, flock.boundsX, flock.boundsY, flock.boundsZ, 16, 50);
+    munit_assert_null(DecodeTrajectoryFrame(&decoder, frame, bytes, &step, &decodedCount));
+    munit_assert_size(EncodeTrajectoryFrame(&encoder, 0, count, positions, frame, 64), ==, 0);
+
+    /* A damaged frame whose residuals are escaped to the largest value decodes without overflow:
+       a keyframe of one boid at the top of the range, then on every axis 24 zeros, a one and
+       32 bits of 0xfffffffe */
+    const unsigned char damaged[24] = { 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0x7f, 0xff,
+                                        0xff, 0xff, 0x80, 0x00, 0x00, 0x3f, 0xff, 0xff, 0xff, 0xc0, 0x00, 0x00 };
+    const float top[3] = { 1e9f, 1e9f, 1e9f };
+    UnloadTrajectoryCodec(&encoder);
+    InitTrajectoryCodec(&encoder, flock.boundsX, flock.boundsY, flock.boundsZ, 16, 50);
+    bytes = EncodeTrajectoryFrame(&encoder, 1, 1, top, frame, capacity);
+    munit_assert_not_null(DecodeTrajectoryFrame(&decoder, frame, bytes, &step, &decodedCount));
+    header = (TrajectoryFrameHeader){ sizeof(header) + sizeof(damaged), 2, 1, TRAJECTORY_FRAME_PREDICTED };
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), damaged, sizeof(damaged));
+    munit_assert_not_null(DecodeTrajectoryFrame(&decoder, frame, header.bytes, &step, &decodedCount));
+
+    /* At the most bits the bound still holds, give or take the rounding of the decoded floats,
+       with x spread over the top of the range where a step is fewest of their ulps */
+    UnloadTrajectoryCodec(&encoder);
+    UnloadTrajectoryCodec(&decoder);
+    InitTrajectoryCodec(&encoder, flock.boundsX, flock.boundsY, flock.boundsZ, TRAJECTORY_MAX_BITS, 50);
+    InitTrajectoryCodec(&decoder, flock.boundsX, flock.boundsY, flock.boundsZ, TRAJECTORY_MAX_BITS, 50);
+    error = GetTrajectoryCodecError(&encoder);
+    for (int s = 0; s < 10; s++) {
+        UpdateFlock(&flock, 1.0f/60.0f);
+        for (int id = 0; id < count; id++) {
+            positions[id] = COMPACT_POSITION_RANGE*flock.boundsX*(1.0f - 0.001f*(float)((id + s)%count)/count);
+            positions[count + id] = flock.positionY[flock.slots[id]];
+            positions[2*count + id] = flock.positionZ[flock.slots[id]];
+        }
+
+        bytes = EncodeTrajectoryFrame(&encoder, flock.stepCounter, count, positions, frame, capacity);
+        const float *decoded = DecodeTrajectoryFrame(&decoder, frame, bytes, &step, &decodedCount);
+        munit_assert_not_null(decoded);
+        for (int v = 0; v < 3*count; v++) {
+            float range = COMPACT_POSITION_RANGE*bounds[v/count];
+            float expected = fminf(fmaxf(positions[v], -range), range);
+            munit_assert_float(fabsf(decoded[v] - expected), <=, error + range*FLT_EPSILON);
+        }
+    }
+
+    UnloadTrajectoryCodec(&encoder);
+    UnloadTrajectoryCodec(&decoder);
+    free(positions);
+    free(frame);
+    UnloadFlock(&flock);
+    return MUNIT_OK;
+}
+
+static MunitResult
+test_trace(const MunitParameter params[], void *user_data)
+{
+    const char *path = "test_trace.json";
+    ThreadPool pool;
+
+    /* Off, recording does nothing */
+    TraceBegin("untraced");
+    TraceEnd("untraced");
+
+    /* Every thread of the pool records its tasks and the phases in them, flushed part way
+     * through while the pool is still there */
+    munit_assert_true(StartTrace(path, 1 << 16));
+    NameTraceThread("main");
+    InitThreadPool(&pool, 4);
+    scatter_flock(&flock, 2000);
+    flock.threadPool = &pool;
+    for (int step = 0; step < 10; step++) {
+        UpdateFlock(&flock, 1.0f/60.0f);
+        if (step == 4) FlushTrace();
+    }
+    int jobs = (int)pool.generation;
+    int steals = 0;
+    for (int t = 0; t < pool.threadCount; t++) steals += pool.workers[t].stats.steals;
+    TraceBegin("last");
+    UnloadThreadPool(&pool);
+    UnloadFlock(&flock);
+    StopTrace();
+    munit_assert_int(GetTraceDropped(), ==, 0);
+    TraceEnd("last");
+
+    munit_assert_int(count_trace_lines(path, "["), ==, 1);
+    munit_assert_int(count_trace_lines(path, "]"), ==, 1);
+    munit_assert_int(count_trace_lines(path, "untraced"), ==, 0);
+    munit_assert_int(count_trace_lines(path, "\"name\":\"step\""), ==, 20);
+    munit_assert_int(count_trace_lines(path, "\"args\":{\"name\":\"main\"}"), ==, 1);
+    munit_assert_int(count_trace_lines(path, "\"ph\":\"M\""), ==, 4);
+    munit_assert_int(count_trace_lines(path, "\"name\":\"task\""), >, 20);
+
+    /* A span per run of tasks, not per grain: a task span per thread and job, and a stolen
+     * span per steal at most */
+    munit_assert_int(count_trace_lines(path, "\"name\":\"task\""), <=, 2*4*jobs);
+    munit_assert_int(count_trace_lines(path, "\"name\":\"stolen\""), <=, 2*steals);
+
+    /* Phases timed already are whole complete events */
+    munit_assert_int(count_trace_lines(path, "\"name\":\"neighbours\",\"ph\":\"X\""), ==, 10);
+    munit_assert_int(count_trace_lines(path, "\"name\":\"neighbours\",\"ph\":\"B\""), ==, 0);
+
+    /* Only the end recorded after the trace stopped is missing */
+    int begins = count_trace_lines(path, "\"ph\":\"B\"");
+    int ends = count_trace_lines(path, "\"ph\":\"E\"");
+    int completes = count_trace_lines(path, "\"ph\":\"X\"");
+    munit_assert_int(begins, ==, ends + 1);
+    munit_assert_int(GetTraceEventCount(), ==, 4 + begins + ends + completes);
+
+    /* A full buffer drops whole spans: a begin needs room for its end and the ends of the
+     * spans open around it, and everything inside a dropped span goes with it */
+    munit_assert_true(StartTrace(path, 1));
+    for (int e = 0; e < 1500; e++) TraceBegin("full");
+    TraceSpan("inside", 0.0, 1.0);
+    for (int e = 0; e < 1500; e++) TraceEnd("full");
+    FlushTrace();
+    munit_assert_int(GetTraceDropped(), ==, 2*(1500 - 512) + 1);
+    munit_assert_int(count_trace_lines(path, "\"name\":\"full\",\"ph\":\"B\""), ==, 512);
+    munit_assert_int(count_trace_lines(path, "\"name\":\"full\",\"ph\":\"E\""), ==, 512);
+
+    /* The flush makes room again, for complete events as much as there is */
+    for (int e = 0; e < 1500; e++) TraceSpan("span", 0.0, 1.0);
+    TraceEnd("unopened");
+    StopTrace();
+    munit_assert_int(count_trace_lines(path, "\"name\":\"span\",\"ph\":\"X\""), ==, 1024);
+    munit_assert_int(count_trace_lines(path, "\"dur\":1000000.000"), ==, 1024);
+    munit_assert_int(GetTraceDropped(), ==, 2*(1500 - 512) + 1 + (1500 - 1024) + 1);
+    remove(path);
+    return MUNIT_OK;
+}
+
 /* Creating a test suite is pretty simple.  First, you'll need an
  * array of tests: */
 static MunitTest test_suite_tests[] = {
-    {(char *)"/example/boids", test_boids, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
+    {(char *)"/example/boids", test_boids, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/arena/bump", test_arena, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/spatial_grid/neighbours", test_spatial_grid, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/spatial_grid/dynamic", test_dynamic_spatial_grid, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/spatial_grid/morton_sort", test_morton_sort, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/neighbour_kernel/match_scalar", test_neighbour_kernels, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/neighbour_kernel/compact", test_compact_kernels, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/flock/neighbours", test_flock_neighbours, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/flock/reorder", test_flock_reorder, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/flock/fused", test_flock_fused, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/flock/double_buffer", test_flock_double_buffer, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/flock/nearest", test_flock_nearest, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/flock/interpolate", test_flock_interpolate, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/flock/threads", test_flock_threads, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/flock/resize", test_flock_resize, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/flock/compact", test_flock_compact, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/flock/footprint", test_flock_footprint, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/flock/checksum", test_flock_checksum, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/flock/file", test_flock_file, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/recorder/stream", test_recorder, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/trajectory_codec/round_trip", test_trajectory_codec, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/thread_pool/chunks", test_thread_pool, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/simulation/triple_buffer", test_triple_buffer, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/simulation/thread", test_simulation_thread, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/frame_timer/phases", test_frame_timer, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {(char *)"/trace/events", test_trace, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL},
+    {NULL, NULL, NULL, NULL, MUNIT_TEST_OPTION_NONE, NULL}};
 
 /* Now we'll actually declare the test suite.  You could do this in
  * the main function, or on the heap, or whatever you want. */